@@ -0,0 +1,90 @@
+/**
+ * Copyright (C) 2020 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef __BOARD_H_
+#define __BOARD_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Most registers a board may have */
+#define CPLD_REG_MAX 32
+/* Longest board or register name, including the NUL */
+#define CPLD_NAME_MAX 16
+/* Board definitions read when no other file is given, if present */
+#define CPLD_BOARDS_DEFAULT "/etc/cpld-control/boards.conf"
+
+enum register_mode {
+	RW = 0U,
+	R = 1U,
+	W = 2U
+};
+
+enum protocol {
+	SPI = 0U,
+	IIC = 1U,
+	SMI = 2U
+};
+
+/**
+ * The register and flash field records have no pointers, so the tables
+ * of boards loaded from a file are used in place in the mapped image.
+ */
+struct register_context {
+	char name[CPLD_NAME_MAX];
+	uint64_t address;
+	uint8_t addr_length;
+	uint8_t val_length;
+	uint8_t mode;		/* enum register_mode */
+	uint8_t constant;	/* identity register, never changes on a board */
+	uint8_t self_clear;	/* does not read back what was written, e.g. RESET */
+};
+
+struct cpld_nv_field {
+	uint16_t address;	/* register */
+	uint8_t page;
+	uint8_t offset;		/* first byte in the page */
+	uint8_t length;		/* bytes stored, 0 ends the table */
+	uint64_t invert;	/* bits stored inverted, first byte in the LSB */
+};
+
+struct cpld_nv_layout {
+	uint16_t base[2];	/* flash address of each page */
+	uint16_t erase[2];	/* erase register of each page */
+	uint8_t erase_value;
+	uint16_t status;	/* flash status register, 0x01 when ready */
+	uint8_t unit;		/* bytes per program command */
+	const struct cpld_nv_field *field;
+	uint16_t span[2];	/* bytes kept in each page, at least up to the last field */
+	uint8_t read_lag;	/* SMI flash reads return the word of the previous frame */
+};
+
+struct cpld_board {
+	const char *name;
+	enum protocol protocol;
+	uint8_t iface;				/* FTDI channel, 1 for A, 2 for B */
+	uint16_t product_id;
+	uint32_t i2c_khz;			/* default SCL frequency of I2C boards */
+	const struct register_context *reg;	/* ascending addresses */
+	int count;
+	const uint8_t *by_name;			/* register indexes in name order */
+	const struct cpld_nv_layout *nv;	/* NULL without non-volatile registers */
+};
+
+void cpld_board_set_file(const char *path);
+const struct cpld_board *cpld_board_find(const char *name);
+int cpld_board_reg(const struct cpld_board *board, uint64_t address);
+int cpld_board_reg_name(const struct cpld_board *board, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __BOARD_H_ */
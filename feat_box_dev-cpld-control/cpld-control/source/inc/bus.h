@@ -0,0 +1,30 @@
+/**
+ * Copyright (C) 2020 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef __BUS_H_
+#define __BUS_H_
+
+#include <stdint.h>
+
+enum bus_op_type {
+	BUS_READ = 0U,
+	BUS_WRITE = 1U,
+	BUS_DELAY = 2U
+};
+
+/* One access of a batch run by i2c_batch, spi_batch or smi_transfer */
+struct bus_op {
+	uint8_t type;		/* enum bus_op_type */
+	uint64_t address;
+	uint8_t addr_length;
+	uint8_t *value;		/* data to write, or read data */
+	uint8_t val_length;
+	uint32_t delay_us;	/* idle time of BUS_DELAY */
+	uint8_t status;		/* 0 once done, NACKs or failure otherwise */
+};
+
+#endif /* __BUS_H_ */
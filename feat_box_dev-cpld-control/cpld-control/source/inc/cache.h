@@ -0,0 +1,21 @@
+/**
+ * Copyright (C) 2020 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef __CACHE_H_
+#define __CACHE_H_
+
+#include "cpld.h"
+
+/* Register that validates the cache, read from the board every session */
+#define CPLD_CACHE_KEY "VERSION"
+
+const char *cpld_cache_get_dir(void);
+void cpld_cache_open(struct cpld_context *cpld);
+void cpld_cache_close(struct cpld_context *cpld);
+void cpld_cache_invalidate(struct cpld_context *cpld);
+
+#endif /* __CACHE_H_ */
@@ -0,0 +1,21 @@
+/**
+ * Copyright (C) 2020 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef __COMMAND_H_
+#define __COMMAND_H_
+
+#include "cpld.h"
+
+void usage(char *pn);
+void cpld_set_output(FILE *out);
+FILE *cpld_output(void);
+uint8_t cpld_list(int json);
+int cpld_check_args(int argc, char *argv[]);
+struct cpld_context *cpld_command_open(char *board, char *serial);
+int cpld_command(struct cpld_context *cpld, int argc, char *argv[]);
+
+#endif /* __COMMAND_H_ */
@@ -8,9 +8,11 @@
 #ifndef __CPLD_H_
 #define __CPLD_H_
 
+#include "libcpld.h"
 #include "i2c.h"
 #include "spi.h"
 #include "smi.h"
+#include "flash.h"
 #include <libusb-1.0/libusb.h>
 
 #define VENDOR 0x0403
@@ -23,46 +25,35 @@
 
 #define CPLD_SLAVE_ADDR 0xE0
 
-enum register_mode {
-	RW = 0U,
-	R = 1U,
-	W = 2U
-};
-
-enum protocol {
-	SPI = 0U,
-	IIC = 1U,
-	SMI = 2U
-};
-
-struct register_context {
-	char *name;
-	uint64_t address;
-	uint8_t addr_length;
-	uint64_t value;
-	uint8_t val_length;
-	enum register_mode mode;
-	struct register_context *pnext;
-};
+/* Bit of a register in the register masks of the CPLD structure */
+#define CPLD_REG_BIT(cpld, r) (1U << ((r) - (cpld)->reg))
 
 struct cpld_context {
 	struct mpsse_context *mpsse;
-	struct register_context *reg;
-	char *board_name;
+	const struct cpld_board *board;
+	const struct register_context *reg;	/* register map of the board */
+	uint64_t value[CPLD_REG_MAX];		/* last value of each register */
+	uint32_t cached;	/* registers served from value[] without a read */
+	uint32_t fresh;		/* registers read from the board this session */
+	char board_name[CPLD_NAME_MAX];
+	char serial[32];
 	uint16_t product_id;
 	enum protocol protocol;
+	uint8_t i2c_engine;	/* enum i2c_engine */
+	uint32_t i2c_khz;	/* SCL frequency of I2C boards */
+	uint16_t spi_hold;	/* extra samples of each SCK level */
+	uint8_t verify;		/* enum cpld_verify */
+	uint8_t nv_force;	/* reprogram pages that hold the values */
+	char *cache_dir;	/* register cache, NULL when off */
+	struct cpld_log_handler log;
+	int removed;		/* set when the board is unplugged, atomic */
+	struct cpld_flash_hist flash[2];	/* erase and program latency */
+	struct cpld_flash_poll poll[2];		/* erase and program schedule */
 };
 
-struct cpld_context *cpld_init(char *board, char *serial);
-uint8_t cpld_list(void);
-uint8_t cpld_change_serial(struct cpld_context *cpld, char *new_serial);
-uint8_t cpld_read(struct cpld_context *cpld, uint64_t address);
-uint8_t cpld_write(struct cpld_context *cpld, uint64_t address, uint8_t *value);
-uint8_t cpld_write_nonvolatile(struct cpld_context *cpld, uint64_t address, uint8_t *value);
-uint8_t cpld_dump(struct cpld_context *cpld, uint64_t address);
-
-uint8_t cpld_get_info(struct cpld_context *cpld);
-struct register_context *cpld_get_reg(struct cpld_context *cpld, uint64_t address);
-void cpld_deinit(struct cpld_context *cpld);
+int cpld_verify(struct cpld_context *cpld, const uint64_t *address, const uint64_t *value,
+		int count, uint32_t *mask);
+uint8_t cpld_read_span(struct cpld_context *cpld, uint64_t address, uint8_t addr_length,
+		       uint8_t *value, uint8_t length);
 
 #endif /* __CPLD_H_ */
@@ -0,0 +1,33 @@
+/**
+ * Copyright (C) 2020 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef __DAEMON_H_
+#define __DAEMON_H_
+
+#include "cpld.h"
+
+/* Socket of the daemon in $XDG_RUNTIME_DIR when no other path is given */
+#define CPLD_SOCKET_NAME "cpld-control.sock"
+
+/* Seconds a client may take to send its request */
+#define CPLD_REQUEST_TIMEOUT 5
+
+/* Largest request accepted by the daemon (NUL separated argv) */
+#define CPLD_REQUEST_MAX 65536
+
+struct cpld_session {
+	char *board;
+	char *serial;
+	struct cpld_context *cpld;
+	struct cpld_session *pnext;
+};
+
+int cpld_socket_default(char *path, size_t size);
+int cpld_daemon(char *path);
+int cpld_client(char *path, int argc, char *argv[]);
+
+#endif /* __DAEMON_H_ */
@@ -0,0 +1,55 @@
+/**
+ * Copyright (C) 2020 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef __FLASH_H_
+#define __FLASH_H_
+
+#include "libcpld.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Latency buckets, bucket i counts latencies below 2^(i + 4) us */
+#define CPLD_FLASH_BUCKETS 20
+
+/* Default schedules: first wait, longest wait and deadline */
+#define CPLD_ERASE_WAIT_US	2000
+#define CPLD_ERASE_MAX_US	50000
+#define CPLD_ERASE_DEADLINE_MS	5000
+#define CPLD_PROGRAM_WAIT_US	50
+#define CPLD_PROGRAM_MAX_US	5000
+#define CPLD_PROGRAM_DEADLINE_MS 500
+
+struct cpld_flash_hist {
+	uint32_t count;
+	uint32_t timeout;
+	uint32_t polls;		/* status reads */
+	uint32_t min_us;
+	uint32_t max_us;
+	uint32_t avg_us;	/* moving average, seeds the first wait */
+	uint64_t total_us;
+	uint32_t bucket[CPLD_FLASH_BUCKETS];
+};
+
+/* Polling schedule of one flash command */
+struct cpld_flash_poll {
+	uint32_t wait_us;	/* first wait */
+	uint32_t max_us;	/* longest wait */
+	uint32_t deadline_ms;
+};
+
+/* Returns 1 when the flash is ready, 0 while busy, -1 on bus error */
+typedef int (*cpld_flash_ready)(void *arg);
+
+void cpld_flash_get_poll(struct cpld_flash_poll *poll);
+void cpld_flash_start(struct timespec *start);
+int cpld_flash_wait(struct cpld_flash_hist *hist, const struct cpld_flash_poll *poll,
+		    enum cpld_flash_op op, struct timespec *start, cpld_flash_ready ready,
+		    void *arg);
+void cpld_flash_print(FILE *out, const char *name, const struct cpld_flash_hist *hist);
+
+#endif /* __FLASH_H_ */
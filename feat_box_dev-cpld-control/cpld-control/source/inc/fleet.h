@@ -0,0 +1,23 @@
+/**
+ * Copyright (C) 2020 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef __FLEET_H_
+#define __FLEET_H_
+
+#include "cpld.h"
+
+/* Most boards handled by one command */
+#define CPLD_FLEET_MAX 128
+
+/* Where the workers get their board from, and give it back */
+typedef struct cpld_context *(*cpld_fleet_open)(char *board, char *serial);
+typedef void (*cpld_fleet_close)(struct cpld_context *cpld);
+
+int cpld_is_fleet(char *serial);
+int cpld_fleet(int argc, char *argv[], cpld_fleet_open open, cpld_fleet_close close);
+
+#endif /* __FLEET_H_ */
@@ -8,12 +8,15 @@
 #ifndef __I2C_H_
 #define __I2C_H_
 
+#include "bus.h"
+#include "libcpld.h"
 #include <mpsse.h>
 #include <stdio.h>
 
 #if LIBFTDI1 == 1
 #include <unistd.h>
 #endif
+#include <time.h>
 
 #define SDA 7
 #define SCL 6
@@ -24,12 +27,24 @@
 #define ACK 0
 #define NAK 1
 
-#define TIME 100
+/* SCL frequency in kHz when the board sets none */
+#define I2C_KHZ		100
 
-void i2c_delay(void);
+/* USB transfers of one bit-bang transaction */
+struct i2c_stats {
+	uint32_t transfers;	/* direction writes and pin reads sent */
+	uint32_t saved;		/* direction writes skipped, already in place */
+};
 
-void i2c_init(struct mpsse_context *mpsse);
+void i2c_set_stats(int enable);
+struct i2c_stats i2c_get_stats(void);
 
+void i2c_delay(struct mpsse_context *mpsse);
+
+int i2c_init(struct mpsse_context *mpsse, enum i2c_engine engine, uint32_t khz);
+
+void i2c_release_sda(struct mpsse_context *mpsse);
+void i2c_release_scl(struct mpsse_context *mpsse);
 uint8_t i2c_read_sda(struct mpsse_context *mpsse);
 uint8_t i2c_read_scl(struct mpsse_context *mpsse);
 void i2c_clear_sda(struct mpsse_context *mpsse);
@@ -50,5 +65,25 @@ uint8_t i2c_write_data(struct mpsse_context *mpsse, uint8_t device_address,
 uint8_t i2c_read_data(struct mpsse_context *mpsse, uint8_t device_address,
 		      uint64_t address, uint8_t addr_length,
 		      uint8_t *value, uint8_t val_length);
+uint8_t i2c_batch(struct mpsse_context *mpsse, uint8_t device_address,
+		  struct bus_op *op, int count);
+
+int i2c_syncbb_init(struct mpsse_context *mpsse, uint32_t khz);
+uint8_t i2c_syncbb_write_data(struct mpsse_context *mpsse, uint8_t device_address,
+			      uint64_t address, uint8_t addr_length,
+			      uint8_t *value, uint8_t val_length);
+uint8_t i2c_syncbb_read_data(struct mpsse_context *mpsse, uint8_t device_address,
+			     uint64_t address, uint8_t addr_length,
+			     uint8_t *value, uint8_t val_length);
+
+int i2c_mpsse_init(struct mpsse_context *mpsse, uint32_t khz);
+uint8_t i2c_mpsse_write_data(struct mpsse_context *mpsse, uint8_t device_address,
+			     uint64_t address, uint8_t addr_length,
+			     uint8_t *value, uint8_t val_length);
+uint8_t i2c_mpsse_read_data(struct mpsse_context *mpsse, uint8_t device_address,
+			    uint64_t address, uint8_t addr_length,
+			    uint8_t *value, uint8_t val_length);
+uint8_t i2c_mpsse_batch(struct mpsse_context *mpsse, uint8_t device_address,
+			struct bus_op *op, int count);
 
 #endif /* __I2C_H_ */
@@ -0,0 +1,149 @@
+/**
+ * Copyright (C) 2020-2021 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef __LIBCPLD_H_
+#define __LIBCPLD_H_
+
+#include "board.h"
+#include "log.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * libcpld
+ *
+ * Register access to the CPLD of a board through its FTDI port. A board
+ * is opened into a context of its own. A context is used by one thread at
+ * a time, contexts of different boards may run in parallel threads.
+ *
+ * Nothing is printed: values are stored in buffers of the caller, results
+ * are returned as enum cpld_error and messages go to the log handler of
+ * the context (see log.h).
+ *
+ * The settings of a context (I2C engine and speed, SPI hold, flash poll
+ * schedule, cache directory, verification) are copied from the defaults
+ * when it is opened and may then be changed for that context alone. The
+ * setters take NULL as context to change the defaults. Only the board
+ * file is process wide.
+ */
+
+/* Most operations of one transaction */
+#define CPLD_TXN_MAX 64
+
+/* Range of the I2C bus speed, kHz */
+#define I2C_KHZ_MIN	10
+#define I2C_KHZ_MAX	1000
+/* Most extra samples an SPI clock level is held for */
+#define SPI_HOLD_MAX	16
+
+struct cpld_context;
+
+enum cpld_error {
+	CPLD_OK = 0U,
+	CPLD_ERR_BOARD = 1U,		/* unknown board name */
+	CPLD_ERR_DEVICE = 2U,		/* FTDI device not found or failed */
+	CPLD_ERR_ADDRESS = 3U,		/* no register at the address */
+	CPLD_ERR_MODE = 4U,		/* register is read or write only */
+	CPLD_ERR_NV = 5U,		/* register is not kept in the flash */
+	CPLD_ERR_BUS = 6U,		/* transfer failed or was not acknowledged */
+	CPLD_ERR_VERIFY = 7U,		/* register does not read back its value */
+	CPLD_ERR_REMOVED = 8U,		/* board unplugged */
+	CPLD_ERR_LIMIT = 9U,		/* too many operations in a transaction */
+	CPLD_ERR_NOMEM = 10U,
+	CPLD_ERR_RANGE = 11U		/* setting out of range */
+};
+
+/* Registers read back after a write */
+enum cpld_verify {
+	CPLD_VERIFY_WRITTEN = 0U,	/* the written registers, compared */
+	CPLD_VERIFY_FULL = 1U,		/* all registers, the written ones compared */
+	CPLD_VERIFY_NONE = 2U
+};
+
+/* What a non-volatile write did with a register */
+enum cpld_nv_state {
+	CPLD_NV_SKIPPED = 0U,		/* invalid pair, not written */
+	CPLD_NV_UNCHANGED = 1U,		/* the flash already held the value */
+	CPLD_NV_WRITTEN = 2U,
+	CPLD_NV_FAILED = 3U
+};
+
+enum i2c_engine {
+	I2C_ENGINE_BITBANG = 0U,	/* one USB transfer per pin change */
+	I2C_ENGINE_SYNCBB = 1U,		/* whole transaction as a sample buffer */
+	I2C_ENGINE_MPSSE = 2U		/* whole transaction as MPSSE commands */
+};
+
+enum cpld_flash_op {
+	CPLD_FLASH_ERASE = 0U,
+	CPLD_FLASH_PROGRAM = 1U
+};
+
+enum cpld_txn_type {
+	CPLD_TXN_READ = 0U,
+	CPLD_TXN_WRITE = 1U,
+	CPLD_TXN_DELAY = 2U
+};
+
+struct cpld_txn_op {
+	uint8_t type;				/* enum cpld_txn_type */
+	const struct register_context *reg;
+	uint64_t value;				/* value to write */
+	uint64_t *result;			/* caller buffer of a read */
+	uint32_t delay_us;
+	uint8_t status;				/* 0 once done */
+};
+
+/* Register operations queued to run in one bus session */
+struct cpld_txn {
+	struct cpld_context *cpld;
+	struct cpld_txn_op op[CPLD_TXN_MAX];
+	int count;
+	uint8_t error;		/* first operation that could not be queued */
+};
+
+int cpld_open(struct cpld_context **cpld, const char *board, const char *serial);
+void cpld_close(struct cpld_context *cpld);
+const char *cpld_strerror(int error);
+void cpld_set_log(struct cpld_context *cpld, cpld_log_fn fn, void *arg);
+void cpld_set_verify(struct cpld_context *cpld, enum cpld_verify verify);
+void cpld_nv_set_force(struct cpld_context *cpld, uint8_t force);
+int cpld_set_i2c_engine(struct cpld_context *cpld, enum i2c_engine engine);
+int cpld_set_i2c_khz(struct cpld_context *cpld, uint32_t khz);
+int cpld_set_spi_hold(struct cpld_context *cpld, uint16_t hold);
+void cpld_flash_set_poll(struct cpld_context *cpld, enum cpld_flash_op op, uint32_t wait_us,
+			 uint32_t deadline_ms);
+void cpld_cache_set_dir(struct cpld_context *cpld, const char *dir);
+int cpld_list_serials(const char *board, char (*serial)[32], int max);
+
+const struct register_context *cpld_registers(struct cpld_context *cpld, int *count);
+const struct register_context *cpld_get_reg(struct cpld_context *cpld, uint64_t address);
+const struct register_context *cpld_find_reg(struct cpld_context *cpld, const char *name);
+
+int cpld_reg_read(struct cpld_context *cpld, uint64_t address, uint64_t *value);
+int cpld_reg_dump(struct cpld_context *cpld, uint64_t *value, uint32_t *valid);
+int cpld_reg_write(struct cpld_context *cpld, const uint64_t *address, const uint64_t *value,
+		   int count, uint8_t *done, uint64_t *readback, uint32_t *valid);
+int cpld_reg_write_nv(struct cpld_context *cpld, const uint64_t *address,
+		      const uint64_t *value, int count, uint8_t *state,
+		      uint64_t *readback, uint32_t *valid);
+int cpld_change_serial(struct cpld_context *cpld, const char *serial);
+
+void cpld_txn_begin(struct cpld_context *cpld, struct cpld_txn *txn);
+int cpld_txn_read(struct cpld_txn *txn, uint64_t address, uint64_t *value);
+int cpld_txn_write(struct cpld_txn *txn, uint64_t address, uint64_t value);
+int cpld_txn_delay(struct cpld_txn *txn, uint32_t us);
+int cpld_txn_commit(struct cpld_txn *txn);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBCPLD_H_ */
@@ -0,0 +1,36 @@
+/**
+ * Copyright (C) 2020 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef __LOG_H_
+#define __LOG_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum cpld_log_level {
+	CPLD_LOG_ERROR = 0U,
+	CPLD_LOG_INFO = 1U
+};
+
+/* Receives one message, without a trailing newline */
+typedef void (*cpld_log_fn)(void *arg, enum cpld_log_level level, const char *msg);
+
+struct cpld_log_handler {
+	cpld_log_fn fn;		/* NULL for the default handler */
+	void *arg;
+};
+
+void cpld_log_set_default(cpld_log_fn fn, void *arg);
+void cpld_log(const struct cpld_log_handler *handler, enum cpld_log_level level,
+	      const char *fmt, ...);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LOG_H_ */
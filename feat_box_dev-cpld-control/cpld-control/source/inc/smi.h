@@ -20,14 +20,30 @@
 #define PIN_MDI  INVERT_CTS
 #define PIN_MDO  INVERT_DTR
 
+/* Samples of one frame: 66 MDC periods of two samples */
+#define SMI_FRAME_SIZE	132
+/* Samples of a frame without the 32-bit preamble */
+#define SMI_SHORT_SIZE	68
+/* Samples per USB transfer, one libftdi chunk */
+#define SMI_BURST	4096
+
+struct smi_frame {
+	uint16_t address;
+	uint16_t value;		/* written value, or read value after the transfer */
+	uint8_t write;
+};
+
 int smi_init(struct mpsse_context *mpsse);
 
 int smi_read(struct mpsse_context *mpsse, uint64_t address, uint8_t addr_length,
 	     uint8_t *value, uint8_t val_length);
+int smi_read_flash(struct mpsse_context *mpsse, uint64_t address, uint8_t addr_length,
+		   uint8_t *value, uint8_t val_length);
 int smi_write(struct mpsse_context *mpsse, uint64_t address, uint8_t addr_length,
 	      uint8_t *value, uint8_t val_length);
 
-int smi_read_frame(struct mpsse_context *mpsse, uint16_t address, uint8_t *value);
-int smi_write_frame(struct mpsse_context *mpsse, uint16_t address, uint16_t value);
+int smi_encode(uint8_t *buffer, const struct smi_frame *frame, uint8_t preamble);
+int smi_transfer(struct mpsse_context *mpsse, struct smi_frame *frame, int count);
+int smi_detect_preamble(struct mpsse_context *mpsse, uint16_t address);
 
 #endif /* __SMI_H_ */
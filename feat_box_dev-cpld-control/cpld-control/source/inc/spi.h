@@ -8,6 +8,8 @@
 #ifndef __SPI_H_
 #define __SPI_H_
 
+#include "bus.h"
+#include "libcpld.h"
 #include <mpsse.h>
 #include <stdio.h>
 
@@ -21,10 +23,18 @@
 #define PIN_SCK	  INVERT_RTS
 #define PIN_SSTBZ INVERT_CTS
 
-int spi_init(struct mpsse_context *mpsse);
+/* Extra samples each SCK level is held for (one sample is ~4.3 us) */
+#define SPI_HOLD	1
+/* Idle samples after a strobe, ~100 us at 57600 baud */
+#define SPI_SETTLE	24
+/* Samples of a batch kept on the stack, longer batches go to the heap */
+#define SPI_STACK	4096
+
+int spi_init(struct mpsse_context *mpsse, uint16_t hold);
 int spi_read(struct mpsse_context *mpsse, uint64_t address, uint8_t addr_length,
 	     uint8_t *value, uint8_t val_length);
 int spi_write(struct mpsse_context *mpsse, uint64_t address, uint8_t addr_length,
 	      uint8_t *value, uint8_t val_length);
+uint8_t spi_batch(struct mpsse_context *mpsse, struct bus_op *op, int count);
 
 #endif /* __SPI_H_ */
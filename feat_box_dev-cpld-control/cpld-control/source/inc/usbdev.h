@@ -0,0 +1,44 @@
+/**
+ * Copyright (C) 2020 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef __USBDEV_H_
+#define __USBDEV_H_
+
+#include <stdint.h>
+
+/* Most FTDI devices remembered by the discovery cache */
+#define CPLD_USB_MAX 256
+
+/* Hash buckets of the serial lookup table */
+#define CPLD_USB_HASH 64
+
+/* USB 3.0 allows up to 7 levels of ports */
+#define CPLD_USB_PORTS 7
+
+struct cpld_usb_device {
+	uint16_t vendor;
+	uint16_t product;
+	char serial[32];
+	uint8_t bus;
+	uint8_t address;
+	uint8_t port[CPLD_USB_PORTS];
+	int port_depth;
+	uint8_t failed;		/* serial could not be read, tried again on the next scan */
+};
+
+int cpld_usb_find(uint16_t product, const char *serial, struct cpld_usb_device *dev);
+int cpld_usb_scan(uint16_t product, struct cpld_usb_device *dev, int max);
+void cpld_usb_forget(const struct cpld_usb_device *dev);
+int cpld_usb_reset_unnamed(void);
+void cpld_usb_port(const struct cpld_usb_device *dev, char *buf, int size);
+
+void cpld_usb_attach(const struct cpld_usb_device *dev, int *removed);
+void cpld_usb_detach(int *removed);
+int cpld_usb_monitor_start(void);
+void cpld_usb_monitor_stop(void);
+
+#endif /* __USBDEV_H_ */
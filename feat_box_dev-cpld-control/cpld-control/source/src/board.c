@@ -0,0 +1,1047 @@
+/**
+ * Copyright (C) 2020 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include "board.h"
+#include "libcpld.h"
+#include "log.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Register maps of the supported boards.
+ *
+ * The built-in tables are read only and shared by every opened board.
+ * Registers are listed in ascending address order, which is what the
+ * address lookup searches and the dump reads in spans. The next to last
+ * column marks registers that never change on a board (identity), which
+ * may be kept in the register cache. The last column marks registers that
+ * clear themselves after a write, which are not compared when written
+ * registers are read back.
+ *
+ * More boards, or new revisions of the built-in ones, come from a board
+ * definition file. Boards of the file are found before the built-in ones.
+ * The file is compiled into a binary image kept next to it as
+ * <file>.cache, which is mapped as is on the next start. The image is
+ * rebuilt when the file changes (inode, size or modification time). If
+ * the cache cannot be written the file is compiled on every start.
+ *
+ * File format, one statement per line, '#' starts a comment:
+ *
+ *	board <name>
+ *	protocol <spi|i2c|smi>
+ *	product <FTDI product id>
+ *	interface <A|B|C|D>		(default B for i2c, A otherwise)
+ *	i2c_khz <kHz>			(10 to 1000, default 100)
+ *	reg <name> <address> <address bytes> <value bytes> <R|W|RW> [const|self_clear]
+ *	nv_page <0|1> <flash base> <erase register> [<bytes kept>]
+ *	nv_erase <erase value>
+ *	nv_status <flash status register>
+ *	nv_unit <bytes per program command>
+ *	nv_read_lag			(smi reads from the flash come one frame late)
+ *	nv <register name> <page> <offset> <bytes> [<inverted bits>]
+ *
+ * Every statement after "board" belongs to that board. Numbers are
+ * decimal or 0x prefixed hex.
+ */
+
+/* H3/M3 Starter Kit */
+static const struct register_context cpld_reg_h3sk[] = {
+	{ "MODE",         0x00,   1, 4, RW, 0, 0 },
+	{ "MUX",          0x02,   1, 4, RW, 0, 0 },
+	{ "DIPSW6",       0x08,   1, 4, R,  0, 0 },
+	{ "RESET",        0x80,   1, 4, RW, 0, 1 },
+	{ "VERSION",      0xFF,   1, 4, R,  0, 0 },
+};
+
+/* V3U */
+static const struct register_context cpld_reg_v3u[] = {
+	{ "PRODUCT",      0x0000, 2, 4, R,  1, 0 },
+	{ "VERSION",      0x0004, 2, 4, R,  0, 0 },
+	{ "MODE_SET",     0x0008, 2, 8, RW, 0, 0 },
+	{ "MODE_NEXT",    0x0010, 2, 8, R,  0, 0 },
+	{ "MODE_LAST",    0x0018, 2, 8, R,  0, 0 },
+	{ "DIPSW50",      0x0020, 2, 1, R,  0, 0 },
+	{ "I2C_ADDR",     0x0022, 2, 1, RW, 0, 0 },
+	{ "RESET",        0x0024, 2, 1, RW, 0, 1 },
+	{ "POWER_CFG",    0x0025, 2, 1, RW, 0, 0 },
+	{ "PERI_CFG",     0x0030, 2, 1, RW, 0, 0 },
+	{ "UART_CFG",     0x0036, 2, 1, RW, 0, 0 },
+	{ "UART_STATUS",  0x0037, 2, 1, R,  0, 0 },
+	{ "CNT_POWER",    0x0080, 2, 4, R,  0, 0 },
+	{ "CNT_RESET",    0x0084, 2, 4, R,  0, 0 },
+	{ "PCB_VERSION",  0x1000, 2, 2, R,  1, 0 },
+	{ "SOC_VERSION",  0x1002, 2, 2, R,  1, 0 },
+	{ "PCB_SN",       0x1004, 2, 4, R,  1, 0 },
+	{ "MAC",          0x1008, 2, 6, R,  1, 0 },
+};
+
+/* V3H Starter Kit */
+static const struct register_context cpld_reg_v3hsk[] = {
+	{ "PRODUCT",      0x0000, 2, 4, R,  1, 0 },
+	{ "VERSION",      0x0004, 2, 4, R,  0, 0 },
+	{ "MODE_SET",     0x0008, 2, 5, RW, 0, 0 },
+	{ "MODE_NEXT",    0x0010, 2, 5, R,  0, 0 },
+	{ "MODE_LAST",    0x0018, 2, 5, R,  0, 0 },
+	{ "DIPSW4",       0x0020, 2, 1, R,  0, 0 },
+	{ "DIPSW5",       0x0021, 2, 1, R,  0, 0 },
+	{ "I2C_ADDR",     0x0022, 2, 1, RW, 0, 0 },
+	{ "RESET",        0x0024, 2, 1, RW, 0, 1 },
+	{ "POWER_CFG",    0x0025, 2, 1, RW, 0, 0 },
+	{ "PMIC_CFG",     0x0026, 2, 1, RW, 0, 0 },
+	{ "PCIE_CLK_CFG", 0x0027, 2, 1, RW, 0, 0 },
+	{ "PERI_CFG",     0x0030, 2, 4, RW, 0, 0 },
+	{ "LEDS",         0x0034, 2, 1, RW, 0, 0 },
+	{ "LEDS_CFG",     0x0035, 2, 1, RW, 0, 0 },
+	{ "UART_CFG",     0x0036, 2, 1, RW, 0, 0 },
+	{ "UART_STATUS",  0x0037, 2, 1, R,  0, 0 },
+	{ "PCB_VERSION",  0x1000, 2, 2, R,  1, 0 },
+	{ "SOC_VERSION",  0x1002, 2, 2, R,  1, 0 },
+	{ "PCB_SN",       0x1004, 2, 2, R,  1, 0 },
+	{ "MAC",          0x1008, 2, 6, R,  1, 0 },
+};
+
+/* V3M Starter Kit */
+static const struct register_context cpld_reg_v3msk[] = {
+	{ "PRODUCT",      0x000,  2, 4, R,  1, 0 },
+	{ "VERSION",      0x002,  2, 4, R,  0, 0 },
+	{ "MODE_SET",     0x004,  2, 4, RW, 0, 0 },
+	{ "MODE_APPLIED", 0x006,  2, 4, R,  0, 0 },
+	{ "DIPSW",        0x008,  2, 2, R,  0, 0 },
+	{ "RESET",        0x00A,  2, 2, RW, 0, 1 },
+	{ "POWER_CFG",    0x00B,  2, 2, RW, 0, 0 },
+	{ "PERI_CFG",     0x00C,  2, 4, RW, 0, 0 },
+	{ "LEDS",         0x00E,  2, 4, RW, 0, 0 },
+	{ "PCB_VERSION",  0x300,  2, 2, R,  1, 0 },
+	{ "SOC_VERSION",  0x301,  2, 2, R,  1, 0 },
+	{ "PCB_SN",       0x302,  2, 4, R,  1, 0 },
+};
+
+/* S4 */
+static const struct register_context cpld_reg_s4[] = {
+	{ "PRODUCT",      0x0000, 2, 4, R,  1, 0 },
+	{ "VERSION",      0x0004, 2, 4, R,  0, 0 },
+	{ "MODE_SET",     0x0008, 2, 8, RW, 0, 0 },
+	{ "MODE_NEXT",    0x0010, 2, 8, R,  0, 0 },
+	{ "MODE_LAST",    0x0018, 2, 8, R,  0, 0 },
+	{ "DIPSW8",       0x0020, 2, 1, R,  0, 0 },
+	{ "I2C_ADDR",     0x0022, 2, 1, RW, 0, 0 },
+	{ "RESET",        0x0024, 2, 1, RW, 0, 1 },
+	{ "POWER_CFG",    0x0025, 2, 1, RW, 0, 0 },
+	{ "PERI_CFG",     0x0030, 2, 1, RW, 0, 0 },
+	{ "UART_CFG",     0x0036, 2, 1, RW, 0, 0 },
+	{ "UART_STATUS",  0x0037, 2, 1, R,  0, 0 },
+	{ "CNT_POWER",    0x0080, 2, 4, R,  0, 0 },
+	{ "CNT_RESET",    0x0084, 2, 4, R,  0, 0 },
+	{ "PCB_VERSION",  0x1000, 2, 2, R,  1, 0 },
+	{ "SOC_VERSION",  0x1002, 2, 2, R,  1, 0 },
+	{ "PCB_SN",       0x1004, 2, 4, R,  1, 0 },
+	{ "MAC",          0x1008, 2, 6, R,  1, 0 },
+};
+
+static const struct cpld_nv_field cpld_nv_v3u[] = {
+	{ 0x0008, 0,  8, 8, 0 },	// MODE_SET
+	{ 0x0025, 0, 37, 1, 0 },	// POWER_CFG
+	{ 0x0030, 0, 48, 1, 0 },	// PERI_CFG
+	{ 0x0036, 0, 54, 1, 0 },	// UART_CFG
+	{ 0x1000, 1,  0, 2, 0 },	// PCB_VERSION
+	{ 0x1002, 1,  2, 2, 0 },	// SOC_VERSION
+	{ 0x1004, 1,  4, 4, 0 },	// PCB_SN
+	{ 0x1008, 1,  8, 6, 0 },	// MAC
+	{ 0 }
+};
+
+static const struct cpld_nv_field cpld_nv_v3hsk[] = {
+	{ 0x0008, 0,  8, 5, 0 },	// MODE_SET
+	{ 0x0025, 0, 37, 1, 0 },	// POWER_CFG
+	{ 0x0026, 0, 38, 1, 0 },	// PMIC_CFG
+	{ 0x0027, 0, 39, 1, 0 },	// PCIE_CLK_CFG
+	{ 0x0030, 0, 48, 1, 0 },	// PERI_CFG
+	{ 0x0034, 0, 52, 1, 0 },	// LEDS
+	{ 0x0035, 0, 53, 1, 0 },	// LEDS_CFG
+	{ 0x0036, 0, 54, 1, 0 },	// UART_CFG
+	{ 0x1000, 1,  0, 2, 0 },	// PCB_VERSION
+	{ 0x1002, 1,  2, 2, 0 },	// SOC_VERSION
+	{ 0x1004, 1,  4, 2, 0 },	// PCB_SN
+	{ 0x1008, 1,  8, 6, 0 },	// MAC
+	{ 0 }
+};
+
+/* Page 0 of the V3M Starter Kit is stored inverted */
+static const struct cpld_nv_field cpld_nv_v3msk[] = {
+	{ 0x004, 0,  8, 4, 0xFFFFFFFF },	// MODE_SET
+	{ 0x00B, 0, 22, 2, 0x7FFF },		// POWER_CFG, bit 15 as is
+	{ 0x00C, 0, 24, 4, 0xFFFFFFFF },	// PERI_CFG
+	{ 0x00E, 0, 28, 2, 0xFFFF },		// LEDS
+	{ 0x300, 1,  0, 2, 0 },			// PCB_VERSION
+	{ 0x301, 1,  2, 2, 0 },			// SOC_VERSION
+	{ 0x302, 1,  4, 4, 0 },			// PCB_SN
+	{ 0 }
+};
+
+static const struct cpld_nv_layout cpld_nv_i2c_v3u = {
+	{ 0x0800, 0x1000 }, { 0x07F0, 0x07F1 }, 0x01, 0x07F0, 4, cpld_nv_v3u, { 60, 0 }, 0
+};
+
+static const struct cpld_nv_layout cpld_nv_i2c_v3hsk = {
+	{ 0x0800, 0x1000 }, { 0x07F0, 0x07F1 }, 0x01, 0x07F0, 4, cpld_nv_v3hsk, { 60, 0 }, 0
+};
+
+static const struct cpld_nv_layout cpld_nv_smi_v3msk = {
+	{ 0x200, 0x300 }, { 0x1FE, 0x1FF }, 0x00, 0x009, 2, cpld_nv_v3msk, { 0, 0 }, 1
+};
+
+#define CPLD_COUNT(table) (sizeof(table) / sizeof(table[0]))
+#define CPLD_REGS(table) table, CPLD_COUNT(table)
+
+/*
+ * Name indexes of the built-in boards: register indexes in the order of
+ * their names, compared without case. Checked by cpld_board_check.
+ */
+static const uint8_t cpld_name_h3sk[CPLD_COUNT(cpld_reg_h3sk)] = {
+	2, 0, 1, 3, 4
+};
+
+static const uint8_t cpld_name_v3u[CPLD_COUNT(cpld_reg_v3u)] = {
+	12, 13, 5, 6, 17, 4, 3, 2, 16, 14, 9, 8, 0, 7, 15, 10, 11, 1
+};
+
+static const uint8_t cpld_name_v3hsk[CPLD_COUNT(cpld_reg_v3hsk)] = {
+	5, 6, 7, 13, 14, 20, 4, 3, 2, 19, 17, 11, 12, 10, 9, 0, 8, 18, 15, 16, 1
+};
+
+static const uint8_t cpld_name_v3msk[CPLD_COUNT(cpld_reg_v3msk)] = {
+	4, 8, 3, 2, 11, 9, 7, 6, 0, 5, 10, 1
+};
+
+static const uint8_t cpld_name_s4[CPLD_COUNT(cpld_reg_s4)] = {
+	12, 13, 5, 6, 17, 4, 3, 2, 16, 14, 9, 8, 0, 7, 15, 10, 11, 1
+};
+
+static const struct cpld_board cpld_boards[] = {
+	{ "H3SK",  SPI, 1, 0x6001, 0,   CPLD_REGS(cpld_reg_h3sk),  cpld_name_h3sk,  NULL },
+	{ "M3SK",  SPI, 1, 0x6001, 0,   CPLD_REGS(cpld_reg_h3sk),  cpld_name_h3sk,  NULL },
+	{ "V3U",   IIC, 2, 0x6010, 400, CPLD_REGS(cpld_reg_v3u),   cpld_name_v3u,   &cpld_nv_i2c_v3u },
+	{ "V3HSK", IIC, 2, 0x6010, 400, CPLD_REGS(cpld_reg_v3hsk), cpld_name_v3hsk, &cpld_nv_i2c_v3hsk },
+	{ "V3MSK", SMI, 1, 0x6001, 0,   CPLD_REGS(cpld_reg_v3msk), cpld_name_v3msk, &cpld_nv_smi_v3msk },
+	{ "S4",    IIC, 2, 0x6010, 400, CPLD_REGS(cpld_reg_s4),    cpld_name_s4,    &cpld_nv_i2c_v3u },
+	{ NULL }
+};
+
+/* Binary image of a board definition file */
+#define CPLD_IMAGE_MAGIC	"CPLDIMG"
+#define CPLD_IMAGE_VERSION	(0x40000 | sizeof(struct register_context) << 8 | \
+				 sizeof(struct cpld_nv_field))
+
+struct cpld_image {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;		/* boards */
+	uint64_t length;	/* bytes of the whole image */
+	uint64_t src_ino;	/* board file the image was built from */
+	uint64_t src_size;
+	uint64_t src_mtime;	/* ns */
+};
+
+/* Offsets are counted from the start of the image */
+struct cpld_image_board {
+	char name[CPLD_NAME_MAX];
+	uint8_t protocol;
+	uint8_t iface;
+	uint16_t product_id;
+	uint32_t i2c_khz;
+	uint32_t reg;		/* register table */
+	uint32_t count;
+	uint32_t by_name;	/* name index */
+	uint32_t field;		/* flash fields, 0 without non-volatile registers */
+	uint16_t base[2];
+	uint16_t erase[2];
+	uint16_t span[2];
+	uint16_t status;
+	uint8_t erase_value;
+	uint8_t unit;
+	uint8_t read_lag;
+};
+
+/* A board while its file is parsed */
+struct cpld_board_src {
+	struct cpld_image_board head;
+	struct register_context reg[CPLD_REG_MAX];
+	uint8_t by_name[CPLD_REG_MAX];
+	struct cpld_nv_field field[CPLD_REG_MAX];
+	char field_name[CPLD_REG_MAX][CPLD_NAME_MAX];
+	int fields;
+	uint8_t pages;		/* bit n set when page n is described */
+	int line;
+};
+
+static pthread_once_t cpld_board_once = PTHREAD_ONCE_INIT;
+static const char *cpld_board_path;
+static struct cpld_board *cpld_file_boards;
+static struct cpld_nv_layout *cpld_file_layouts;
+static int cpld_file_count;
+
+#define CPLD_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+/**
+ * Select the board definition file.
+ *
+ * @param	path	Board definition file, NULL for the default.
+ *
+ * @return	None.
+ */
+void cpld_board_set_file(const char *path)
+{
+	cpld_board_path = path;
+}
+
+/**
+ * Sort a name index. Names compare without case, so -r and -w accept
+ * mode_set as well as MODE_SET.
+ */
+static void cpld_board_sort(const struct register_context *reg, int count, uint8_t *by_name)
+{
+	int i, j;
+
+	for (i = 0; i < count; i++) {
+		for (j = i; j > 0; j--) {
+			if (strcasecmp(reg[by_name[j - 1]].name, reg[i].name) <= 0)
+				break;
+			by_name[j] = by_name[j - 1];
+		}
+		by_name[j] = i;
+	}
+}
+
+static int cpld_board_num(const char *path, int line, const char *arg, uint64_t max,
+			  uint64_t *value)
+{
+	char *end;
+
+	if (arg == NULL) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "%s:%d: missing argument!", path, line);
+		return 1;
+	}
+
+	errno = 0;
+	*value = strtoull(arg, &end, 0);
+	if (errno != 0 || *end != '\0' || *value > max) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "%s:%d: invalid number %s!", path, line, arg);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int cpld_board_name(const char *path, int line, const char *arg, char *name)
+{
+	if (arg == NULL || strlen(arg) >= CPLD_NAME_MAX) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "%s:%d: name missing or longer than %d characters!",
+			path, line, CPLD_NAME_MAX - 1);
+		return 1;
+	}
+
+	strcpy(name, arg);
+	return 0;
+}
+
+/**
+ * Parse one statement into the current board.
+ *
+ * @return	0 on success, 1 on error.
+ */
+static int cpld_board_statement(const char *path, int line, char **arg,
+				struct cpld_board_src *b)
+{
+	struct cpld_image_board *head = &b->head;
+	struct register_context *reg;
+	struct cpld_nv_field *field;
+	uint64_t n[4] = { 0 };
+
+	if (!strcmp(arg[0], "protocol")) {
+		if (arg[1] != NULL && !strcmp(arg[1], "spi"))
+			head->protocol = SPI;
+		else if (arg[1] != NULL && !strcmp(arg[1], "i2c"))
+			head->protocol = IIC;
+		else if (arg[1] != NULL && !strcmp(arg[1], "smi"))
+			head->protocol = SMI;
+		else
+			goto invalid;
+		if (head->iface == 0)
+			head->iface = head->protocol == IIC ? 2 : 1;
+	} else if (!strcmp(arg[0], "product")) {
+		if (cpld_board_num(path, line, arg[1], 0xFFFF, &n[0]))
+			return 1;
+		head->product_id = n[0];
+	} else if (!strcmp(arg[0], "interface")) {
+		if (arg[1] == NULL || arg[1][0] < 'A' || arg[1][0] > 'D' || arg[1][1] != '\0')
+			goto invalid;
+		head->iface = arg[1][0] - 'A' + 1;
+	} else if (!strcmp(arg[0], "i2c_khz")) {
+		if (cpld_board_num(path, line, arg[1], I2C_KHZ_MAX, &n[0]))
+			return 1;
+		if (n[0] < I2C_KHZ_MIN)
+			goto invalid;
+		head->i2c_khz = n[0];
+	} else if (!strcmp(arg[0], "reg")) {
+		if (head->count == CPLD_REG_MAX) {
+			cpld_log(NULL, CPLD_LOG_ERROR, "%s:%d: more than %d registers!", path, line, CPLD_REG_MAX);
+			return 1;
+		}
+		reg = &b->reg[head->count];
+		if (cpld_board_name(path, line, arg[1], reg->name) ||
+		    cpld_board_num(path, line, arg[2], UINT64_MAX, &reg->address) ||
+		    cpld_board_num(path, line, arg[3], 8, &n[0]) ||
+		    cpld_board_num(path, line, arg[4], 8, &n[1]))
+			return 1;
+		if (n[0] == 0 || n[1] == 0 || arg[5] == NULL)
+			goto invalid;
+		reg->addr_length = n[0];
+		reg->val_length = n[1];
+		if (!strcmp(arg[5], "RW"))
+			reg->mode = RW;
+		else if (!strcmp(arg[5], "R"))
+			reg->mode = R;
+		else if (!strcmp(arg[5], "W"))
+			reg->mode = W;
+		else
+			goto invalid;
+		if (arg[6] != NULL && strcmp(arg[6], "const") && strcmp(arg[6], "self_clear"))
+			goto invalid;
+		reg->constant = arg[6] != NULL && !strcmp(arg[6], "const");
+		reg->self_clear = arg[6] != NULL && !strcmp(arg[6], "self_clear");
+		head->count++;
+	} else if (!strcmp(arg[0], "nv_page")) {
+		if (cpld_board_num(path, line, arg[1], 1, &n[0]) ||
+		    cpld_board_num(path, line, arg[2], 0xFFFF, &n[1]) ||
+		    cpld_board_num(path, line, arg[3], 0xFFFF, &n[2]) ||
+		    (arg[4] != NULL && cpld_board_num(path, line, arg[4], 255, &n[3])))
+			return 1;
+		head->base[n[0]] = n[1];
+		head->erase[n[0]] = n[2];
+		head->span[n[0]] = n[3];
+		b->pages |= 1 << n[0];
+	} else if (!strcmp(arg[0], "nv_erase")) {
+		if (cpld_board_num(path, line, arg[1], 0xFF, &n[0]))
+			return 1;
+		head->erase_value = n[0];
+	} else if (!strcmp(arg[0], "nv_status")) {
+		if (cpld_board_num(path, line, arg[1], 0xFFFF, &n[0]))
+			return 1;
+		head->status = n[0];
+	} else if (!strcmp(arg[0], "nv_unit")) {
+		if (cpld_board_num(path, line, arg[1], 8, &n[0]))
+			return 1;
+		head->unit = n[0];
+	} else if (!strcmp(arg[0], "nv_read_lag")) {
+		if (arg[1] != NULL)
+			goto invalid;
+		head->read_lag = 1;
+	} else if (!strcmp(arg[0], "nv")) {
+		if (b->fields == CPLD_REG_MAX) {
+			cpld_log(NULL, CPLD_LOG_ERROR, "%s:%d: more than %d flash fields!",
+				path, line, CPLD_REG_MAX);
+			return 1;
+		}
+		field = &b->field[b->fields];
+		if (cpld_board_name(path, line, arg[1], b->field_name[b->fields]) ||
+		    cpld_board_num(path, line, arg[2], 1, &n[0]) ||
+		    cpld_board_num(path, line, arg[3], 255, &n[1]) ||
+		    cpld_board_num(path, line, arg[4], 8, &n[2]) ||
+		    (arg[5] != NULL && cpld_board_num(path, line, arg[5], UINT64_MAX, &n[3])))
+			return 1;
+		if (n[2] == 0 || n[1] + n[2] > 255)
+			goto invalid;
+		field->page = n[0];
+		field->offset = n[1];
+		field->length = n[2];
+		field->invert = n[3];
+		b->fields++;
+	} else {
+		cpld_log(NULL, CPLD_LOG_ERROR, "%s:%d: unknown statement %s!", path, line, arg[0]);
+		return 1;
+	}
+
+	return 0;
+
+invalid:
+	cpld_log(NULL, CPLD_LOG_ERROR, "%s:%d: invalid %s statement!", path, line, arg[0]);
+	return 1;
+}
+
+/**
+ * Number of bytes a flash page may keep. A page is read in one transfer
+ * of at most 255 bytes and programmed in whole units.
+ */
+static int cpld_nv_limit(uint8_t unit)
+{
+	return 255 / unit * unit;
+}
+
+/**
+ * Check a parsed board, sort its registers by address and resolve its
+ * flash fields.
+ *
+ * @return	0 on success, 1 on error.
+ */
+static int cpld_board_finish(const char *path, struct cpld_board_src *b)
+{
+	struct cpld_image_board *head = &b->head;
+	struct register_context reg;
+	int i, j, limit;
+
+	if (head->count == 0 || head->product_id == 0 || head->iface == 0) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "%s:%d: board %s needs a protocol, a product and registers!",
+			path, b->line, head->name);
+		return 1;
+	}
+	if (head->protocol == IIC && head->i2c_khz == 0)
+		head->i2c_khz = 100;
+
+	for (i = 1; i < head->count; i++) {
+		reg = b->reg[i];
+		for (j = i; j > 0 && b->reg[j - 1].address > reg.address; j--)
+			b->reg[j] = b->reg[j - 1];
+		b->reg[j] = reg;
+	}
+	for (i = 1; i < head->count; i++) {
+		if (b->reg[i].address == b->reg[i - 1].address) {
+			cpld_log(NULL, CPLD_LOG_ERROR, "%s:%d: board %s has two registers at 0x%jX!",
+				path, b->line, head->name, b->reg[i].address);
+			return 1;
+		}
+	}
+
+	cpld_board_sort(b->reg, head->count, b->by_name);
+	for (i = 1; i < head->count; i++) {
+		if (!strcasecmp(b->reg[b->by_name[i]].name, b->reg[b->by_name[i - 1]].name)) {
+			cpld_log(NULL, CPLD_LOG_ERROR, "%s:%d: board %s has two registers named %s!",
+				path, b->line, head->name, b->reg[b->by_name[i]].name);
+			return 1;
+		}
+	}
+
+	/* A page of 256 bytes holds whole program commands */
+	if (b->fields > 0 && (head->unit == 0 || (head->unit & (head->unit - 1)) ||
+			      head->protocol == SPI)) {
+		cpld_log(NULL, CPLD_LOG_ERROR,
+			"%s:%d: board %s needs an i2c or smi bus and nv_unit 1, 2, 4 or 8!",
+			path, b->line, head->name);
+		return 1;
+	}
+	if (head->read_lag && head->protocol != SMI) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "%s:%d: board %s: nv_read_lag needs an smi bus!",
+			path, b->line, head->name);
+		return 1;
+	}
+	if (b->fields == 0)
+		return 0;
+
+	limit = cpld_nv_limit(head->unit);
+	if (head->span[0] > limit || head->span[1] > limit) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "%s:%d: board %s: nv_page spans end past byte %d!",
+			path, b->line, head->name, limit);
+		return 1;
+	}
+	for (i = 0; i < b->fields; i++) {
+		if (b->field[i].offset + b->field[i].length > limit) {
+			cpld_log(NULL, CPLD_LOG_ERROR, "%s:%d: board %s: nv %s ends past byte %d!",
+				path, b->line, head->name, b->field_name[i], limit);
+			return 1;
+		}
+		for (j = 0; j < head->count; j++) {
+			if (!strcasecmp(b->reg[j].name, b->field_name[i]))
+				break;
+		}
+		if (j == head->count || !(b->pages & (1 << b->field[i].page))) {
+			cpld_log(NULL, CPLD_LOG_ERROR, "%s:%d: board %s: nv %s needs a register and its nv_page!",
+				path, b->line, head->name, b->field_name[i]);
+			return 1;
+		}
+		b->field[i].address = b->reg[j].address;
+	}
+
+	return 0;
+}
+
+/**
+ * Parse a board definition file.
+ *
+ * @param	path	Board definition file.
+ * @param	fp	Opened file.
+ * @param	count	Number of boards.
+ *
+ * @return	Array of parsed boards, NULL on error.
+ */
+static struct cpld_board_src *cpld_board_parse(const char *path, FILE *fp, int *count)
+{
+	struct cpld_board_src *boards = NULL, *b = NULL, *grow;
+	char buf[512], *arg[8], *save, *hash;
+	int line = 0, n, ret = 0;
+
+	*count = 0;
+	while (ret == 0 && fgets(buf, sizeof(buf), fp) != NULL) {
+		line++;
+		hash = strchr(buf, '#');
+		if (hash != NULL)
+			*hash = '\0';
+
+		memset(arg, 0, sizeof(arg));
+		for (n = 0, arg[0] = strtok_r(buf, " \t\r\n", &save);
+		     arg[n] != NULL && n < 7;
+		     arg[++n] = strtok_r(NULL, " \t\r\n", &save))
+			;
+		arg[n] = NULL;
+		if (n == 0)
+			continue;
+
+		if (!strcmp(arg[0], "board")) {
+			if (b != NULL && cpld_board_finish(path, b) != 0) {
+				ret = 1;
+				break;
+			}
+			grow = realloc(boards, (*count + 1) * sizeof(*boards));
+			if (grow == NULL) {
+				ret = 1;
+				break;
+			}
+			boards = grow;
+			b = &boards[(*count)++];
+			memset(b, 0, sizeof(*b));
+			b->line = line;
+			ret = cpld_board_name(path, line, arg[1], b->head.name);
+		} else if (b == NULL) {
+			cpld_log(NULL, CPLD_LOG_ERROR, "%s:%d: %s outside of a board!", path, line, arg[0]);
+			ret = 1;
+		} else {
+			ret = cpld_board_statement(path, line, arg, b);
+		}
+	}
+
+	if (ret == 0 && b != NULL)
+		ret = cpld_board_finish(path, b);
+	if (ret != 0) {
+		free(boards);
+		return NULL;
+	}
+
+	return boards;
+}
+
+/**
+ * Lay parsed boards out in a binary image.
+ *
+ * @param	boards	Parsed boards.
+ * @param	count	Number of boards.
+ * @param	st	Status of the board definition file.
+ *
+ * @return	Image, NULL on failure.
+ */
+static struct cpld_image *cpld_image_build(struct cpld_board_src *boards, int count,
+					   const struct stat *st)
+{
+	struct cpld_image *image;
+	struct cpld_image_board *head;
+	size_t length, offset;
+	int i;
+
+	length = CPLD_ALIGN(sizeof(*image) + count * sizeof(*head));
+	for (i = 0; i < count; i++) {
+		length += CPLD_ALIGN(boards[i].head.count * sizeof(struct register_context));
+		length += CPLD_ALIGN(boards[i].head.count);
+		if (boards[i].fields > 0)
+			length += (boards[i].fields + 1) * sizeof(struct cpld_nv_field);
+	}
+
+	image = calloc(1, length);
+	if (image == NULL)
+		return NULL;
+
+	memcpy(image->magic, CPLD_IMAGE_MAGIC, sizeof(image->magic));
+	image->version = CPLD_IMAGE_VERSION;
+	image->count = count;
+	image->length = length;
+	image->src_ino = st->st_ino;
+	image->src_size = st->st_size;
+	image->src_mtime = st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+
+	head = (struct cpld_image_board *)(image + 1);
+	offset = CPLD_ALIGN(sizeof(*image) + count * sizeof(*head));
+	for (i = 0; i < count; i++, head++) {
+		*head = boards[i].head;
+
+		head->reg = offset;
+		memcpy((char *)image + offset, boards[i].reg,
+		       head->count * sizeof(struct register_context));
+		offset += CPLD_ALIGN(head->count * sizeof(struct register_context));
+
+		head->by_name = offset;
+		memcpy((char *)image + offset, boards[i].by_name, head->count);
+		offset += CPLD_ALIGN(head->count);
+
+		/* the zeroed record after the fields ends the table */
+		if (boards[i].fields > 0) {
+			head->field = offset;
+			memcpy((char *)image + offset, boards[i].field,
+			       boards[i].fields * sizeof(struct cpld_nv_field));
+			offset += (boards[i].fields + 1) * sizeof(struct cpld_nv_field);
+		}
+	}
+
+	return image;
+}
+
+/**
+ * Check the records of one board of an image the way the board file
+ * parser checks its statements, so a corrupt image is never used.
+ *
+ * @return	0 if the board can be used.
+ */
+static int cpld_image_check_board(const struct cpld_image *image,
+				  const struct cpld_image_board *head)
+{
+	const struct register_context *reg =
+		(const struct register_context *)((const char *)image + head->reg);
+	const uint8_t *by_name = (const uint8_t *)image + head->by_name;
+	const struct cpld_nv_field *field;
+	uint32_t i, j;
+	int limit;
+
+	if (head->protocol > SMI || head->iface < 1 || head->iface > 4 || head->product_id == 0 ||
+	    head->count == 0)
+		return 1;
+	/* 0 on other buses unless the file gave one */
+	if ((head->protocol == IIC || head->i2c_khz != 0) &&
+	    (head->i2c_khz < I2C_KHZ_MIN || head->i2c_khz > I2C_KHZ_MAX))
+		return 1;
+
+	for (i = 0; i < head->count; i++) {
+		if (reg[i].name[CPLD_NAME_MAX - 1] != '\0' ||
+		    reg[i].addr_length < 1 || reg[i].addr_length > 8 ||
+		    reg[i].val_length < 1 || reg[i].val_length > 8 || reg[i].mode > W ||
+		    (reg[i].constant && reg[i].self_clear))
+			return 1;
+		/* both lookups are binary searches */
+		if (i > 0 && (reg[i].address <= reg[i - 1].address ||
+			      strcasecmp(reg[by_name[i - 1]].name, reg[by_name[i]].name) >= 0))
+			return 1;
+	}
+
+	if (head->read_lag > 1 || (head->read_lag && head->protocol != SMI))
+		return 1;
+	if (head->field == 0)
+		return 0;
+	if (head->protocol == SPI || head->unit == 0 || head->unit > 8 ||
+	    (head->unit & (head->unit - 1)))
+		return 1;
+	limit = cpld_nv_limit(head->unit);
+	if (head->span[0] > limit || head->span[1] > limit)
+		return 1;
+
+	field = (const struct cpld_nv_field *)((const char *)image + head->field);
+	for (; field->length != 0; field++) {
+		if (field->page > 1 || field->length > 8 || field->offset + field->length > limit)
+			return 1;
+		for (j = 0; j < head->count && reg[j].address != field->address; j++)
+			;
+		if (j == head->count)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Check that an image belongs to the board file, that all its tables lie
+ * inside it and that their records are valid.
+ *
+ * @return	0 if the image can be used.
+ */
+static int cpld_image_check(const struct cpld_image *image, size_t length,
+			    const struct stat *st)
+{
+	const struct cpld_image_board *head = (const struct cpld_image_board *)(image + 1);
+	const struct cpld_nv_field *field;
+	uint32_t i, j;
+
+	if (length < sizeof(*image) || memcmp(image->magic, CPLD_IMAGE_MAGIC, 8) ||
+	    image->version != CPLD_IMAGE_VERSION || image->length != length ||
+	    image->src_ino != (uint64_t)st->st_ino || image->src_size != (uint64_t)st->st_size ||
+	    image->src_mtime != st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec ||
+	    image->count > (length - sizeof(*image)) / sizeof(*head))
+		return 1;
+
+	for (i = 0; i < image->count; i++, head++) {
+		if (head->name[CPLD_NAME_MAX - 1] != '\0' || head->count > CPLD_REG_MAX ||
+		    head->reg % 8 || head->reg > length ||
+		    head->count * sizeof(struct register_context) > length - head->reg ||
+		    head->by_name > length || head->count > length - head->by_name)
+			return 1;
+		for (j = 0; j < head->count; j++) {
+			if (((const uint8_t *)image + head->by_name)[j] >= head->count)
+				return 1;
+		}
+		if (head->field != 0 && (head->field % 8 || head->field > length))
+			return 1;
+		field = (const struct cpld_nv_field *)((const char *)image + head->field);
+		for (j = 0; head->field != 0; j++, field++) {
+			if ((const char *)(field + 1) > (const char *)image + length || j > CPLD_REG_MAX)
+				return 1;
+			if (field->length == 0)
+				break;
+		}
+		if (cpld_image_check_board(image, head) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Map the cached image of a board file.
+ *
+ * @return	Mapped image, NULL if there is no usable cache.
+ */
+static struct cpld_image *cpld_image_map(const char *cache, const struct stat *st)
+{
+	struct stat cst;
+	void *map;
+	int fd;
+
+	fd = open(cache, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &cst) != 0 || cst.st_size < (off_t)sizeof(struct cpld_image)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	if (cpld_image_check(map, cst.st_size, st) != 0) {
+		munmap(map, cst.st_size);
+		return NULL;
+	}
+
+	return map;
+}
+
+/**
+ * Store an image next to its board file. A temporary file is renamed
+ * over the cache, so a concurrent start maps either image but never half
+ * of one.
+ */
+static void cpld_image_save(const char *cache, const struct cpld_image *image)
+{
+	char tmp[strlen(cache) + 16];
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", cache, (int)getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+
+	if (write(fd, image, image->length) != (ssize_t)image->length ||
+	    close(fd) != 0 || rename(tmp, cache) != 0)
+		unlink(tmp);
+}
+
+/**
+ * Load the boards of the board definition file, through its image.
+ *
+ * @return	None.
+ */
+static void cpld_board_load(void)
+{
+	const char *path = cpld_board_path ? cpld_board_path : CPLD_BOARDS_DEFAULT;
+	char cache[strlen(path) + 8];
+	struct cpld_board_src *boards;
+	const struct cpld_image_board *head;
+	struct cpld_image *image;
+	struct stat st;
+	FILE *fp;
+	int i, count;
+
+	if (stat(path, &st) != 0) {
+		/* The default file is optional */
+		if (cpld_board_path != NULL)
+			cpld_log(NULL, CPLD_LOG_ERROR, "Cannot open board file %s (%s)!", path, strerror(errno));
+		return;
+	}
+
+	snprintf(cache, sizeof(cache), "%s.cache", path);
+	image = cpld_image_map(cache, &st);
+	if (image == NULL) {
+		fp = fopen(path, "r");
+		if (fp == NULL || fstat(fileno(fp), &st) != 0) {
+			cpld_log(NULL, CPLD_LOG_ERROR, "Cannot open board file %s (%s)!", path, strerror(errno));
+			if (fp != NULL)
+				fclose(fp);
+			return;
+		}
+		boards = cpld_board_parse(path, fp, &count);
+		fclose(fp);
+		if (boards == NULL)
+			return;
+
+		image = cpld_image_build(boards, count, &st);
+		free(boards);
+		if (image == NULL)
+			return;
+		cpld_image_save(cache, image);
+	}
+
+	/* The image stays mapped, the boards point into it */
+	cpld_file_boards = calloc(image->count, sizeof(*cpld_file_boards));
+	cpld_file_layouts = calloc(image->count, sizeof(*cpld_file_layouts));
+	if (cpld_file_boards == NULL || cpld_file_layouts == NULL)
+		return;
+
+	head = (const struct cpld_image_board *)(image + 1);
+	for (i = 0; i < (int)image->count; i++, head++) {
+		cpld_file_boards[i].name = head->name;
+		cpld_file_boards[i].protocol = head->protocol;
+		cpld_file_boards[i].iface = head->iface;
+		cpld_file_boards[i].product_id = head->product_id;
+		cpld_file_boards[i].i2c_khz = head->i2c_khz;
+		cpld_file_boards[i].reg =
+			(const struct register_context *)((char *)image + head->reg);
+		cpld_file_boards[i].count = head->count;
+		cpld_file_boards[i].by_name = (const uint8_t *)image + head->by_name;
+		if (head->field == 0)
+			continue;
+
+		memcpy(cpld_file_layouts[i].base, head->base, sizeof(head->base));
+		memcpy(cpld_file_layouts[i].erase, head->erase, sizeof(head->erase));
+		memcpy(cpld_file_layouts[i].span, head->span, sizeof(head->span));
+		cpld_file_layouts[i].erase_value = head->erase_value;
+		cpld_file_layouts[i].status = head->status;
+		cpld_file_layouts[i].unit = head->unit;
+		cpld_file_layouts[i].read_lag = head->read_lag;
+		cpld_file_layouts[i].field =
+			(const struct cpld_nv_field *)((char *)image + head->field);
+		cpld_file_boards[i].nv = &cpld_file_layouts[i];
+	}
+	cpld_file_count = image->count;
+}
+
+#ifndef NDEBUG
+/**
+ * Check that the name indexes of the built-in boards are in name order.
+ */
+static void cpld_board_check(void)
+{
+	const struct cpld_board *board;
+	int i;
+
+	for (board = cpld_boards; board->name != NULL; board++) {
+		for (i = 0; i < board->count; i++) {
+			assert(board->by_name[i] < board->count);
+			assert(i == 0 || strcasecmp(board->reg[board->by_name[i - 1]].name,
+						    board->reg[board->by_name[i]].name) < 0);
+		}
+	}
+}
+#endif
+
+static void cpld_board_init(void)
+{
+#ifndef NDEBUG
+	cpld_board_check();
+#endif
+	cpld_board_load();
+}
+
+/**
+ * Find the register map of a board. Boards of the board definition file
+ * come first.
+ *
+ * @param	name	Board name.
+ *
+ * @return	Board description, NULL if the board is not supported.
+ */
+const struct cpld_board *cpld_board_find(const char *name)
+{
+	const struct cpld_board *board;
+	int i;
+
+	pthread_once(&cpld_board_once, cpld_board_init);
+
+	for (i = 0; i < cpld_file_count; i++) {
+		if (strcmp(cpld_file_boards[i].name, name) == 0)
+			return &cpld_file_boards[i];
+	}
+
+	for (board = cpld_boards; board->name != NULL; board++) {
+		if (strcmp(board->name, name) == 0)
+			return board;
+	}
+
+	return NULL;
+}
+/**
+ * Look up a register by address.
+ *
+ * @param	board	Board description.
+ * @param	address	Register address.
+ *
+ * @return	Index of the register, -1 if there is none at the address.
+ */
+int cpld_board_reg(const struct cpld_board *board, uint64_t address)
+{
+	int low = 0, high = board->count - 1, mid;
+
+	while (low <= high) {
+		mid = (low + high) / 2;
+		if (board->reg[mid].address == address)
+			return mid;
+		if (board->reg[mid].address < address)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+
+	return -1;
+}
+
+/**
+ * Look up a register by name, ignoring case.
+ *
+ * @param	board	Board description.
+ * @param	name	Register name.
+ *
+ * @return	Index of the register, -1 if the board has no such register.
+ */
+int cpld_board_reg_name(const struct cpld_board *board, const char *name)
+{
+	int low = 0, high = board->count - 1, mid, cmp;
+
+	while (low <= high) {
+		mid = (low + high) / 2;
+		cmp = strcasecmp(board->reg[board->by_name[mid]].name, name);
+		if (cmp == 0)
+			return board->by_name[mid];
+		if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+
+	return -1;
+}
@@ -0,0 +1,316 @@
+/**
+ * Copyright (C) 2020 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include "cache.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * Register cache.
+ *
+ * Identity registers (marked const in the board tables) never change on
+ * a board, so their values may be kept on disk between sessions, one
+ * file per board and FTDI serial:
+ *
+ *	<dir>/<board>-<serial>
+ *
+ *	VERSION <address> <value>
+ *	<name> <address> <value>
+ *	...
+ *
+ * Every session reads the VERSION register from the board first. The file
+ * is only used when it was written with the same VERSION, its registers
+ * are then printed from memory instead of being read from the bus. When
+ * the file is missing or stale, it is written again once a dump has read
+ * all identity registers. Writing the identity page of the flash removes
+ * the file, from every directory a later session may use, also when the
+ * cache is off in the session that writes.
+ *
+ * The cache is off unless a directory is given, for one CPLD structure or
+ * as the default of the ones opened later.
+ */
+
+/* Cache directory of the CPLDs opened from now on, NULL when the cache is off */
+static char *cpld_cache_dir;
+
+/**
+ * Get the default cache directory.
+ *
+ * @param	path	Buffer of the directory.
+ * @param	size	Size of the buffer.
+ *
+ * @return	0 on success, -1 without a home directory.
+ */
+static int cpld_cache_default(char *path, size_t size)
+{
+	const char *base;
+
+	base = getenv("XDG_CACHE_HOME");
+	if (base != NULL && base[0] != '\0')
+		snprintf(path, size, "%s/cpld-control", base);
+	else if ((base = getenv("HOME")) != NULL)
+		snprintf(path, size, "%s/.cache/cpld-control", base);
+	else
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Set the cache directory.
+ *
+ * @param	cpld	CPLD structure, NULL for the CPLDs opened from now on.
+ * @param	dir	Directory, "" for the default one, NULL to turn the cache off.
+ *
+ * @return	None.
+ */
+void cpld_cache_set_dir(struct cpld_context *cpld, const char *dir)
+{
+	char **cache_dir = cpld ? &cpld->cache_dir : &cpld_cache_dir;
+	char path[PATH_MAX];
+
+	free(*cache_dir);
+	*cache_dir = NULL;
+	if (dir == NULL)
+		return;
+
+	if (dir[0] == '\0') {
+		if (cpld_cache_default(path, sizeof(path)) != 0)
+			return;
+		dir = path;
+	}
+
+	*cache_dir = strdup(dir);
+}
+
+/**
+ * Get the cache directory of the CPLDs opened from now on.
+ *
+ * @return	Directory, NULL when the cache is off.
+ */
+const char *cpld_cache_get_dir(void)
+{
+	return cpld_cache_dir;
+}
+
+/**
+ * Mask of the registers kept in the cache file, the key included.
+ */
+static uint32_t cpld_cache_mask(struct cpld_context *cpld, const struct register_context *key)
+{
+	uint32_t mask = CPLD_REG_BIT(cpld, key);
+	int i;
+
+	for (i = 0; i < cpld->board->count; i++)
+		if (cpld->reg[i].constant && cpld->reg[i].mode != W)
+			mask |= 1U << i;
+
+	return mask;
+}
+
+/**
+ * Get the register that validates the cache.
+ *
+ * @return	The key register, NULL if the cache is off for the board.
+ */
+static const struct register_context *cpld_cache_key(struct cpld_context *cpld)
+{
+	const struct register_context *key;
+
+	if (cpld->cache_dir == NULL)
+		return NULL;
+
+	key = cpld_find_reg(cpld, CPLD_CACHE_KEY);
+	if (key == NULL || key->mode == W)
+		return NULL;
+
+	/* nothing to cache */
+	if (cpld_cache_mask(cpld, key) == CPLD_REG_BIT(cpld, key))
+		return NULL;
+
+	return key;
+}
+
+/**
+ * Get the cache file of a board in a directory, characters of the serial
+ * that may not be in a file name are replaced.
+ */
+static void cpld_cache_path(struct cpld_context *cpld, const char *dir, char *path, size_t size)
+{
+	char *c;
+	int n;
+
+	n = snprintf(path, size, "%s/%s-", dir, cpld->board->name);
+	snprintf(path + n, size - n, "%s", cpld->serial);
+	for (c = path + n; *c != '\0'; c++)
+		if (*c == '/' || *c < ' ' || *c > '~')
+			*c = '_';
+}
+
+/**
+ * Validate the cache of a board and load the cached registers.
+ *
+ * The key register is read from the board, a failed read leaves the
+ * cache unused.
+ *
+ * @param	cpld	CPLD structure.
+ *
+ * @return	None.
+ */
+void cpld_cache_open(struct cpld_context *cpld)
+{
+	const struct register_context *key = cpld_cache_key(cpld);
+	const struct register_context *reg;
+	char path[PATH_MAX], line[128], name[CPLD_NAME_MAX];
+	uint64_t version = 0, address, value;
+	uint32_t mask, loaded = 0;
+	int index;
+	FILE *fp;
+
+	cpld->cached = 0;
+	cpld->fresh = 0;
+	if (key == NULL)
+		return;
+
+	if (cpld_read_span(cpld, key->address, key->addr_length, (uint8_t *)&version,
+			   key->val_length) != 0)
+		return;
+	cpld->value[key - cpld->reg] = version;
+	cpld->cached = cpld->fresh = CPLD_REG_BIT(cpld, key);
+
+	cpld_cache_path(cpld, cpld->cache_dir, path, sizeof(path));
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return;
+
+	/* the key comes first, stale files are ignored */
+	if (fgets(line, sizeof(line), fp) == NULL ||
+	    sscanf(line, "%15s %jx %jx", name, &address, &value) != 3 ||
+	    address != key->address || value != version) {
+		fclose(fp);
+		return;
+	}
+
+	mask = cpld_cache_mask(cpld, key);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%15s %jx %jx", name, &address, &value) != 3)
+			break;
+		index = cpld_board_reg(cpld->board, address);
+		if (index < 0 || !(mask & (1U << index)))
+			continue;
+		reg = &cpld->reg[index];
+		if (strcmp(reg->name, name) || (reg->val_length < 8 && value >> (reg->val_length * 8)))
+			continue;
+		cpld->value[index] = value;
+		loaded |= 1U << index;
+	}
+	fclose(fp);
+
+	/* the board definition may have changed since the file was written */
+	if ((loaded | cpld->cached) == mask)
+		cpld->cached = mask;
+}
+
+/**
+ * Store the cached registers of a board.
+ *
+ * The file is written when it was not valid and the session has read
+ * all its registers from the board. A temporary file is renamed over the
+ * cache, so a concurrent session reads either file but never half of one.
+ *
+ * @param	cpld	CPLD structure.
+ *
+ * @return	None.
+ */
+void cpld_cache_close(struct cpld_context *cpld)
+{
+	const struct register_context *key = cpld_cache_key(cpld);
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	uint32_t mask;
+	char *c;
+	FILE *fp;
+	int i;
+
+	if (key == NULL)
+		return;
+
+	mask = cpld_cache_mask(cpld, key);
+	if ((cpld->cached & mask) == mask || (cpld->fresh & mask) != mask)
+		return;
+
+	/* create the directory and its parents */
+	cpld_cache_path(cpld, cpld->cache_dir, path, sizeof(path));
+	for (c = strchr(path + 1, '/'); c != NULL; c = strchr(c + 1, '/')) {
+		*c = '\0';
+		if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+			cpld_log(&cpld->log, CPLD_LOG_ERROR, "Cannot create cache directory %s!", path);
+			return;
+		}
+		*c = '/';
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	fp = fopen(tmp, "w");
+	if (fp == NULL)
+		return;
+
+	fprintf(fp, "%s 0x%0*jX 0x%0*jX\n", key->name, key->addr_length * 2, key->address,
+		key->val_length * 2, cpld->value[key - cpld->reg]);
+	for (i = 0; i < cpld->board->count; i++)
+		if (&cpld->reg[i] != key && (mask & (1U << i)))
+			fprintf(fp, "%s 0x%0*jX 0x%0*jX\n", cpld->reg[i].name,
+				cpld->reg[i].addr_length * 2, cpld->reg[i].address,
+				cpld->reg[i].val_length * 2, cpld->value[i]);
+
+	if (fclose(fp) != 0 || rename(tmp, path) != 0)
+		unlink(tmp);
+}
+
+/**
+ * Drop the cache of a board, after its identity registers were written.
+ *
+ * The file is removed from the directory of this session, the one of
+ * CPLD_CONTROL_CACHE and the default one, whether or not the cache is on,
+ * since another session may read any of them. The registers are read
+ * from the board again and the file is written anew when the session
+ * ends.
+ *
+ * @param	cpld	CPLD structure.
+ *
+ * @return	None.
+ */
+void cpld_cache_invalidate(struct cpld_context *cpld)
+{
+	const struct register_context *key = cpld_cache_key(cpld);
+	char dir[PATH_MAX], path[PATH_MAX];
+	const char *env = getenv("CPLD_CONTROL_CACHE");
+	uint32_t mask;
+
+	if (key != NULL) {
+		mask = cpld_cache_mask(cpld, key) & ~CPLD_REG_BIT(cpld, key);
+		cpld->cached &= ~mask;
+		cpld->fresh &= ~mask;
+	}
+
+	if (cpld->cache_dir != NULL) {
+		cpld_cache_path(cpld, cpld->cache_dir, path, sizeof(path));
+		unlink(path);
+	}
+	if (env != NULL && env[0] != '\0') {
+		cpld_cache_path(cpld, env, path, sizeof(path));
+		unlink(path);
+	}
+	if (cpld_cache_default(dir, sizeof(dir)) == 0) {
+		cpld_cache_path(cpld, dir, path, sizeof(path));
+		unlink(path);
+	}
+}
@@ -0,0 +1,508 @@
+/**
+ * Copyright (C) 2020 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include "command.h"
+#include "cache.h"
+#include "daemon.h"
+#include "usbdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAJOR_VERSION 1
+#define MINOR_VERSION 7
+
+/* Output stream of the calling thread, NULL means stdout */
+static __thread FILE *cpld_out;
+
+static const char *cpld_nv_state_name[] = {
+	[CPLD_NV_UNCHANGED] = "unchanged",
+	[CPLD_NV_WRITTEN] = "written",
+	[CPLD_NV_FAILED] = "failed"
+};
+
+/**
+ * usage
+ */
+void usage(char *pn)
+{
+	printf("CPLD control version %d.%d.1\n", MAJOR_VERSION, MINOR_VERSION);
+	printf("\nThe valid <Board name>: M3SK, H3SK, V3HSK, V3MSK, V3U, S4 and the boards\n");
+	printf("of the board definition file\n\n");
+	printf("%s -h ....................................................... ", pn);
+	printf("Print this help.\n");
+
+	printf("%s -l [--json] .............................................. ", pn);
+	printf("List available devices.\n");
+
+	printf("%s -c <Board name> <Old serial number> <New serial number>... ", pn);
+	printf("Change FTDI serial number\n");
+
+	printf("%s -r <Board name> <FTDI iSerial> ........................... ", pn);
+	printf("Print all CPLD registers.\n");
+
+	printf("%s -r <Board name> <FTDI iSerial> <reg>* .................... ", pn);
+	printf("Print 1 CPLD register.\n");
+	printf("\t\t\t\t *One or more <reg> can be specified.\n");
+
+	printf("%s -w <Board name> <FTDI iSerial> [<reg> <val>]* ............ ", pn);
+	printf("Write CPLD register(s).\n");
+	printf("\t\t\t\t *One or more [<reg> <val>] pairs can be specified.\n");
+	printf("\t\t\t\t *The writes and the read back (see --verify) run as one\n");
+	printf("\t\t\t\t  bus transaction.\n");
+	printf("\t\t\t\t *Pairs of consecutive registers, in ascending order, are\n");
+	printf("\t\t\t\t  written in one bus access.\n");
+
+	printf("%s -wnv <Board name> <FTDI iSerial> [<reg> <val>]* .......... ", pn);
+	printf("Write non-volatile CPLD register(s).\n");
+	printf("\t\t\t\t *One or more [<reg> <val>] pairs can be specified.\n");
+	printf("\t\t\t\t *Flash pages that already hold the values are not reprogrammed.\n");
+
+	printf("%s -nvstat <Board name> <FTDI iSerial> ...................... ", pn);
+	printf("Print flash erase/program latency of the board.\n");
+	printf("\t\t\t\t *Statistics build up while the daemon keeps the board open.\n");
+
+	printf("\t\t\t\t *<reg> is a hex address or a register name such as MODE_SET.\n");
+	printf("\t\t\t\t *<FTDI iSerial> of -r, -w and -wnv may be a comma separated list\n");
+	printf("\t\t\t\t  or \"all\", the boards are then handled in parallel.\n");
+
+	printf("%s -daemon .................................................. ", pn);
+	printf("Keep boards open and serve commands on a Unix socket.\n");
+
+	printf("\nOptions (placed before the command):\n");
+	printf("--i2c-engine=<bitbang|syncbb|mpsse> ...................... ");
+	printf("Select I2C engine (default bitbang).\n");
+	printf("--i2c-khz=<kHz> .......................................... ");
+	printf("I2C SCL frequency, %d..%d (default per board).\n", I2C_KHZ_MIN, I2C_KHZ_MAX);
+	printf("--i2c-stats .............................................. ");
+	printf("Print USB transfers of each bitbang I2C access.\n");
+	printf("--verify=<written|full|none> ............................. ");
+	printf("Registers read back after -w and -wnv:\n");
+	printf("\t\t\t\t *written: the written registers (default), full: all\n");
+	printf("\t\t\t\t  registers. A written register that does not read back\n");
+	printf("\t\t\t\t  its value makes the command fail, except a self-clearing\n");
+	printf("\t\t\t\t  one such as RESET.\n");
+	printf("--nv-force ............................................... ");
+	printf("Reprogram flash pages that already hold the values.\n");
+	printf("--nv-erase=<us>,<ms> ..................................... ");
+	printf("First flash erase poll and deadline (default %d,%d).\n",
+	       CPLD_ERASE_WAIT_US, CPLD_ERASE_DEADLINE_MS);
+	printf("--nv-program=<us>,<ms> ................................... ");
+	printf("First flash program poll and deadline (default %d,%d).\n",
+	       CPLD_PROGRAM_WAIT_US, CPLD_PROGRAM_DEADLINE_MS);
+	printf("--spi-hold=<n> ........................................... ");
+	printf("Extra samples per SPI clock edge, 0..%d (default %d).\n", SPI_HOLD_MAX, SPI_HOLD);
+	printf("--cache[=<dir>] .......................................... ");
+	printf("Keep identity registers on disk, default dir $CPLD_CONTROL_CACHE\n");
+	printf("\t\t\t\t  or ~/.cache/cpld-control.\n");
+	printf("--no-cache ............................................... ");
+	printf("Read every register from the board.\n");
+	printf("--boards=<file> .......................................... ");
+	printf("Board definitions, default $CPLD_CONTROL_BOARDS or %s.\n",
+	       CPLD_BOARDS_DEFAULT);
+	printf("--socket=<path> .......................................... ");
+	printf("Daemon socket, default $CPLD_CONTROL_SOCKET or\n");
+	printf("\t\t\t\t  $XDG_RUNTIME_DIR/%s.\n", CPLD_SOCKET_NAME);
+	printf("\t\t\t\t *When a socket is given, commands go to the daemon and\n");
+	printf("\t\t\t\t  the other options must be passed to the daemon itself.\n");
+}
+
+/**
+ * Redirect the register output of the calling thread.
+ *
+ * @param	out	Stream to print to, NULL for stdout.
+ *
+ * @return	None.
+ */
+void cpld_set_output(FILE *out)
+{
+	cpld_out = out;
+}
+
+/**
+ * Get the register output stream of the calling thread.
+ *
+ * @param	None.
+ *
+ * @return	Output stream.
+ */
+FILE *cpld_output(void)
+{
+	return cpld_out ? cpld_out : stdout;
+}
+
+/**
+ * Escape a string for a JSON string literal. The serial comes from the
+ * EEPROM and may hold any character.
+ *
+ * @param	str	String to escape.
+ * @param	buf	Output buffer, 6 bytes per character of str are enough.
+ * @param	size	Size of buf.
+ *
+ * @return	None.
+ */
+static void cpld_json_string(const char *str, char *buf, int size)
+{
+	int n = 0;
+
+	for (; *str != '\0' && n < size - 7; str++) {
+		if (*str == '"' || *str == '\\')
+			n += snprintf(buf + n, size - n, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20 || (unsigned char)*str >= 0x7F)
+			n += snprintf(buf + n, size - n, "\\u%04x", (unsigned char)*str);
+		else
+			buf[n++] = *str;
+	}
+	buf[n] = '\0';
+}
+
+/**
+ * List all FTDI devices found.
+ *
+ * @param	json	Print a JSON array instead of text.
+ *
+ * @return	Failed when no devices found.
+ */
+uint8_t cpld_list(int json)
+{
+	int i, j, n, first = 1;
+	char port[4 * CPLD_USB_PORTS + 4];
+	struct cpld_usb_device dev[CPLD_USB_MAX];
+	char serial[6 * sizeof(dev[0].serial)];
+	struct product_context {
+		char *name;
+		uint16_t value;
+	};
+	struct product_context product_id[NUM_PRODUCT] = {
+	    {"FT232R", FT232R},
+	    {"FT2232", FT2232},
+	    {"FT4232", FT4232},
+	    {"FT232H", FT232H}
+	};
+
+	// checking and resetting all wrong boards before listing.
+	cpld_usb_reset_unnamed();
+
+	n = cpld_usb_scan(0, dev, CPLD_USB_MAX);
+	if (n < 0) {
+		fprintf(stderr, "Failed to list devices!\n");
+		return 1;
+	}
+
+	if (json)
+		printf("[");
+	for (i = 0; i < NUM_PRODUCT; i++) {
+		for (j = 0; j < n; j++) {
+			if (dev[j].product != product_id[i].value)
+				continue;
+
+			if (dev[j].failed) {
+				fprintf(stderr, "Skipping device %s!\n", product_id[i].name);
+				continue;
+			}
+
+			if (!json) {
+				printf("%s: %s\n", product_id[i].name, dev[j].serial);
+				continue;
+			}
+
+			cpld_usb_port(&dev[j], port, sizeof(port));
+			cpld_json_string(dev[j].serial, serial, sizeof(serial));
+			printf("%s\n  {\"product\": \"%s\", \"serial\": \"%s\", ",
+			       first ? "" : ",", product_id[i].name, serial);
+			printf("\"bus\": %d, \"address\": %d, \"port\": \"%s\"}",
+			       dev[j].bus, dev[j].address, port);
+			first = 0;
+		}
+	}
+	if (json)
+		printf("%s]\n", first ? "" : "\n");
+
+	return 0;
+}
+
+/**
+ * Check the command line of a command.
+ *
+ * @param	argc	Argument count.
+ * @param	argv	Argument vector.
+ *
+ * @return	-1 if the command can run, otherwise the exit status.
+ */
+int cpld_check_args(int argc, char *argv[])
+{
+	int ret = EXIT_FAILURE;
+
+	if ((argc < 2) || (argc == 2 && !strcmp(argv[1], "-h"))) {
+		usage(argv[0]);
+		return EXIT_SUCCESS;
+	}
+
+	if (!strcmp(argv[1], "-l") &&
+	    (argc == 2 || (argc == 3 && !strcmp(argv[2], "--json"))))
+		return -1;
+
+	if (argc > 2 && !strcmp(argv[1], "-l")) {
+		fprintf(stderr, "The -l option only takes --json!\n");
+		usage(argv[0]);
+		return ret;
+	}
+
+	if (argc != 5 && !strcmp(argv[1], "-c")) {
+		fprintf(stderr, "The -c option takes three arguments");
+		fprintf(stderr, "(board name, old serial number and new serial number)!\n");
+		usage(argv[0]);
+		return ret;
+	}
+
+	if (strcmp(argv[1], "-r") && strcmp(argv[1], "-w") && strcmp(argv[1], "-c") &&
+	    strcmp(argv[1], "-wnv") && strcmp(argv[1], "-nvstat") && argc >= 2) {
+		printf("Unknown option!\n");
+		usage(argv[0]);
+		return ret;
+	}
+
+	if (argc != 4 && !strcmp(argv[1], "-nvstat")) {
+		fprintf(stderr, "The -nvstat option takes one board name and one iSerial!\n");
+		usage(argv[0]);
+		return ret;
+	}
+
+	if (argc < 4 && !strcmp(argv[1], "-r")) {
+		fprintf(stderr, "The -d option takes at least one board name and one iSerial!\n");
+		usage(argv[0]);
+		return ret;
+	}
+
+	if (((argc < 6) || (((argc - 6) % 2) != 0)) && !strcmp(argv[1], "-w")) {
+		fprintf(stderr, "The -w option takes one board name, one iSerial ");
+		fprintf(stderr, "and at least one reg/val pair!\n");
+		usage(argv[0]);
+		return ret;
+	}
+
+	if (((argc < 6) || (((argc - 6) % 2) != 0)) && !strcmp(argv[1], "-wnv")) {
+		fprintf(stderr, "The -wnv option takes one board name, one iSerial ");
+		fprintf(stderr, "and at least one reg/val pair!\n");
+		usage(argv[0]);
+		return ret;
+	}
+
+	return -1;
+}
+
+/**
+ * Parse a register argument, either a register name or a hex address.
+ *
+ * @param	cpld	CPLD structure.
+ * @param	arg	Argument.
+ * @param	address	Register address.
+ *
+ * @return	0 on success, 1 if the address is too large.
+ */
+static int cpld_parse_reg(struct cpld_context *cpld, char *arg, uint64_t *address)
+{
+	const struct register_context *reg = cpld_find_reg(cpld, arg);
+
+	if (reg != NULL) {
+		*address = reg->address;
+		return 0;
+	}
+
+	*address = strtoull(arg, NULL, 16);
+	return *address == ULLONG_MAX;
+}
+
+/**
+ * Open a board for a command.
+ *
+ * @param	board	Board name.
+ * @param	serial	Device serial number.
+ *
+ * @return	CPLD structure, NULL on failure.
+ */
+struct cpld_context *cpld_command_open(char *board, char *serial)
+{
+	struct cpld_context *cpld;
+
+	fprintf(cpld_output(), "Using device %s with iSerial: %s\n\n", board, serial);
+
+	return cpld_open(&cpld, board, serial) == CPLD_OK ? cpld : NULL;
+}
+
+/**
+ * Exit status of a failed register access.
+ *
+ * @param	error	enum cpld_error.
+ *
+ * @return	255 for an address that cannot be accessed that way, 1 for
+ *		other failures, 0 on success.
+ */
+static int cpld_status(int error)
+{
+	if (error == CPLD_ERR_ADDRESS || error == CPLD_ERR_MODE || error == CPLD_ERR_NV)
+		return 255;
+
+	return error != CPLD_OK;
+}
+
+/**
+ * Print a register with its value.
+ *
+ * @param	reg	Register.
+ * @param	value	Value.
+ *
+ * @return	None.
+ */
+static void cpld_print_reg(const struct register_context *reg, uint64_t value)
+{
+	fprintf(cpld_output(), "%-15s 0x%0*jX: 0x%0*jX\n", reg->name,
+		reg->addr_length * 2, reg->address, reg->val_length * 2, value);
+}
+
+/**
+ * Print the registers of a mask, in table order.
+ *
+ * @param	cpld	CPLD structure.
+ * @param	value	Values, indexed like the register table.
+ * @param	valid	Registers to print.
+ *
+ * @return	None.
+ */
+static void cpld_print_regs(struct cpld_context *cpld, const uint64_t *value, uint32_t valid)
+{
+	const struct register_context *reg;
+	int i, count;
+
+	reg = cpld_registers(cpld, &count);
+	for (i = 0; i < count; i++)
+		if (valid & (1U << i))
+			cpld_print_reg(&reg[i], value[i]);
+}
+
+/**
+ * Run a command on an initialized CPLD.
+ *
+ * @param	cpld	CPLD structure.
+ * @param	argc	Argument count.
+ * @param	argv	Argument vector.
+ *
+ * @return	Exit status of the command.
+ */
+int cpld_command(struct cpld_context *cpld, int argc, char *argv[])
+{
+	const struct register_context *r;
+	uint64_t value[CPLD_REG_MAX];
+	uint32_t valid;
+	uint64_t reg;
+	uint64_t val;
+	char *endptr;
+	int i, err, ret = EXIT_SUCCESS;
+
+	/* Change serial number */
+	if (argc == 5 && !strcmp(argv[1], "-c")) {
+		if (cpld_change_serial(cpld, argv[4]) != CPLD_OK) {
+			fprintf(stderr, "Failed to change serial!\n");
+			return EXIT_FAILURE;
+		}
+		fprintf(cpld_output(),
+			"Serial number has been changed, please run cpld-control -l to re-check!\n");
+	}
+
+	/* Identity registers of the last session */
+	if (!strcmp(argv[1], "-r") || !strcmp(argv[1], "-w") || !strcmp(argv[1], "-wnv"))
+		cpld_cache_open(cpld);
+
+	/* Dump registers */
+	if (argc == 4 && !strcmp(argv[1], "-r")) {
+		ret = cpld_status(cpld_reg_dump(cpld, value, &valid));
+		cpld_print_regs(cpld, value, valid);
+	} else if (argc > 4 && !strcmp(argv[1], "-r")) {
+		for (i = 4; i < argc; i++) {
+			if (cpld_parse_reg(cpld, argv[i], &reg))
+				fprintf(stderr, "The address %s is too large!\n", argv[i]);
+			else if ((err = cpld_reg_read(cpld, reg, &val)) != CPLD_OK)
+				ret |= cpld_status(err);
+			else
+				cpld_print_reg(cpld_get_reg(cpld, reg), val);
+		}
+	}
+
+	/* Write registers and read them back, in one bus session */
+	if (argc >= 5 && (((argc - 6) % 2) == 0) && !strcmp(argv[1], "-w")) {
+		uint64_t w_reg[(argc - 4) / 2], w_val[(argc - 4) / 2];
+		uint8_t done[(argc - 4) / 2];
+		int count = 0;
+
+		for (i = 4; i < argc; i += 2) {
+			val = strtoull(argv[i + 1], &endptr, 16);
+			if (cpld_parse_reg(cpld, argv[i], &reg) || val == ULLONG_MAX) {
+				fprintf(stderr, "The address %s or value %s is too large!\n",
+					argv[i],
+					argv[i + 1]);
+				ret = cpld_status(CPLD_ERR_ADDRESS);
+			} else {
+				w_reg[count] = reg;
+				w_val[count] = val;
+				count++;
+			}
+		}
+
+		ret |= cpld_status(cpld_reg_write(cpld, w_reg, w_val, count, done, value, &valid));
+		for (i = 0; i < count; i++) {
+			r = cpld_get_reg(cpld, w_reg[i]);
+			if (done[i])
+				fprintf(cpld_output(), "Writing register 0x%0*jX with value 0x%0*jX\n",
+					r->addr_length * 2, w_reg[i], r->val_length * 2, w_val[i]);
+		}
+		cpld_print_regs(cpld, value, valid);
+	}
+
+	/* Write non-volatile registers, all pairs of a flash page in one cycle */
+	if (argc >= 5 && (((argc - 6) % 2) == 0) && !strcmp(argv[1], "-wnv")) {
+		uint64_t nv_reg[(argc - 4) / 2], nv_val[(argc - 4) / 2];
+		uint8_t state[(argc - 4) / 2];
+		int count = 0;
+
+		for (i = 4; i < argc; i += 2) {
+			val = strtoull(argv[i + 1], &endptr, 16);
+			if (cpld_parse_reg(cpld, argv[i], &reg) || val == ULLONG_MAX) {
+				fprintf(stderr, "The address %s or value %s is too large!\n",
+					argv[i],
+					argv[i + 1]);
+				ret = cpld_status(CPLD_ERR_ADDRESS);
+			} else {
+				nv_reg[count] = reg;
+				nv_val[count] = val;
+				count++;
+			}
+		}
+		if (count > 0) {
+			ret |= cpld_status(cpld_reg_write_nv(cpld, nv_reg, nv_val, count, state,
+							     value, &valid));
+			for (i = 0; i < count; i++) {
+				r = cpld_get_reg(cpld, nv_reg[i]);
+				if (state[i] != CPLD_NV_SKIPPED)
+					fprintf(cpld_output(),
+						"Writing register 0x%0*jX with value 0x%0*jX: %s\n",
+						r->addr_length * 2, r->address, r->val_length * 2,
+						nv_val[i], cpld_nv_state_name[state[i]]);
+			}
+			cpld_print_regs(cpld, value, valid);
+		}
+	}
+
+	cpld_cache_close(cpld);
+
+	/* Flash latency of the board */
+	if (argc == 4 && !strcmp(argv[1], "-nvstat")) {
+		cpld_flash_print(cpld_output(), "erase", &cpld->flash[CPLD_FLASH_ERASE]);
+		cpld_flash_print(cpld_output(), "program", &cpld->flash[CPLD_FLASH_PROGRAM]);
+	}
+
+	return ret;
+}
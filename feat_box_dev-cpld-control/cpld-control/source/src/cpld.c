@@ -6,980 +6,1556 @@
  * published by the Free Software Foundation.
  */
 #include "cpld.h"
+#include "cache.h"
+#include "usbdev.h"
 #include <stdio.h>
 #include <string.h>
 
+/* Settings of the CPLD structures opened from now on */
+static enum cpld_verify cpld_verify_default = CPLD_VERIFY_WRITTEN;
+static uint8_t cpld_nv_force_default;
+static enum i2c_engine cpld_i2c_engine_default = I2C_ENGINE_BITBANG;
+static uint32_t cpld_i2c_khz_default;	/* 0 for the board speed */
+static uint16_t cpld_spi_hold_default = SPI_HOLD;
+
+static const char *cpld_error_name[] = {
+	[CPLD_OK] = "Success",
+	[CPLD_ERR_BOARD] = "Unknown board",
+	[CPLD_ERR_DEVICE] = "Device not found or failed",
+	[CPLD_ERR_ADDRESS] = "Unsupported address",
+	[CPLD_ERR_MODE] = "Register is read or write only",
+	[CPLD_ERR_NV] = "Register is not non-volatile",
+	[CPLD_ERR_BUS] = "Bus transfer failed",
+	[CPLD_ERR_VERIFY] = "Register does not hold the written value",
+	[CPLD_ERR_REMOVED] = "Board removed",
+	[CPLD_ERR_LIMIT] = "Too many operations",
+	[CPLD_ERR_NOMEM] = "Out of memory",
+	[CPLD_ERR_RANGE] = "Setting out of range"
+};
+
 /**
- * Get the index-th device with a given, vendor id, product id and serial.
+ * Describe an error code.
  *
- * @param	vendor    Vendor ID.
- * @param	product   Product ID.
- * @param	serial    Serial Number.
+ * @param	error	enum cpld_error.
  *
- * @return	Index-th device.
- * Return -1 if cannot find any devices with that vendor ID and that product ID.
- * Return -2 if cannot find any devices with that serial number.
+ * @return	Text of the error.
  */
-int cpld_get_index(int vendor, int product, char *serial)
+const char *cpld_strerror(int error)
 {
-	int ret, index = 0;
-	char ser[32];
-	struct ftdi_context ftdi;
-	struct ftdi_device_list *list, *dev;
+	if (error < 0 || error >= (int)(sizeof(cpld_error_name) / sizeof(cpld_error_name[0])))
+		return "Unknown error";
 
-	ftdi_init(&ftdi);
-	ret = ftdi_usb_find_all(&ftdi, &list, vendor, product);
-	if (ret < 0) {
-		fprintf(stderr, "Failed to find device!\n");
-		ftdi_deinit(&ftdi);
-		return -1;
+	return cpld_error_name[error];
+}
+
+/**
+ * Keep the first error of a batch.
+ */
+static int cpld_error(int ret, int error)
+{
+	return ret != CPLD_OK ? ret : error;
+}
+
+/**
+ * Set the log handler of a CPLD.
+ *
+ * @param	cpld	CPLD structure, NULL for the default handler, which
+ *			also takes the messages of the bus layers.
+ * @param	fn	Handler, NULL for the default one (stderr).
+ * @param	arg	Argument of the handler.
+ *
+ * @return	None.
+ */
+void cpld_set_log(struct cpld_context *cpld, cpld_log_fn fn, void *arg)
+{
+	if (cpld == NULL) {
+		cpld_log_set_default(fn, arg);
+		return;
+	}
+
+	cpld->log.fn = fn;
+	cpld->log.arg = arg;
+}
+
+/**
+ * Select whether non-volatile writes skip pages that already hold the
+ * new values.
+ *
+ * @param	cpld	CPLD structure, NULL for the CPLDs opened from now on.
+ * @param	force	1 to always erase and reprogram.
+ *
+ * @return	None.
+ */
+void cpld_nv_set_force(struct cpld_context *cpld, uint8_t force)
+{
+	if (cpld == NULL)
+		cpld_nv_force_default = force;
+	else
+		cpld->nv_force = force;
+}
+
+/**
+ * Select which registers are read back after a write.
+ *
+ * @param	cpld	CPLD structure, NULL for the CPLDs opened from now on.
+ * @param	verify	Verification mode.
+ *
+ * @return	None.
+ */
+void cpld_set_verify(struct cpld_context *cpld, enum cpld_verify verify)
+{
+	if (cpld == NULL)
+		cpld_verify_default = verify;
+	else
+		cpld->verify = verify;
+}
+
+/**
+ * Set up the I2C bus of a CPLD with its engine and speed, other boards
+ * are left alone.
+ *
+ * @param	cpld	CPLD structure.
+ *
+ * @return	CPLD_OK, CPLD_ERR_DEVICE if the engine cannot be set up.
+ */
+static int cpld_i2c_setup(struct cpld_context *cpld)
+{
+	if (cpld->protocol != IIC)
+		return CPLD_OK;
+
+	if (i2c_init(cpld->mpsse, cpld->i2c_engine, cpld->i2c_khz) != MPSSE_OK)
+		return CPLD_ERR_DEVICE;
+
+	return CPLD_OK;
+}
+
+/**
+ * Select the I2C engine. The bus of an open board is set up again.
+ *
+ * @param	cpld	CPLD structure, NULL for the CPLDs opened from now on.
+ * @param	engine	I2C engine.
+ *
+ * @return	CPLD_OK, CPLD_ERR_DEVICE if the engine cannot be set up.
+ */
+int cpld_set_i2c_engine(struct cpld_context *cpld, enum i2c_engine engine)
+{
+	if (cpld == NULL) {
+		cpld_i2c_engine_default = engine;
+		return CPLD_OK;
+	}
+
+	cpld->i2c_engine = engine;
+	return cpld_i2c_setup(cpld);
+}
+
+/**
+ * Set the SCL frequency, overriding the one of the board. The bus of an
+ * open board is set up again.
+ *
+ * @param	cpld	CPLD structure, NULL for the CPLDs opened from now on.
+ * @param	khz	SCL frequency in kHz, I2C_KHZ_MIN to I2C_KHZ_MAX, 0 for
+ *			the board speed.
+ *
+ * @return	CPLD_OK, CPLD_ERR_RANGE or CPLD_ERR_DEVICE.
+ */
+int cpld_set_i2c_khz(struct cpld_context *cpld, uint32_t khz)
+{
+	if (khz != 0 && (khz < I2C_KHZ_MIN || khz > I2C_KHZ_MAX))
+		return CPLD_ERR_RANGE;
+
+	if (cpld == NULL) {
+		cpld_i2c_khz_default = khz;
+		return CPLD_OK;
 	}
 
-	for (dev = list; dev != NULL; dev = dev->next) {
-		ret = ftdi_usb_get_strings(&ftdi, dev->dev, NULL, 0, NULL, 0, ser, 32);
-		if (ret == 0 && strcmp(serial, ser) == 0) {
-			ftdi_list_free(&list);
-			ftdi_deinit(&ftdi);
-			return index;
+	cpld->i2c_khz = khz ? khz : cpld->board->i2c_khz;
+	return cpld_i2c_setup(cpld);
+}
+
+/**
+ * Set the number of extra samples each SPI clock level is held for. The
+ * bus of an open board is set up again.
+ *
+ * @param	cpld	CPLD structure, NULL for the CPLDs opened from now on.
+ * @param	hold	Extra samples, at most SPI_HOLD_MAX.
+ *
+ * @return	CPLD_OK, CPLD_ERR_RANGE or CPLD_ERR_DEVICE.
+ */
+int cpld_set_spi_hold(struct cpld_context *cpld, uint16_t hold)
+{
+	if (hold > SPI_HOLD_MAX)
+		return CPLD_ERR_RANGE;
+
+	if (cpld == NULL) {
+		cpld_spi_hold_default = hold;
+		return CPLD_OK;
+	}
+
+	cpld->spi_hold = hold;
+	if (cpld->protocol == SPI && spi_init(cpld->mpsse, hold) != MPSSE_OK)
+		return CPLD_ERR_DEVICE;
+
+	return CPLD_OK;
+}
+
+/**
+ * Check whether the board of a CPLD has been unplugged. Only the hotplug
+ * monitor of the daemon sets the flag.
+ *
+ * @param	cpld	CPLD structure.
+ *
+ * @return	1 if the board is gone.
+ */
+static uint8_t cpld_removed(struct cpld_context *cpld)
+{
+	if (!__atomic_load_n(&cpld->removed, __ATOMIC_ACQUIRE))
+		return 0;
+
+	cpld_log(&cpld->log, CPLD_LOG_ERROR, "Board %s has been removed!", cpld->board_name);
+	return 1;
+}
+
+/**
+ * Open the FTDI device of a CPLD by serial. The device is looked up in the
+ * discovery cache and opened by bus/address. A cached entry that cannot be
+ * opened any more (board replugged) is dropped and the bus scanned again.
+ *
+ * @param	cpld	CPLD structure.
+ * @param	serial	Device serial number.
+ *
+ * @return	MPSSE structure of the opened device, NULL on failure.
+ */
+static struct mpsse_context *cpld_open_device(struct cpld_context *cpld, const char *serial)
+{
+	int retry;
+	struct cpld_usb_device dev;
+	struct mpsse_context *mpsse;
+
+	for (retry = 0; retry < 2; retry++) {
+		if (cpld_usb_find(cpld->product_id, serial, &dev) != 0) {
+			cpld_log(&cpld->log, CPLD_LOG_ERROR, "Failed to find serial number!");
+			return NULL;
+		}
+
+		mpsse = OpenBusAddr(VENDOR, cpld->product_id, BITBANG, 0, 0, cpld->board->iface,
+				    dev.bus, dev.address);
+		if (mpsse != NULL && mpsse->open) {
+			cpld_usb_attach(&dev, &cpld->removed);
+			return mpsse;
 		}
-		index++;
+
+		Close(mpsse);
+		cpld_usb_forget(&dev);
 	}
 
-	fprintf(stderr, "Failed to find serial number!\n");
-	ftdi_list_free(&list);
-	ftdi_deinit(&ftdi);
-	return -2;
+	cpld_log(&cpld->log, CPLD_LOG_ERROR, "Cannot open device!");
+	return NULL;
 }
 
 /**
-     * Initialize CPLD.
+ * Get CPLD infomation.
  *
- * @param   board	Board name.
- * @param   serial	Device serial number.
+ * @param	cpld	CPLD structure.
+ * @param	board	Board name.
  *
- * @return  A pointer to an CPLD context structure.
+ * @return	CPLD_OK, CPLD_ERR_BOARD if the board is unknown.
  */
-struct cpld_context *cpld_init(char *board, char *serial)
+static int cpld_get_info(struct cpld_context *cpld, const char *board)
 {
-	int ret, index;
-	struct cpld_context *cpld;
+	cpld->board = cpld_board_find(board);
+	if (cpld->board == NULL) {
+		cpld_log(&cpld->log, CPLD_LOG_ERROR, "CPLD is not supported for %s", board);
+		return CPLD_ERR_BOARD;
+	}
+
+	snprintf(cpld->board_name, sizeof(cpld->board_name), "%s", board);
+	cpld->reg = cpld->board->reg;
+	cpld->protocol = cpld->board->protocol;
+	cpld->product_id = cpld->board->product_id;
+	cpld->i2c_khz = cpld_i2c_khz_default ? cpld_i2c_khz_default : cpld->board->i2c_khz;
+	return CPLD_OK;
+}
+
+/**
+ * Open the CPLD of a board.
+ *
+ * Messages of the open go to the default log handler.
+ *
+ * @param	cpld	Set to the new CPLD structure, NULL on failure.
+ * @param	board	Board name.
+ * @param	serial	Device serial number.
+ *
+ * @return	CPLD_OK, CPLD_ERR_BOARD, CPLD_ERR_DEVICE or CPLD_ERR_NOMEM.
+ */
+int cpld_open(struct cpld_context **cpld, const char *board, const char *serial)
+{
+	struct cpld_context *ctx;
+	int ret;
 
-	printf("Using device %s with iSerial: %s\n\n", board, serial);
+	*cpld = NULL;
 
 	/* Initialize CPLD structure */
-	cpld = (struct cpld_context *)malloc(sizeof(struct cpld_context));
-	cpld->board_name = board;
-	cpld->reg = NULL;
-	ret = cpld_get_info(cpld);
-	if (ret != 0)
-		return NULL;
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL)
+		return CPLD_ERR_NOMEM;
+	ctx->i2c_engine = cpld_i2c_engine_default;
+	ctx->spi_hold = cpld_spi_hold_default;
+	ctx->verify = cpld_verify_default;
+	ctx->nv_force = cpld_nv_force_default;
+	cpld_flash_get_poll(ctx->poll);
+	cpld_cache_set_dir(ctx, cpld_cache_get_dir());
+	snprintf(ctx->serial, sizeof(ctx->serial), "%s", serial);
+	ret = cpld_get_info(ctx, board);
 
 	/* Initialize MPSSE structure */
-	index = cpld_get_index(VENDOR, cpld->product_id, serial);
-	if (index < 0)
-		return NULL;
+	if (ret == CPLD_OK) {
+		ctx->mpsse = cpld_open_device(ctx, serial);
+		if (ctx->mpsse == NULL)
+			ret = CPLD_ERR_DEVICE;
+	}
+	if (ret != CPLD_OK) {
+		free(ctx->cache_dir);
+		free(ctx);
+		return ret;
+	}
 
-	if (cpld->protocol == SPI) { // M3/H3 Starter Kit
-		cpld->mpsse = OpenIndex(VENDOR, cpld->product_id, BITBANG, 0, 0, IFACE_A,
-					NULL, NULL, index);
-		spi_init(cpld->mpsse);
-	} else if (cpld->protocol == SMI) { // V3M Starter Kit
-		cpld->mpsse = OpenIndex(VENDOR, cpld->product_id, BITBANG, 0, 0, IFACE_A,
-					NULL, NULL, index);
-		smi_init(cpld->mpsse);
-	} else { // V3U/V3H Starter Kit/S4
-		cpld->mpsse = OpenIndex(VENDOR, cpld->product_id, BITBANG, 0, 0, IFACE_B,
-					NULL, NULL, index);
-		i2c_init(cpld->mpsse);
-	}
-	if (cpld->mpsse->open == 0) {
-		fprintf(stderr, "Cannot open device!\n");
-		return NULL;
+	if (ctx->protocol == SPI) // M3/H3 Starter Kit
+		spi_init(ctx->mpsse, ctx->spi_hold);
+	else if (ctx->protocol == SMI) { // V3M Starter Kit
+		smi_init(ctx->mpsse);
+		/* Drop the preamble if PRODUCT reads back the same without it */
+		smi_detect_preamble(ctx->mpsse, ctx->reg->address);
+	}
+	else if (cpld_i2c_setup(ctx) != CPLD_OK) { // V3U/V3H Starter Kit/S4
+		cpld_close(ctx);
+		return CPLD_ERR_DEVICE;
 	}
 
-	return cpld;
+	*cpld = ctx;
+	return CPLD_OK;
 }
 
 /**
- * Append a register to list
+ * Collect the serials of all FTDI devices used by a board type.
  *
- * @param	cpld_reg	CPLD register structure.
- * @param	name		Register name.
- * @param	address		Register address.
- * @param	addr_length	Address length.
- * @param	val_length	Value length.
- * @param	mode		Register mode.
+ * @param	board	Board name.
+ * @param	serial	Array to store the serials.
+ * @param	max	Number of entries in serial.
  *
- * @return	failed(1) if cannot create new register structure.
+ * @return	Number of serials found, -1 on failure.
  */
-uint8_t cpld_add_reg(struct register_context **cpld_reg,
-		     char *name,
-		     uint16_t address,
-		     uint8_t addr_length,
-		     uint8_t val_length,
-		     enum register_mode mode)
+int cpld_list_serials(const char *board, char (*serial)[32], int max)
 {
-	struct register_context *node = *cpld_reg;
-	struct register_context *reg =
-		(struct register_context *)malloc(sizeof(struct register_context));
+	int i, n, count = 0;
+	struct cpld_context cpld = { 0 };
+	struct cpld_usb_device dev[CPLD_USB_MAX];
 
-	if (reg == NULL) {
-		fprintf(stderr, "Cannot create node!\n");
-		return 1;
+	if (cpld_get_info(&cpld, board) != CPLD_OK)
+		return -1;
+
+	n = cpld_usb_scan(cpld.product_id, dev, CPLD_USB_MAX);
+	if (n < 0) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "Failed to find device!");
+		return -1;
 	}
 
-	/* add register infomation */
-	reg->name = (char *)malloc(strlen(name) * sizeof(char));
-	memcpy(reg->name, name, strlen(name));
-	reg->address = address;
-	reg->value = 0;
-	reg->addr_length = addr_length;
-	reg->val_length = val_length;
-	reg->mode = mode;
-	reg->pnext = NULL;
+	for (i = 0; i < n && count < max; i++)
+		if (dev[i].serial[0] != '\0')
+			strcpy(serial[count++], dev[i].serial);
 
-	/* add new register to the end of list */
-	if (node == NULL) {
-		*cpld_reg = reg;
-		return 0;
+	return count;
+}
+
+/**
+ * Change FTDI serial number
+ *
+ * @param	cpld	CPLD structure.
+ * @param	serial	New serial need to change to
+ *
+ * @return	CPLD_OK, CPLD_ERR_DEVICE if the EEPROM cannot be written.
+ */
+int cpld_change_serial(struct cpld_context *cpld, const char *serial)
+{
+	struct ftdi_context *ftdi = &cpld->mpsse->ftdi;
+	int ret;
+
+	ftdi_eeprom_initdefaults(ftdi, NULL, NULL, (char *)serial);
+	ret = ftdi_erase_eeprom(ftdi);
+	if (ftdi_set_eeprom_value(ftdi, MAX_POWER, 500) < 0)
+		cpld_log(&cpld->log, CPLD_LOG_ERROR, "ftdi_set_eeprom_value: %d (%s)", ret,
+			 ftdi_get_error_string(ftdi));
+
+	ret = ftdi_eeprom_build(ftdi);
+	if (ret < 0) {
+		cpld_log(&cpld->log, CPLD_LOG_ERROR, "Erase failed: %s",
+			 ftdi_get_error_string(ftdi));
+		return CPLD_ERR_DEVICE;
+	}
+	ret = ftdi_write_eeprom(ftdi);
+	if (ret < 0) {
+		cpld_log(&cpld->log, CPLD_LOG_ERROR, "ftdi_eeprom_decode: %d (%s)", ret,
+			 ftdi_get_error_string(ftdi));
+		return CPLD_ERR_DEVICE;
 	}
 
-	while (node->pnext != NULL)
-		node = node->pnext;
+	return CPLD_OK;
+}
 
-	node->pnext = reg;
-	return 0;
+/**
+ * Check whether an address lies in the flash pages of a board whose
+ * layout has a read lag, which have to be read with smi_read_flash.
+ */
+static int cpld_flash_window(struct cpld_context *cpld, uint64_t address)
+{
+	return cpld->board->nv != NULL && cpld->board->nv->read_lag &&
+	       address >= cpld->board->nv->base[0];
 }
 
 /**
- * Get CPLD infomation.
+ * Last value of a register, kept in the CPLD structure.
+ */
+static uint64_t *cpld_reg_value(struct cpld_context *cpld, const struct register_context *reg)
+{
+	return &cpld->value[reg - cpld->reg];
+}
+
+/**
+ * Copy the values of the registers of a mask to a caller buffer.
  *
  * @param	cpld	CPLD structure.
+ * @param	mask	Registers with a value.
+ * @param	value	Buffer indexed like the register table, may be NULL.
+ * @param	valid	Set to mask, may be NULL.
  *
- * @return	integer value.
- * return 0 if success.
- * return 1 if failure.
- */
-uint8_t cpld_get_info(struct cpld_context *cpld)
-{
-	if (strcmp(cpld->board_name, "H3SK") == 0 || strcmp(cpld->board_name, "M3SK") == 0) {
-	/* H3/M3 Starter Kit */
-		cpld->protocol = SPI;
-		cpld->product_id = 0x6001;
-		cpld_add_reg(&cpld->reg, "MODE",    0x00, 1, 4, RW);
-		cpld_add_reg(&cpld->reg, "MUX",     0x02, 1, 4, RW);
-		cpld_add_reg(&cpld->reg, "DIPSW6",  0x08, 1, 4, R);
-		cpld_add_reg(&cpld->reg, "RESET",   0x80, 1, 4, RW);
-		cpld_add_reg(&cpld->reg, "VERSION", 0xFF, 1, 4, R);
-	} else if (strcmp(cpld->board_name, "V3U") == 0) {
-	/* V3U */
-		cpld->protocol = IIC;
-		cpld->product_id = 0x6010;
-		cpld_add_reg(&cpld->reg, "PRODUCT",     0x0000, 2,  4, R);
-		cpld_add_reg(&cpld->reg, "VERSION",     0x0004, 2,  4, R);
-		cpld_add_reg(&cpld->reg, "MODE_SET",    0x0008, 2,  8, RW);
-		cpld_add_reg(&cpld->reg, "MODE_NEXT",   0x0010, 2,  8, R);
-		cpld_add_reg(&cpld->reg, "MODE_LAST",   0x0018, 2,  8, R);
-		cpld_add_reg(&cpld->reg, "DIPSW50",     0x0020, 2,  1, R);
-		cpld_add_reg(&cpld->reg, "I2C_ADDR",    0x0022, 2,  1, RW);
-		cpld_add_reg(&cpld->reg, "RESET",       0x0024, 2,  1, RW);
-		cpld_add_reg(&cpld->reg, "POWER_CFG",   0x0025, 2,  1, RW);
-		cpld_add_reg(&cpld->reg, "PERI_CFG",    0x0030, 2,  1, RW);
-		cpld_add_reg(&cpld->reg, "UART_CFG",    0x0036, 2,  1, RW);
-		cpld_add_reg(&cpld->reg, "UART_STATUS", 0x0037, 2,  1, R);
-		cpld_add_reg(&cpld->reg, "CNT_POWER",   0x0080, 2,  4, R);
-		cpld_add_reg(&cpld->reg, "CNT_RESET",   0x0084, 2,  4, R);
-		cpld_add_reg(&cpld->reg, "PCB_VERSION", 0x1000, 2,  2, R);
-		cpld_add_reg(&cpld->reg, "SOC_VERSION", 0x1002, 2,  2, R);
-		cpld_add_reg(&cpld->reg, "PCB_SN",      0x1004, 2,  4, R);
-		cpld_add_reg(&cpld->reg, "MAC",         0x1008, 2,  6, R);
-	} else if (strcmp(cpld->board_name, "V3HSK") == 0) {
-	/* V3H Starter Kit */
-		cpld->protocol = IIC;
-		cpld->product_id = 0x6010;
-		cpld_add_reg(&cpld->reg, "PRODUCT",      0x0000, 2, 4, R);
-		cpld_add_reg(&cpld->reg, "VERSION",      0x0004, 2, 4, R);
-		cpld_add_reg(&cpld->reg, "MODE_SET",     0x0008, 2, 5, RW);
-		cpld_add_reg(&cpld->reg, "MODE_NEXT",    0x0010, 2, 5, R);
-		cpld_add_reg(&cpld->reg, "MODE_LAST",    0x0018, 2, 5, R);
-		cpld_add_reg(&cpld->reg, "DIPSW4",       0x0020, 2, 1, R);
-		cpld_add_reg(&cpld->reg, "DIPSW5",       0x0021, 2, 1, R);
-		cpld_add_reg(&cpld->reg, "I2C_ADDR",     0x0022, 2, 1, RW);
-		cpld_add_reg(&cpld->reg, "RESET",        0x0024, 2, 1, RW);
-		cpld_add_reg(&cpld->reg, "POWER_CFG",    0x0025, 2, 1, RW);
-		cpld_add_reg(&cpld->reg, "PMIC_CFG",     0x0026, 2, 1, RW);
-		cpld_add_reg(&cpld->reg, "PCIE_CLK_CFG", 0x0027, 2, 1, RW);
-		cpld_add_reg(&cpld->reg, "PERI_CFG",     0x0030, 2, 4, RW);
-		cpld_add_reg(&cpld->reg, "LEDS",         0x0034, 2, 1, RW);
-		cpld_add_reg(&cpld->reg, "LEDS_CFG",     0x0035, 2, 1, RW);
-		cpld_add_reg(&cpld->reg, "UART_CFG",     0x0036, 2, 1, RW);
-		cpld_add_reg(&cpld->reg, "UART_STATUS",  0x0037, 2, 1, R);
-		cpld_add_reg(&cpld->reg, "PCB_VERSION",  0x1000, 2, 2, R);
-		cpld_add_reg(&cpld->reg, "SOC_VERSION",  0x1002, 2, 2, R);
-		cpld_add_reg(&cpld->reg, "PCB_SN",       0x1004, 2, 2, R);
-		cpld_add_reg(&cpld->reg, "MAC",          0x1008, 2, 6, R);
-	} else if (strcmp(cpld->board_name, "V3MSK") == 0) {
-	/* V3M Starter Kit */
-		cpld->protocol = SMI;
-		cpld->product_id = 0x6001;
-		cpld_add_reg(&cpld->reg, "PRODUCT",      0x000, 2, 4, R);
-		cpld_add_reg(&cpld->reg, "VERSION",      0x002, 2, 4, R);
-		cpld_add_reg(&cpld->reg, "MODE_SET",     0x004, 2, 4, RW);
-		cpld_add_reg(&cpld->reg, "MODE_APPLIED", 0x006, 2, 4, R);
-		cpld_add_reg(&cpld->reg, "DIPSW",        0x008, 2, 2, R);
-		cpld_add_reg(&cpld->reg, "RESET",        0x00A, 2, 2, RW);
-		cpld_add_reg(&cpld->reg, "POWER_CFG",    0x00B, 2, 2, RW);
-		cpld_add_reg(&cpld->reg, "PERI_CFG",     0x00C, 2, 4, RW);
-		cpld_add_reg(&cpld->reg, "LEDS",         0x00E, 2, 4, RW);
-		cpld_add_reg(&cpld->reg, "PCB_VERSION",  0x300, 2, 2, R);
-		cpld_add_reg(&cpld->reg, "SOC_VERSION",  0x301, 2, 2, R);
-		cpld_add_reg(&cpld->reg, "PCB_SN",       0x302, 2, 4, R);
-	} else if (strcmp(cpld->board_name, "S4") == 0) {
-	/* S4 */
-		cpld->protocol = IIC;
-		cpld->product_id = 0x6010;
-		cpld_add_reg(&cpld->reg, "PRODUCT",     0x0000, 2,  4, R);
-		cpld_add_reg(&cpld->reg, "VERSION",     0x0004, 2,  4, R);
-		cpld_add_reg(&cpld->reg, "MODE_SET",    0x0008, 2,  8, RW);
-		cpld_add_reg(&cpld->reg, "MODE_NEXT",   0x0010, 2,  8, R);
-		cpld_add_reg(&cpld->reg, "MODE_LAST",   0x0018, 2,  8, R);
-		cpld_add_reg(&cpld->reg, "DIPSW8",      0x0020, 2,  1, R);
-		cpld_add_reg(&cpld->reg, "I2C_ADDR",    0x0022, 2,  1, RW);
-		cpld_add_reg(&cpld->reg, "RESET",       0x0024, 2,  1, RW);
-		cpld_add_reg(&cpld->reg, "POWER_CFG",   0x0025, 2,  1, RW);
-		cpld_add_reg(&cpld->reg, "PERI_CFG",    0x0030, 2,  1, RW);
-		cpld_add_reg(&cpld->reg, "UART_CFG",    0x0036, 2,  1, RW);
-		cpld_add_reg(&cpld->reg, "UART_STATUS", 0x0037, 2,  1, R);
-		cpld_add_reg(&cpld->reg, "CNT_POWER",   0x0080, 2,  4, R);
-		cpld_add_reg(&cpld->reg, "CNT_RESET",   0x0084, 2,  4, R);
-		cpld_add_reg(&cpld->reg, "PCB_VERSION", 0x1000, 2,  2, R);
-		cpld_add_reg(&cpld->reg, "SOC_VERSION", 0x1002, 2,  2, R);
-		cpld_add_reg(&cpld->reg, "PCB_SN",      0x1004, 2,  4, R);
-		cpld_add_reg(&cpld->reg, "MAC",         0x1008, 2,  6, R);
-	} else {
-		fprintf(stderr, "CPLD is not supported for %s\n", cpld->board_name);
-		return 1;
+ * @return	None.
+ */
+static void cpld_copy_out(struct cpld_context *cpld, uint32_t mask, uint64_t *value,
+			  uint32_t *valid)
+{
+	int i;
+
+	for (i = 0; value != NULL && i < cpld->board->count; i++)
+		if (mask & (1U << i))
+			value[i] = cpld->value[i];
+	if (valid != NULL)
+		*valid = mask;
+}
+
+/**
+ * Look up a register to access.
+ *
+ * @param	cpld	CPLD structure.
+ * @param	address	Register address.
+ * @param	mode	R for a read, W for a write.
+ * @param	reg	Set to the register.
+ *
+ * @return	CPLD_OK, CPLD_ERR_ADDRESS or CPLD_ERR_MODE.
+ */
+static int cpld_check_reg(struct cpld_context *cpld, uint64_t address, enum register_mode mode,
+			  const struct register_context **reg)
+{
+	*reg = cpld_get_reg(cpld, address);
+	if (*reg == NULL) {
+		cpld_log(&cpld->log, CPLD_LOG_ERROR, "The address 0x%0*jX is not supported!",
+			 cpld->reg->addr_length * 2, address);
+		return CPLD_ERR_ADDRESS;
 	}
-	return 0;
+	if ((*reg)->mode != RW && (*reg)->mode != mode) {
+		cpld_log(&cpld->log, CPLD_LOG_ERROR, "The address 0x%0*jX is %s only!",
+			 (*reg)->addr_length * 2, address, (*reg)->mode == R ? "read" : "write");
+		return CPLD_ERR_MODE;
+	}
+
+	return CPLD_OK;
 }
 
 /**
- * Reset all wrong FTDI.
+ * Read value from an address of CPLD. Registers of the register cache
+ * are not read from the board.
  *
- * @param	None.
+ * @param	cpld	CPLD structure.
+ * @param	address	CPLD address need to read.
+ * @param	value	Buffer of the value.
  *
- * @return	Failed when cannot reset usb device.
+ * @return	CPLD_OK, or the error that stopped the read.
  */
-int cpld_reset_usb(void)
+int cpld_reg_read(struct cpld_context *cpld, uint64_t address, uint64_t *value)
 {
-	int i = 0;
-	int ret = 0;
-	libusb_device_handle *dev;
-	struct libusb_device *usb, **list;
-	struct libusb_device_descriptor desc;
+	const struct register_context *reg;
+	int ret;
 
-	ret = libusb_init(NULL);
-	if (ret < 0) {
-		fprintf(stderr, "libusb: Initialized failed!\n");
+	if (cpld_removed(cpld))
+		return CPLD_ERR_REMOVED;
+	ret = cpld_check_reg(cpld, address, R, &reg);
+	if (ret != CPLD_OK)
 		return ret;
+
+	if (!(cpld->cached & CPLD_REG_BIT(cpld, reg))) {
+		if (cpld_read_span(cpld, reg->address, reg->addr_length,
+				   (uint8_t *)cpld_reg_value(cpld, reg), reg->val_length) != 0)
+			return CPLD_ERR_BUS;
+		cpld->fresh |= CPLD_REG_BIT(cpld, reg);
 	}
 
-	ret = libusb_get_device_list(NULL, &list);
-	if (ret < 0) {
-		fprintf(stderr, "libusb: Get list of device failed!\n");
-		libusb_exit(NULL);
-		return ret;
+	*value = *cpld_reg_value(cpld, reg);
+	return CPLD_OK;
+}
+
+/**
+ * Non-volatile layout.
+ *
+ * A board keeps two flash pages: page 0 holds the power-on value of the
+ * configuration registers, page 1 the board identity. Writing a register
+ * reads the page back, patches it, erases it and programs it again one
+ * program unit at a time. Only the bytes up to the last field of a page
+ * are kept, so that is all that is read and programmed. The layouts
+ * belong to the board descriptions.
+ */
+
+/* Flash of one board while a page is written */
+struct cpld_nv_flash {
+	struct cpld_context *cpld;
+	const struct cpld_nv_layout *layout;
+};
+
+static const struct cpld_nv_field *cpld_nv_field(const struct cpld_nv_layout *layout,
+						 uint64_t address)
+{
+	const struct cpld_nv_field *field;
+
+	for (field = layout->field; field->length != 0; field++) {
+		if (field->address == address)
+			return field;
 	}
 
-	while ((usb = list[i++]) != NULL) {
-		ret = libusb_get_device_descriptor(usb, &desc);
-		if (ret < 0) {
-			fprintf(stderr, "libusb: Fail to get device description!\n");
-			goto libusb_err;
-		}
+	return NULL;
+}
 
-		if (desc.idVendor == VENDOR && desc.idProduct == FT4232 &&
-		    desc.iSerialNumber == 0) {
-			ret = libusb_open(usb, &dev);
-			if (ret < 0) {
-				fprintf(stderr, "libusb: Cannot open usb device!\n");
-				libusb_close(dev);
-				goto libusb_err;
-			}
-			libusb_reset_device(dev);
-			usleep(300000);
-			libusb_close(dev);
-		}
+/**
+ * Number of bytes kept in a flash page: up to its last field or the span
+ * of the layout, whichever is longer, rounded up to whole program commands.
+ */
+static int cpld_nv_span(const struct cpld_nv_layout *layout, int page)
+{
+	const struct cpld_nv_field *field;
+	int span = layout->span[page];
+
+	for (field = layout->field; field->length != 0; field++) {
+		if (field->page == page && field->offset + field->length > span)
+			span = field->offset + field->length;
 	}
 
-libusb_err:
-	libusb_free_device_list(list, 1);
-	libusb_exit(NULL);
-	return ret;
+	return (span + layout->unit - 1) / layout->unit * layout->unit;
+}
+
+/**
+ * Modify the copy of a flash page with a new register value.
+ *
+ * @param	field		Place of the register in the page.
+ * @param	value		Value need to write.
+ * @param	page_content	Copy of the flash page.
+ *
+ * @return	None.
+ */
+static void cpld_nv_patch(const struct cpld_nv_field *field, uint64_t value,
+			  uint8_t *page_content)
+{
+	int i;
+
+	for (i = 0; i < field->length; i++)
+		page_content[field->offset + i] = (value ^ field->invert) >> (8 * i);
+}
+
+/**
+ * Patch a copy of a flash page and find which registers change it.
+ * Registers are applied in order, so a later value for the same address
+ * is compared against the earlier one.
+ *
+ * @param	field		Registers to modify.
+ * @param	value		Values need to write.
+ * @param	count		Number of registers.
+ * @param	page_content	Copy of the flash page, patched on return.
+ * @param	length		Number of page bytes in use.
+ * @param	changed		Set to 1 for every register that changes the page.
+ * @param	force		Treat every register as changing the page.
+ *
+ * @return	1 if the page has to be reprogrammed, 0 otherwise.
+ */
+static int cpld_nv_diff(const struct cpld_nv_field **field, uint64_t *value, int count,
+			uint8_t *page_content, int length, uint8_t *changed, uint8_t force)
+{
+	int i;
+	uint8_t flash[256], shadow[256];
+
+	memcpy(flash, page_content, length);
+	for (i = 0; i < count; i++) {
+		memcpy(shadow, page_content, length);
+		cpld_nv_patch(field[i], value[i], page_content);
+		changed[i] = force || memcmp(shadow, page_content, length) != 0;
+	}
+
+	return force || memcmp(flash, page_content, length) != 0;
+}
+
+static int cpld_nv_ready(void *arg)
+{
+	struct cpld_nv_flash *nv = arg;
+	struct cpld_context *cpld = nv->cpld;
+	struct smi_frame frame = { nv->layout->status, 0, 0 };
+	uint8_t flash_status = 0x00;
+
+	if (cpld_removed(cpld))
+		return -1;
+
+	if (cpld->protocol == SMI) {
+		if (smi_transfer(cpld->mpsse, &frame, 1) != MPSSE_OK)
+			return -1;
+		flash_status = frame.value & 0xFF;
+	} else {
+		if (i2c_read_data(cpld->mpsse, CPLD_SLAVE_ADDR, nv->layout->status, 2,
+				  &flash_status, 1) != 0)
+			return -1;
+	}
+
+	return flash_status == 0x01;
 }
 
 /**
- * List all FTDI devices found.
+ * Send one erase or program command and wait until the flash is ready
+ * again. The status is only polled after the command went out: a status
+ * read in the same burst may come before the flash latched busy.
  *
- * @param	None.
+ * @param	nv	Flash of the board.
+ * @param	op	Erase or program.
+ * @param	address	Register address.
+ * @param	data	Bytes need to write.
+ * @param	length	Number of bytes, at most one program unit.
  *
- * @return	Failed when no devices found.
+ * @return	0 if write successfully, !=0 if write failure.
  */
-uint8_t cpld_list(void)
+static uint8_t cpld_nv_program(struct cpld_nv_flash *nv, enum cpld_flash_op op,
+			       uint16_t address, const uint8_t *data, int length)
+{
+	struct cpld_context *cpld = nv->cpld;
+	struct timespec start;
+	struct smi_frame frame = { address, data[0] | (length > 1 ? data[1] << 8 : 0), 1 };
+
+	cpld_flash_start(&start);
+	if (cpld->protocol == SMI) {
+		if (smi_transfer(cpld->mpsse, &frame, 1) != MPSSE_OK)
+			return 1;
+	} else if (i2c_write_data(cpld->mpsse, CPLD_SLAVE_ADDR, address, 2,
+				  (uint8_t *)data, length) != 0) {
+		return 1;
+	}
+
+	return cpld_flash_wait(&cpld->flash[op], &cpld->poll[op], op, &start, cpld_nv_ready, nv);
+}
+
+/**
+ * Read, erase and reprogram one flash page. The page is left alone if it
+ * already holds the new values.
+ *
+ * @param	nv	Flash of the board.
+ * @param	page	Page number.
+ * @param	field	Registers to modify.
+ * @param	value	Values need to write.
+ * @param	count	Number of registers.
+ * @param	changed	Set to 1 for every register that is programmed.
+ *
+ * @return	0 if write successfully, !=0 if write failure.
+ */
+static uint8_t cpld_nv_write_page(struct cpld_nv_flash *nv, int page,
+				  const struct cpld_nv_field **field, uint64_t *value,
+				  int count, uint8_t *changed)
 {
 	int i, ret;
-	char ser[32];
-	struct ftdi_context ftdi;
-	struct ftdi_device_list *list, *dev;
-	/*
-ftdi	pointer to ftdi_context
-devlist	Pointer where to store list of found devices*/
-	struct product_context {
-		char *name;
-		uint16_t value;
-	};
-	struct product_context product_id[NUM_PRODUCT] = {
-	    {"FT232R", FT232R},
-	    {"FT2232", FT2232},
-	    {"FT4232", FT4232},
-	    {"FT232H", FT232H}
-	};
-
-	// checking and resetting all wrong boards before listing.
-	cpld_reset_usb();
-
-	ftdi_init(&ftdi);
-	for (i = 0; i < NUM_PRODUCT; i++) {
-		ret = ftdi_usb_find_all(&ftdi, &list, VENDOR, product_id[i].value);
-		if (ret < 0) {
-			fprintf(stderr, "Failed to list devices!\n");
-			ftdi_deinit(&ftdi);
-			return ret;
+	struct cpld_context *cpld = nv->cpld;
+	const struct cpld_nv_layout *layout = nv->layout;
+	uint8_t page_content[256];
+	int span = cpld_nv_span(layout, page);
+	/* SMI addresses 16-bit words, I2C bytes */
+	int width = cpld->protocol == SMI ? 2 : 1;
+
+	/* The page is read in one transfer */
+	if (span > UINT8_MAX) {
+		cpld_log(&cpld->log, CPLD_LOG_ERROR, "Flash page %d of %s is longer than %d bytes!",
+			 page, cpld->board_name, UINT8_MAX);
+		return 1;
+	}
+
+	/* Read previous page content */
+	if (cpld->protocol == SMI)
+		ret = smi_read_flash(cpld->mpsse, layout->base[page], 2, page_content, span);
+	else
+		ret = i2c_read_data(cpld->mpsse, CPLD_SLAVE_ADDR, layout->base[page], 2,
+				    page_content, span);
+	if (ret != 0)
+		return 1;
+
+	/* Modify page content */
+	if (!cpld_nv_diff(field, value, count, page_content, span, changed, cpld->nv_force))
+		return 0;
+
+	/* Erase previous page content */
+	if (cpld_nv_program(nv, CPLD_FLASH_ERASE, layout->erase[page], &layout->erase_value, 1))
+		return 1;
+
+	/* Write back */
+	for (i = 0; i < span; i += layout->unit) {
+		if (cpld_nv_program(nv, CPLD_FLASH_PROGRAM, layout->base[page] + i / width,
+				    &page_content[i], layout->unit))
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Write the pairs of cpld_reg_write_nv, count is at least 1.
+ */
+static int cpld_nv_write_pairs(struct cpld_context *cpld, const uint64_t *address,
+			       const uint64_t *value, int count, uint8_t *state,
+			       uint64_t *readback, uint32_t *valid)
+{
+	int i, page, num, ret = CPLD_OK;
+	uint8_t page_ret;
+	uint32_t mask = 0;
+	struct cpld_nv_flash nv = { cpld, cpld->board->nv };
+	const struct register_context *reg[count];
+	const struct cpld_nv_field *field[count];
+	const struct cpld_nv_field *page_field[count];
+	uint64_t page_value[count];
+	uint64_t written[count];
+	uint8_t changed[count];
+	int pair[count];
+
+	memset(state, CPLD_NV_SKIPPED, count);
+	cpld_copy_out(cpld, 0, NULL, valid);
+	if (cpld_removed(cpld))
+		return CPLD_ERR_REMOVED;
+	if (nv.layout == NULL) {
+		cpld_log(&cpld->log, CPLD_LOG_ERROR,
+			 "Cannot write! %s has no non-volatile registers", cpld->board_name);
+		return CPLD_ERR_NV;
+	}
+
+	for (i = 0; i < count; i++) {
+		reg[i] = cpld_get_reg(cpld, address[i]);
+		field[i] = NULL;
+
+		if (reg[i] == NULL) {
+			cpld_log(&cpld->log, CPLD_LOG_ERROR, "The address 0x%0*jX is not supported!",
+				 cpld->reg->addr_length * 2, address[i]);
+			ret = cpld_error(ret, CPLD_ERR_ADDRESS);
+			continue;
+		}
+
+		field[i] = cpld_nv_field(nv.layout, address[i]);
+		if (field[i] == NULL) {
+			cpld_log(&cpld->log, CPLD_LOG_ERROR,
+				 "The address 0x%0*jX is not supported for writing non-volatile!",
+				 cpld->reg->addr_length * 2, address[i]);
+			ret = cpld_error(ret, CPLD_ERR_NV);
+			continue;
 		}
 
-		for (dev = list; dev != NULL; dev = dev->next) {
-			ret = ftdi_usb_get_strings(&ftdi, dev->dev,
-						NULL, 0, NULL, 0, ser, 32);
-						/*serial	Store serial string here if not NULL*/
-			if (ret < 0)
-				fprintf(stderr, "Skipping device %s!\n", product_id[i].name);
+		/* Configuration registers also take the value right away */
+		if (field[i]->page == 0) {
+			if (cpld->protocol == SMI)
+				page_ret = smi_write(cpld->mpsse, reg[i]->address, reg[i]->addr_length,
+						     (uint8_t *)&value[i], reg[i]->val_length);
 			else
-				printf("%s: %s\n", product_id[i].name, ser);
+				page_ret = i2c_write_data(cpld->mpsse, CPLD_SLAVE_ADDR,
+							  reg[i]->address, reg[i]->addr_length,
+							  (uint8_t *)&value[i], reg[i]->val_length);
+			if (page_ret != 0)
+				ret = cpld_error(ret, CPLD_ERR_BUS);
 		}
 	}
 
-	ftdi_list_free(&list);
-	ftdi_deinit(&ftdi);
-	return 0;
+	for (page = 0; page < 2; page++) {
+		for (i = 0, num = 0; i < count; i++) {
+			if (field[i] == NULL || field[i]->page != page)
+				continue;
+			page_field[num] = field[i];
+			page_value[num] = value[i];
+			pair[num] = i;
+			num++;
+		}
+		if (num == 0)
+			continue;
+
+		memset(changed, 0, num);
+		page_ret = cpld_nv_write_page(&nv, page, page_field, page_value, num, changed);
+		if (page_ret != 0)
+			ret = cpld_error(ret, __atomic_load_n(&cpld->removed, __ATOMIC_ACQUIRE) ?
+						CPLD_ERR_REMOVED : CPLD_ERR_BUS);
+
+		/* the identity registers changed, or may have */
+		if (page == 1 && (page_ret || memchr(changed, 1, num) != NULL))
+			cpld_cache_invalidate(cpld);
+
+		for (i = 0; i < num; i++)
+			state[pair[i]] = page_ret ? CPLD_NV_FAILED :
+					 changed[i] ? CPLD_NV_WRITTEN : CPLD_NV_UNCHANGED;
+	}
+
+	/* read back the registers of the pages */
+	for (i = 0, num = 0; i < count; i++) {
+		if (field[i] == NULL)
+			continue;
+		page_value[num] = value[i];
+		written[num++] = address[i];
+	}
+
+	ret = cpld_error(ret, cpld_verify(cpld, written, page_value, num, &mask));
+	cpld_copy_out(cpld, mask, readback, valid);
+	return ret;
 }
 
 /**
- * Change FTDI serial number
+ * Write (Non-volatile) values to several addresses of CPLD.
+ *
+ * The registers are grouped by flash page and every page is read, erased
+ * and reprogrammed once, no matter how many of its registers change. A
+ * page that already holds all the new values is only read. The registers
+ * are then read back as set with cpld_set_verify.
  *
  * @param	cpld		CPLD structure.
- * @param	new_serial	New serial need to change to
+ * @param	address		CPLD addresses need to write.
+ * @param	value		Values need to write.
+ * @param	count		Number of address/value pairs.
+ * @param	state		enum cpld_nv_state of each pair.
+ * @param	readback	Registers read back, indexed like the register table,
+ *				may be NULL.
+ * @param	valid		Mask of the registers read back, may be NULL.
  *
- * @return	Failed when errors occur.
+ * @return	CPLD_OK, or the first error: an invalid pair, a failed write or
+ *		a register that does not hold its value. CPLD_ERR_ADDRESS
+ *		without any pair.
  */
-uint8_t cpld_change_serial(struct cpld_context *cpld, char *new_serial)
+int cpld_reg_write_nv(struct cpld_context *cpld, const uint64_t *address,
+		      const uint64_t *value, int count, uint8_t *state,
+		      uint64_t *readback, uint32_t *valid)
 {
-	uint8_t ret = 0;
+	if (count <= 0) {
+		cpld_copy_out(cpld, 0, NULL, valid);
+		return CPLD_ERR_ADDRESS;
+	}
 
-	ftdi_eeprom_initdefaults(&(cpld->mpsse->ftdi), NULL, NULL, new_serial);
-	ret = ftdi_erase_eeprom(&(cpld->mpsse->ftdi));
-	if (ftdi_set_eeprom_value(&(cpld->mpsse->ftdi), MAX_POWER, 500) < 0)
-		fprintf(stderr, "ftdi_set_eeprom_value: %d (%s)\n", ret,
-			ftdi_get_error_string(&(cpld->mpsse->ftdi)));
+	return cpld_nv_write_pairs(cpld, address, value, count, state, readback, valid);
+}
 
-	ret = (ftdi_eeprom_build(&(cpld->mpsse->ftdi)));
-	if (ret < 0) {
-		fprintf(stderr, "Erase failed: %s", ftdi_get_error_string(&(cpld->mpsse->ftdi)));
+/**
+ * Read a span of contiguous registers in one bus transaction.
+ *
+ * @param	cpld		CPLD structure.
+ * @param	address		First register address.
+ * @param	addr_length	Address length.
+ * @param	value		Buffer for the span.
+ * @param	length		Number of bytes in the span.
+ *
+ * @return	0 if read successfully, >0 if read failure.
+ */
+uint8_t cpld_read_span(struct cpld_context *cpld, uint64_t address, uint8_t addr_length,
+		       uint8_t *value, uint8_t length)
+{
+	uint8_t ret;
+
+	if (cpld->protocol == SMI) {
+		// V3MSK issue: flash registers (0x2XX or 0x3XX) return the previous request
+		if (cpld_flash_window(cpld, address))
+			ret = smi_read_flash(cpld->mpsse, address, addr_length, value, length);
+		else
+			ret = smi_read(cpld->mpsse, address, addr_length, value, length);
+	} else if (cpld->protocol == IIC) {
+		ret = i2c_read_data(cpld->mpsse, CPLD_SLAVE_ADDR, address, addr_length,
+				    value, length);
+	} else {
+		ret = spi_read(cpld->mpsse, address, addr_length, value, length);
+	}
+
+	return ret;
+}
+
+/**
+ * Check whether a register directly follows another one on the bus.
+ *
+ * @param	cpld	CPLD structure.
+ * @param	reg	Register.
+ * @param	next	Following register.
+ *
+ * @return	1 if both can be read or written in one span, 0 otherwise.
+ */
+uint8_t cpld_is_adjacent(struct cpld_context *cpld, const struct register_context *reg,
+			 const struct register_context *next)
+{
+	/* SMI addresses 16-bit words, I2C addresses bytes, SPI has no bursts */
+	uint8_t unit = (cpld->protocol == SMI) ? 2 : 1;
+
+	if (cpld->protocol == SPI || next == NULL)
+		return 0;
+
+	return next->address == reg->address + reg->val_length / unit;
+}
+
+/**
+ * Register transactions.
+ *
+ * A transaction queues reads, writes and delays in a structure of the
+ * caller and runs them in one bus session on commit. Consecutive reads,
+ * or writes, of registers that follow each other on the bus are merged
+ * into one span, then the accesses go to the batch function of the
+ * protocol, which concatenates them into as few USB transfers as it can.
+ * Read values are delivered into the buffers given when the reads were
+ * queued.
+ */
+
+/**
+ * Start an empty transaction.
+ *
+ * @param	cpld	CPLD structure.
+ * @param	txn	Transaction.
+ *
+ * @return	None.
+ */
+void cpld_txn_begin(struct cpld_context *cpld, struct cpld_txn *txn)
+{
+	txn->cpld = cpld;
+	txn->count = 0;
+	txn->error = 0;
+}
+
+/**
+ * Record the first operation that could not be queued, the transaction
+ * is then not run.
+ */
+static void cpld_txn_fail(struct cpld_txn *txn, int error)
+{
+	txn->error = cpld_error(txn->error, error);
+}
+
+/**
+ * Append an operation.
+ */
+static struct cpld_txn_op *cpld_txn_add(struct cpld_txn *txn, enum cpld_txn_type type,
+					const struct register_context *reg)
+{
+	struct cpld_txn_op *op;
+
+	if (txn->count == CPLD_TXN_MAX) {
+		cpld_log(&txn->cpld->log, CPLD_LOG_ERROR,
+			 "More than %d operations in one transaction!", CPLD_TXN_MAX);
+		cpld_txn_fail(txn, CPLD_ERR_LIMIT);
+		return NULL;
+	}
+
+	op = &txn->op[txn->count++];
+	memset(op, 0, sizeof(*op));
+	op->type = type;
+	op->reg = reg;
+	op->status = 255;	/* not run yet */
+	return op;
+}
+
+/**
+ * Queue a register read.
+ *
+ * @param	txn	Transaction.
+ * @param	address	Register address.
+ * @param	value	Buffer of the value, filled in by the commit.
+ *
+ * @return	CPLD_OK if queued, an error otherwise, the transaction is then
+ *		not run.
+ */
+int cpld_txn_read(struct cpld_txn *txn, uint64_t address, uint64_t *value)
+{
+	const struct register_context *reg;
+	struct cpld_txn_op *op;
+	int ret = cpld_check_reg(txn->cpld, address, R, &reg);
+
+	if (ret != CPLD_OK) {
+		cpld_txn_fail(txn, ret);
 		return ret;
 	}
-	ret = ftdi_write_eeprom(&(cpld->mpsse->ftdi));
-	if (ret < 0) {
-		fprintf(stderr, "ftdi_eeprom_decode: %d (%s)\n", ret,
-			ftdi_get_error_string(&(cpld->mpsse->ftdi)));
+
+	op = cpld_txn_add(txn, CPLD_TXN_READ, reg);
+	if (op == NULL)
+		return CPLD_ERR_LIMIT;
+
+	op->result = value;
+	return CPLD_OK;
+}
+
+/**
+ * Queue a register write.
+ *
+ * @param	txn	Transaction.
+ * @param	address	Register address.
+ * @param	value	Value to write.
+ *
+ * @return	CPLD_OK if queued, an error otherwise, the transaction is then
+ *		not run.
+ */
+int cpld_txn_write(struct cpld_txn *txn, uint64_t address, uint64_t value)
+{
+	const struct register_context *reg;
+	struct cpld_txn_op *op;
+	int ret = cpld_check_reg(txn->cpld, address, W, &reg);
+
+	if (ret != CPLD_OK) {
+		cpld_txn_fail(txn, ret);
 		return ret;
 	}
 
-	printf("Serial number has been changed, please run cpld-control -l to re-check!\n");
-	return ret;
+	op = cpld_txn_add(txn, CPLD_TXN_WRITE, reg);
+	if (op == NULL)
+		return CPLD_ERR_LIMIT;
+
+	op->value = value;
+	return CPLD_OK;
 }
 
 /**
- * Read value from an address of CPLD.
+ * Queue a delay between two operations.
  *
- * @param	cpld	CPLD structure.
- * @param	address	CPLD address need to read.
+ * @param	txn	Transaction.
+ * @param	us	Delay in microseconds.
  *
- * @return	uint8_t Read value
- * 0   if read successfully.
- * >0  if read failure.
- * 255 if unsupported address.
+ * @return	CPLD_OK if queued, CPLD_ERR_LIMIT otherwise, the transaction is
+ *		then not run.
  */
-uint8_t cpld_read(struct cpld_context *cpld, uint64_t address)
+int cpld_txn_delay(struct cpld_txn *txn, uint32_t us)
 {
-	uint8_t ret;
-	struct register_context *reg = cpld_get_reg(cpld, address);
-	uint64_t addr;
+	struct cpld_txn_op *op = cpld_txn_add(txn, CPLD_TXN_DELAY, NULL);
 
-	if (reg == NULL) {
-		fprintf(stderr, "The address 0x%0*jX is not supported!\n",
-			cpld->reg->addr_length * 2, address);
-		return 255;
+	if (op == NULL)
+		return CPLD_ERR_LIMIT;
+
+	op->delay_us = us;
+	return CPLD_OK;
+}
+
+/**
+ * Check whether an SMI read takes one more frame: flash window words come
+ * with the frame after their request.
+ */
+static int cpld_txn_lag(struct cpld_context *cpld, const struct bus_op *bus)
+{
+	return bus->type == BUS_READ && cpld_flash_window(cpld, bus->address);
+}
+
+/**
+ * Send SMI accesses in one smi_transfer.
+ *
+ * @param	cpld	CPLD structure.
+ * @param	bus	Accesses, no delays.
+ * @param	count	Number of accesses.
+ * @param	frames	Number of frames.
+ *
+ * @return	0 if every access succeeded.
+ */
+static uint8_t cpld_txn_smi_run(struct cpld_context *cpld, struct bus_op *bus, int count,
+				int frames)
+{
+	int i, k, w, lag, failed;
+	struct smi_frame frame[frames];
+
+	for (i = 0, k = 0; i < count; i++) {
+		lag = cpld_txn_lag(cpld, &bus[i]);
+		for (w = 0; w < bus[i].val_length / 2 + lag; w++, k++) {
+			frame[k].address = bus[i].address + w;
+			frame[k].write = (bus[i].type == BUS_WRITE);
+			frame[k].value = frame[k].write ?
+					 bus[i].value[w * 2] | (bus[i].value[w * 2 + 1] << 8) : 0;
+		}
 	}
-	if (reg->mode == W) {
-		fprintf(stderr, "The address 0x%0*jX is write only!\n",
-			cpld->reg->addr_length * 2, address);
-		return 255;
+
+	failed = (smi_transfer(cpld->mpsse, frame, frames) != MPSSE_OK);
+
+	/* Words are stored little endian */
+	for (i = 0, k = 0; i < count; i++) {
+		lag = cpld_txn_lag(cpld, &bus[i]);
+		bus[i].status = failed ? (uint8_t)MPSSE_FAIL : 0;
+		for (w = 0; !failed && bus[i].type == BUS_READ && w < bus[i].val_length / 2; w++) {
+			bus[i].value[w * 2] = frame[k + lag + w].value & 0xFF;
+			bus[i].value[w * 2 + 1] = frame[k + lag + w].value >> 8;
+		}
+		k += bus[i].val_length / 2 + lag;
 	}
 
-	if (cpld->protocol == SPI)
-		ret = spi_read(cpld->mpsse, reg->address, reg->addr_length,
-			       (uint8_t *)&(reg->value), reg->val_length);
-	else if (cpld->protocol == SMI) {
-		addr = address;
-		// V3MSK issue: remove first 2 bytes if reading flash registers (0x2XX or 0x3XX)
-		if (strcmp(cpld->board_name, "V3MSK") == 0 && (reg->address & ~0x1FF) == 0x200) {
-			ret = smi_read(cpld->mpsse, addr, reg->addr_length,
-				(uint8_t *)&(reg->value), 2);
-			if (reg->val_length > 2)
-				addr++;
+	return failed ? (uint8_t)MPSSE_FAIL : 0;
+}
+
+/**
+ * Run a list of SMI accesses. The accesses between two delays go out in
+ * one smi_transfer, delays are waited out on the host.
+ */
+static uint8_t cpld_txn_smi(struct cpld_context *cpld, struct bus_op *bus, int count)
+{
+	int i, start, frames;
+	uint8_t ret = 0;
+
+	for (start = 0; start < count; start = i) {
+		if (bus[start].type == BUS_DELAY) {
+			usleep(bus[start].delay_us);
+			bus[start].status = 0;
+			i = start + 1;
+			continue;
 		}
-		ret = smi_read(cpld->mpsse, addr, reg->addr_length,
-			(uint8_t *)&(reg->value), reg->val_length);
-	} else
-		ret = i2c_read_data(cpld->mpsse, CPLD_SLAVE_ADDR, reg->address, reg->addr_length,
-				    (uint8_t *)&(reg->value), reg->val_length);
 
-	if (ret == 0)
-		printf("%-15s 0x%0*jX: 0x%0*jX\n", reg->name,
-		       reg->addr_length * 2, address,
-		       reg->val_length * 2, reg->value);
+		for (i = start, frames = 0; i < count && bus[i].type != BUS_DELAY; i++)
+			frames += bus[i].val_length / 2 + cpld_txn_lag(cpld, &bus[i]);
+
+		ret |= cpld_txn_smi_run(cpld, bus + start, i - start, frames);
+	}
 
 	return ret;
 }
 
 /**
- * Write value to an address of CPLD.
+ * Run a transaction.
  *
- * @param	cpld	CPLD structure.
- * @param	address	CPLD address need to write.
- * @param	value	Value need to write.
+ * Nothing is run if an operation could not be queued. The status of
+ * every operation is filled in, operations that were not run keep 255.
+ *
+ * @param	txn	Transaction.
  *
- * @return	uint8_t Return value
- * 0   if write successfully.
- * >0  if write failure.
- * 255 if unsupported address.
+ * @return	CPLD_OK if all operations succeeded, CPLD_ERR_BUS if one
+ *		failed, the reason the transaction was not run otherwise.
  */
-uint8_t cpld_write(struct cpld_context *cpld, uint64_t address, uint8_t *value)
+int cpld_txn_commit(struct cpld_txn *txn)
 {
+	struct cpld_context *cpld = txn->cpld;
+	struct cpld_txn_op *op = txn->op;
+	struct bus_op bus[CPLD_TXN_MAX];
+	int index[CPLD_TXN_MAX], offset[CPLD_TXN_MAX];
+	uint8_t data[CPLD_TXN_MAX * sizeof(uint64_t)];
+	int i, len, n = 0, used = 0;
 	uint8_t ret;
-	struct register_context *reg = cpld_get_reg(cpld, address);
 
-	if (reg == NULL) {
-		fprintf(stderr, "The address 0x%0*jX is not supported!\n",
-			cpld->reg->addr_length * 2, address);
-		return 255;
-	}
-	if (reg->mode == R) {
-		fprintf(stderr, "The address 0x%0*jX is read only!\n",
-			reg->addr_length * 2, address);
-		return 255;
-	}
+	if (txn->error != CPLD_OK)
+		return txn->error;
+	if (cpld_removed(cpld))
+		return CPLD_ERR_REMOVED;
+
+	/*
+	 * Plan the accesses. An access to the register that follows the one
+	 * of the previous operation of the same kind on the bus extends it,
+	 * so reads become one span and writes one auto-increment write.
+	 * Operations keep their order: a gap, another kind of operation or a
+	 * delay in between ends the span.
+	 */
+	for (i = 0; i < txn->count; i++) {
+		offset[i] = used;
+		len = op[i].reg ? op[i].reg->val_length : 0;
+		if (op[i].type != CPLD_TXN_DELAY && i > 0 && op[i - 1].type == op[i].type &&
+		    cpld_is_adjacent(cpld, op[i - 1].reg, op[i].reg) &&
+		    bus[n - 1].val_length + len <= UINT8_MAX) {
+			index[i] = n - 1;
+			if (op[i].type == CPLD_TXN_WRITE)
+				memcpy(data + used, &op[i].value, len);
+			bus[n - 1].val_length += len;
+			used += len;
+			continue;
+		}
 
-	printf("Writing register 0x%0*jX with value 0x%0*jX\n",
-	       reg->addr_length * 2, address,
-	       reg->val_length * 2, *((uint64_t *) value));
+		index[i] = n;
+		memset(&bus[n], 0, sizeof(bus[n]));
+		if (op[i].type == CPLD_TXN_DELAY) {
+			bus[n].type = BUS_DELAY;
+			bus[n].delay_us = op[i].delay_us;
+		} else {
+			bus[n].type = (op[i].type == CPLD_TXN_WRITE) ? BUS_WRITE : BUS_READ;
+			bus[n].address = op[i].reg->address;
+			bus[n].addr_length = op[i].reg->addr_length;
+			bus[n].val_length = len;
+			bus[n].value = data + used;
+			if (op[i].type == CPLD_TXN_WRITE)
+				memcpy(data + used, &op[i].value, len);
+			used += len;
+		}
+		n++;
+	}
 
 	if (cpld->protocol == SPI)
-		ret = spi_write(cpld->mpsse, reg->address, reg->addr_length,
-				value, reg->val_length);
+		ret = spi_batch(cpld->mpsse, bus, n);
 	else if (cpld->protocol == SMI)
-		ret = smi_write(cpld->mpsse, reg->address, reg->addr_length,
-				value, reg->val_length);
+		ret = cpld_txn_smi(cpld, bus, n);
 	else
-		ret = i2c_write_data(cpld->mpsse, CPLD_SLAVE_ADDR, reg->address, reg->addr_length,
-				     value, reg->val_length);
+		ret = i2c_batch(cpld->mpsse, CPLD_SLAVE_ADDR, bus, n);
+
+	/* slice the spans back into the caller buffers */
+	for (i = 0; i < txn->count; i++) {
+		op[i].status = bus[index[i]].status;
+		if (op[i].type == CPLD_TXN_READ && op[i].status == 0) {
+			*op[i].result = 0;
+			memcpy(op[i].result, data + offset[i], op[i].reg->val_length);
+		}
+	}
 
-	return ret;
+	return ret != 0 ? CPLD_ERR_BUS : CPLD_OK;
+}
+
+/**
+ * Queue reads of all registers that are not in the register cache.
+ */
+static void cpld_dump_queue(struct cpld_txn *txn)
+{
+	struct cpld_context *cpld = txn->cpld;
+	const struct register_context *reg, *end = cpld->reg + cpld->board->count;
+
+	for (reg = cpld->reg; reg < end; reg++)
+		if (reg->mode != W && !(cpld->cached & CPLD_REG_BIT(cpld, reg)))
+			cpld_txn_read(txn, reg->address, cpld_reg_value(cpld, reg));
 }
 
 /**
- * Write (Non-volatile) value to an address of CPLD.
+ * Collect all registers once the reads of cpld_dump_queue ran.
  *
  * @param	cpld	CPLD structure.
- * @param	address	CPLD address need to write.
- * @param	value	Value need to write.
+ * @param	op	First read queued by cpld_dump_queue.
+ * @param	mask	Registers with a value are added, in table order up to
+ *			the first failed read.
+ *
+ * @return	CPLD_OK, CPLD_ERR_BUS if a read failed.
+ */
+static int cpld_dump_collect(struct cpld_context *cpld, const struct cpld_txn_op *op,
+			     uint32_t *mask)
+{
+	const struct register_context *reg, *end = cpld->reg + cpld->board->count;
+
+	for (reg = cpld->reg; reg < end; reg++) {
+		if (reg->mode == W)
+			continue;
+		if (!(cpld->cached & CPLD_REG_BIT(cpld, reg))) {
+			if (op->status != 0)
+				return CPLD_ERR_BUS;
+			cpld->fresh |= CPLD_REG_BIT(cpld, reg);
+			op++;
+		}
+		*mask |= CPLD_REG_BIT(cpld, reg);
+	}
+
+	return CPLD_OK;
+}
+
+/**
+ * Find the last write to a register.
  *
- * @return	uint8_t Return value
- * 0   if write successfully.
- * >0  if write failure.
- * 255 if unsupported address.
+ * @return	Index of the last pair of the register, -1 if it was not written.
  */
-uint8_t cpld_write_nonvolatile(struct cpld_context *cpld, uint64_t address, uint8_t *value)
+static int cpld_verify_find(const struct register_context *reg, const uint64_t *address,
+			    int count)
 {
 	int i;
-	uint8_t ret;
-	uint8_t page_content[256];
-	uint8_t flash_status = 0x01;
-	struct register_context *reg = cpld_get_reg(cpld, address);
 
-	if (reg == NULL) {
-		fprintf(stderr, "The address 0x%0*jX is not supported!\n",
-			 cpld->reg->addr_length * 2, address);
-		return 255;
+	for (i = count - 1; i >= 0; i--)
+		if (address[i] == reg->address)
+			return i;
+
+	return -1;
+}
+
+/**
+ * Queue the read back of written registers: all registers in full mode,
+ * otherwise the readable registers that were written, in address order
+ * so that neighbours are read in one span.
+ */
+static void cpld_verify_queue(struct cpld_txn *txn, const uint64_t *address, int count)
+{
+	struct cpld_context *cpld = txn->cpld;
+	const struct register_context *reg, *end = cpld->reg + cpld->board->count;
+
+	if (cpld->verify == CPLD_VERIFY_FULL) {
+		cpld_dump_queue(txn);
+		return;
 	}
+	if (cpld->verify == CPLD_VERIFY_NONE)
+		return;
 
-	if (strcmp(cpld->board_name, "V3U") == 0) {
-		if ((address != 0x0008) && (address != 0x0025) && (address != 0x0030) &&
-		    (address != 0x0036) && (address != 0x1000) && (address != 0x1002) &&
-		    (address != 0x1004) && (address != 0x1008)) {
-			fprintf(stderr, "The address 0x%0*jX is not supported ",
-				cpld->reg->addr_length * 2, address);
-			fprintf(stderr, "for writing non-volatile!\n");
-			return 255;
-		}
-		else if ((address == 0x0008) || (address == 0x0025) ||
-			   (address == 0x0030) || (address == 0x0036))
-			    ret = i2c_write_data(cpld->mpsse, CPLD_SLAVE_ADDR,
-					     reg->address, reg->addr_length,
-					     value, reg->val_length);
-
-		       printf("Writing register 0x%0*jX with value 0x%0*jX\n",
-		       reg->addr_length * 2, address,
-		       reg->val_length * 2, *((uint64_t *) value));
-
-		/**
-		 * Find page
-		 * Read previous page content. Due to hardware implementation
-		 * For page 0, only need to read the first 56 bytes to save time -> make it 60
-		 * For page 1, only need to read the first 14 bytes to save time -> make it 16
-		 */
-
-		if (address < 0x07FF) { // page 0
-			ret = i2c_read_data(cpld->mpsse, CPLD_SLAVE_ADDR, 0x0800, 2,
-					    &page_content[0], 60);
-			/* Erase previous page content */
-			ret = i2c_write_data(cpld->mpsse, CPLD_SLAVE_ADDR, 0x07F0, 2,
-					     &flash_status, 1);
-		}
-		else { // page 1
-			ret = i2c_read_data(cpld->mpsse, CPLD_SLAVE_ADDR, 0x1000, 2,
-					    &page_content[0], 16);
-			/* Erase previous page content */
-			ret = i2c_write_data(cpld->mpsse, CPLD_SLAVE_ADDR, 0x07F1, 2,
-					     &flash_status, 1);
-		}
+	for (reg = cpld->reg; reg < end; reg++)
+		if (reg->mode != W && cpld_verify_find(reg, address, count) >= 0)
+			cpld_txn_read(txn, reg->address, cpld_reg_value(cpld, reg));
+}
 
-		do {
-			i2c_read_data(cpld->mpsse, CPLD_SLAVE_ADDR, 0x07F0, 2, &flash_status, 1);
-		} while (flash_status != 0x01);
-
-		/* Modify page content */
-		if (address == 0x0008) // mode set register
-			for (i = 0; i < reg->val_length; i++)
-				page_content[8 + i] = *(value + i);
-		if (address == 0x0025) // power configure register
-			page_content[37] = *value;
-		if (address == 0x0030) // peripheral configure register
-			page_content[48] = *value;
-		if (address == 0x0036) // UART configure register
-			page_content[54] = *value;
-		if (address == 0x1000) { // PCB version
-			page_content[0] = *value;
-			page_content[1] = *(value + 1);
-		}
-		if (address == 0x1002) { // SoC version
-			page_content[2] = *value;
-			page_content[3] = *(value + 1);
-		}
-		if (address == 0x1004) // PCB Serial number
-			for (i = 0; i < reg->val_length; i++)
-				page_content[4 + i] = *(value + i);
-		if (address == 0x1008) // MAC address
-			for (i = 0; i < reg->val_length; i++)
-				page_content[8 + i] = *(value + i);
-
-		/* Write back */
-		if (address < 0x07FF) // page 0
-			for (i = 0; i < 15; i++) {
-				do {
-					i2c_read_data(cpld->mpsse, CPLD_SLAVE_ADDR,
-						       0x07F0, 2, &flash_status, 1);
-				} while (flash_status != 0x01);
-				ret = i2c_write_data(cpld->mpsse, CPLD_SLAVE_ADDR,
-						      0x0800 + i * 4, 2, &page_content[i * 4], 4);
-			}
-		else // page 1
-			for (i = 0; i < 4; i++) {
-				do {
-					i2c_read_data(cpld->mpsse, CPLD_SLAVE_ADDR,
-						       0x07F0, 2, &flash_status, 1);
-				} while (flash_status != 0x01);
-				ret = i2c_write_data(cpld->mpsse, CPLD_SLAVE_ADDR,
-						      0x1000 + i * 4, 2, &page_content[i * 4], 4);
-			}
-	}
-	else if (strcmp(cpld->board_name, "S4") == 0) {
-		if ((address != 0x0008) && (address != 0x0025) && (address != 0x0030) &&
-		    (address != 0x0036) && (address != 0x1000) && (address != 0x1002) &&
-		    (address != 0x1004) && (address != 0x1008)) {
-			fprintf(stderr, "The address 0x%0*jX is not supported ",
-				cpld->reg->addr_length * 2, address);
-			fprintf(stderr, "for writing non-volatile!\n");
-			return 255;
-		} else if ((address == 0x0008) || (address == 0x0025) ||
-			   (address == 0x0030) || (address == 0x0036))
-			ret = i2c_write_data(cpld->mpsse, CPLD_SLAVE_ADDR,
-					     reg->address, reg->addr_length,
-					     value, reg->val_length);
-
-		printf("Writing register 0x%0*jX with value 0x%0*jX\n",
-		       reg->addr_length * 2, address,
-		       reg->val_length * 2, *((uint64_t *) value));
-
-		/**
-		 * Find page
-		 * Read previous page content. Due to hardware implementation
-		 * For page 0, only need to read the first 56 bytes to save time -> make it 60
-		 * For page 1, only need to read the first 14 bytes to save time -> make it 16
-		 */
-		if (address < 0x07FF) { // page 0
-			ret = i2c_read_data(cpld->mpsse, CPLD_SLAVE_ADDR, 0x0800, 2,
-					    &page_content[0], 60);
-			/* Erase previous page content */
-			ret = i2c_write_data(cpld->mpsse, CPLD_SLAVE_ADDR, 0x07F0, 2,
-					     &flash_status, 1);
-		}
-		else { // page 1
-			ret = i2c_read_data(cpld->mpsse, CPLD_SLAVE_ADDR, 0x1000, 2,
-					    &page_content[0], 16);
-			/* Erase previous page content */
-			ret = i2c_write_data(cpld->mpsse, CPLD_SLAVE_ADDR, 0x07F1, 2,
-					     &flash_status, 1);
-		}
+/**
+ * Collect the registers read back and compare them with the last value
+ * written to each of them.
+ *
+ * @param	cpld	CPLD structure.
+ * @param	op	First read queued by cpld_verify_queue.
+ * @param	address	Written addresses.
+ * @param	value	Written values.
+ * @param	count	Number of address/value pairs.
+ * @param	mask	Registers read back are added.
+ *
+ * @return	CPLD_OK if every register holds its value, CPLD_ERR_VERIFY on a
+ *		mismatch, CPLD_ERR_BUS if a read failed.
+ */
+static int cpld_verify_check(struct cpld_context *cpld, const struct cpld_txn_op *op,
+			     const uint64_t *address, const uint64_t *value, int count,
+			     uint32_t *mask)
+{
+	const struct register_context *reg, *end = cpld->reg + cpld->board->count;
+	uint64_t bits;
+	int i, ret = CPLD_OK;
+
+	if (cpld->verify == CPLD_VERIFY_NONE)
+		return CPLD_OK;
+	if (cpld->verify == CPLD_VERIFY_FULL) {
+		ret = cpld_dump_collect(cpld, op, mask);
+		if (ret != CPLD_OK)
+			return ret;
+	}
 
-		do {
-			i2c_read_data(cpld->mpsse, CPLD_SLAVE_ADDR, 0x07F0, 2, &flash_status, 1);
-		} while (flash_status != 0x01);
-
-		/* Modify page content */
-		if (address == 0x0008) // mode set register
-			for (i = 0; i < reg->val_length; i++)
-				page_content[8 + i] = *(value + i);
-		if (address == 0x0025) // power configure register
-			page_content[37] = *value;
-		if (address == 0x0030) // peripheral configure register
-			page_content[48] = *value;
-		if (address == 0x0036) // UART configure register
-			page_content[54] = *value;
-		if (address == 0x1000) { // PCB version
-			page_content[0] = *value;
-			page_content[1] = *(value + 1);
-		}
-		if (address == 0x1002) { // SoC version
-			page_content[2] = *value;
-			page_content[3] = *(value + 1);
-		}
-		if (address == 0x1004) // PCB Serial number
-			for (i = 0; i < reg->val_length; i++)
-				page_content[4 + i] = *(value + i);
-		if (address == 0x1008) // MAC address
-			for (i = 0; i < reg->val_length; i++)
-				page_content[8 + i] = *(value + i);
-		/* Write back */
-		if (address < 0x07FF) // page 0
-			for (i = 0; i < 15; i++) {
-				do {
-					i2c_read_data(cpld->mpsse, CPLD_SLAVE_ADDR,
-						       0x07F0, 2, &flash_status, 1);
-				} while (flash_status != 0x01);
-				ret = i2c_write_data(cpld->mpsse, CPLD_SLAVE_ADDR,
-						      0x0800 + i * 4, 2, &page_content[i * 4], 4);
-			}
-		else // page 1
-			for (i = 0; i < 4; i++) {
-				do {
-					i2c_read_data(cpld->mpsse, CPLD_SLAVE_ADDR,
-						       0x07F0, 2, &flash_status, 1);
-				} while (flash_status != 0x01);
-				ret = i2c_write_data(cpld->mpsse, CPLD_SLAVE_ADDR,
-						      0x1000 + i * 4, 2, &page_content[i * 4], 4);
-			}
-	}
-	else if (strcmp(cpld->board_name, "V3HSK") == 0) {
-		if ((address != 0x0008) && (address != 0x0025) && (address != 0x0026) &&
-		    (address != 0x0027) && (address != 0x0030) && (address != 0x0034) &&
-		    (address != 0x0035) && (address != 0x0036) && (address != 0x1000) &&
-		    (address != 0x1002) && (address != 0x1004) && (address != 0x1008)) {
-			fprintf(stderr, "The address 0x%0*jX is not supported ",
-				cpld->reg->addr_length * 2, address);
-			fprintf(stderr, "for writing non-volatile!\n");
-			return 255;
-		} else if ((address == 0x0008) || (address == 0x0025) || (address == 0x0026) ||
-			   (address == 0x0027) || (address == 0x0030) || (address == 0x0034) ||
-			   (address == 0x0035) || (address == 0x0036))
-			ret = i2c_write_data(cpld->mpsse, CPLD_SLAVE_ADDR,
-					     reg->address, reg->addr_length,
-					     value, reg->val_length);
-
-		printf("Writing register 0x%0*jX with value 0x%0*jX\n",
-		       cpld->reg->addr_length * 2, address,
-		       reg->val_length * 2, *((uint64_t *) value));
-
-		/**
-		 * Find page
-		 * Read previous page content. Due to hardware implementation
-		 * For page 0, only need to read the first 56 bytes to save time -> make it 60
-		 * For page 1, only need to read the first 14 bytes to save time -> make it 16
-		 */
-		if (address < 0x07FF) { // page 0
-			ret = i2c_read_data(cpld->mpsse, CPLD_SLAVE_ADDR, 0x0800, 2,
-					    &page_content[0], 60);
-			/* Erase previous page content */
-			ret = i2c_write_data(cpld->mpsse, CPLD_SLAVE_ADDR, 0x07F0, 2,
-					     &flash_status, 1);
-		} else { // page 1
-			ret = i2c_read_data(cpld->mpsse, CPLD_SLAVE_ADDR, 0x1000, 2,
-					    &page_content[0], 16);
-			/* Erase previous page content */
-			ret = i2c_write_data(cpld->mpsse, CPLD_SLAVE_ADDR, 0x07F1, 2,
-					     &flash_status, 1);
+	for (reg = cpld->reg; reg < end; reg++) {
+		i = (reg->mode != W) ? cpld_verify_find(reg, address, count) : -1;
+		if (i < 0)
+			continue;
+
+		if (cpld->verify == CPLD_VERIFY_WRITTEN) {
+			if (op->status != 0)
+				return CPLD_ERR_BUS;
+			op++;
+			cpld->fresh |= CPLD_REG_BIT(cpld, reg);
+			*mask |= CPLD_REG_BIT(cpld, reg);
 		}
 
-		do {
-			i2c_read_data(cpld->mpsse, CPLD_SLAVE_ADDR, 0x07F0, 2, &flash_status, 1);
-		} while (flash_status != 0x01);
-
-		/* Modify page content */
-		if (address == 0x0008) // mode set register
-			for (i = 0; i < reg->val_length; i++)
-				page_content[8 + i] = *(value + i);
-		if (address == 0x0025) // power configure register
-			page_content[37] = *value;
-		if (address == 0x0026) // PMIC configure register
-			page_content[38] = *value;
-		if (address == 0x0027) // PCIe clock configure register
-			page_content[39] = *value;
-		if (address == 0x0030) // peripheral configure register
-			page_content[48] = *value;
-		if (address == 0x0034) // LED register
-			page_content[52] = *value;
-		if (address == 0x0035) // LED configure register
-			page_content[53] = *value;
-		if (address == 0x0036) // UART configure register
-			page_content[54] = *value;
-		if (address == 0x1000) { // PCB version
-			page_content[0] = *value;
-			page_content[1] = *(value + 1);
-		}
-		if (address == 0x1002) { // SoC version
-			page_content[2] = *value;
-			page_content[3] = *(value + 1);
-		}
-		if (address == 0x1004) { // PCB Serial number
-			page_content[4] = *value;
-			page_content[5] = *(value + 1);
-		}
-		if (address == 0x1008) // MAC address
-			for (i = 0; i < reg->val_length; i++)
-				page_content[8 + i] = *(value + i);
-
-		/* Write back */
-		if (address < 0x07FF) // page 0
-			for (i = 0; i < 15; i++) {
-				do {
-					i2c_read_data(cpld->mpsse, CPLD_SLAVE_ADDR,
-						       0x07F0, 2, &flash_status, 1);
-				} while (flash_status != 0x01);
-				ret = i2c_write_data(cpld->mpsse, CPLD_SLAVE_ADDR,
-						      0x0800 + i * 4, 2, &page_content[i * 4], 4);
-			}
-		else // page 1
-			for (i = 0; i < 4; i++) {
-				do {
-					i2c_read_data(cpld->mpsse, CPLD_SLAVE_ADDR,
-						       0x07F0, 2, &flash_status, 1);
-				} while (flash_status != 0x01);
-				ret = i2c_write_data(cpld->mpsse, CPLD_SLAVE_ADDR,
-						      0x1000 + i * 4, 2, &page_content[i * 4], 4);
-			}
-	}
-	else if (strcmp(cpld->board_name, "V3MSK") == 0) {
-		if ((address != 0x004) && (address != 0x00B) && (address != 0x00C) &&
-		    (address != 0x00E) && (address != 0x300) && (address != 0x301) &&
-		    (address != 0x302)) {
-			fprintf(stderr, "The address 0x%0*jX is not supported ",
-				cpld->reg->addr_length * 2, address);
-			fprintf(stderr, "for writing non-volatile!\n");
-			return 255;
-		} else if ((address == 0x004) || (address == 0x00B) ||
-			   (address == 0x00C) || (address == 0x00E))
-			ret = smi_write(cpld->mpsse, reg->address, reg->addr_length,
-					 value, reg->val_length);
-
-		printf("Writing register 0x%0*jX with value 0x%0*jX\n",
-		       reg->addr_length * 2, address,
-		       reg->val_length * 2, *((uint64_t *) value));
-
-		/**
-		 * Find page
-		 * Read previous page content. Due to hardware implementation
-		 * For page 0, only need to read the first 30 bytes to save time!
-		 * For page 1, only need to read the first 8 bytes to save time!
-		 */
-		flash_status = 0x00;
-		if (address < 0x2FF) { // page 0
-			// V3MSK issue: remove first 2 bytes if reading flash registers
-			ret = smi_read(cpld->mpsse, 0x200, 2, &page_content[0], 2);
-			ret = smi_read(cpld->mpsse, 0x201, 2, &page_content[0], 30);
-
-			/* Erase previous page content */
-			ret = smi_write(cpld->mpsse, 0x1FE, 2, &flash_status, 2);
-		} else { // page 1
-			// V3MSK issue: remove first 2 bytes if reading flash registers
-			ret = smi_read(cpld->mpsse, 0x300, 2, &page_content[0], 2);
-			ret = smi_read(cpld->mpsse, 0x301, 2, &page_content[0], 8);
-
-			/* Erase previous page content */
-			ret = smi_write(cpld->mpsse, 0x1FF, 2, &flash_status, 2);
+		/* e.g. RESET reads back 0 once the reset is done */
+		if (reg->self_clear)
+			continue;
+
+		bits = (reg->val_length < 8) ? (1ULL << (8 * reg->val_length)) - 1 : UINT64_MAX;
+		if (*cpld_reg_value(cpld, reg) != (value[i] & bits)) {
+			cpld_log(&cpld->log, CPLD_LOG_ERROR,
+				 "%s reads back 0x%0*jX instead of 0x%0*jX!", reg->name,
+				 reg->val_length * 2, *cpld_reg_value(cpld, reg),
+				 reg->val_length * 2, value[i] & bits);
+			ret = CPLD_ERR_VERIFY;
 		}
+	}
 
-		do {
-			smi_read(cpld->mpsse, 0x009, 2, &flash_status, 2);
-		} while (flash_status != 0x01);
-
-		/**
-		 * Modify page content
-		 * In page 0, the data in flash is stored inverted
-		 * so inverting the data before writing back is needed!
-		 */
-		if (address == 0x004) // mode set register
-			for (i = 0; i < reg->val_length; i++)
-				page_content[4 * 2 + i] = 0xFF ^ *(value + i);
-		if (address == 0x00B) { // power configure register
-			page_content[22] = 0xFF ^ *value;
-			page_content[23] = 0xFF ^ *(value + 1) ^ 0x80;
-		}
-		if (address == 0x00C) { // peripheral configure register
-			for (i = 0; i < reg->val_length; i++)
-				page_content[12 * 2 + i] = 0xFF ^ *(value + i);
-		}
-		if (address == 0x00E) { // LED register
-			page_content[28] = 0xFF ^ *value;
-			page_content[29] = 0xFF ^ *(value + 1);
-		}
-		if (address == 0x300) { // PCB version
-			page_content[0] = *value;
-			page_content[1] = *(value + 1);
+	return ret;
+}
+
+/**
+ * Read back written registers in a transaction of their own. Which
+ * registers are read back is set with cpld_set_verify.
+ *
+ * @param	cpld	CPLD structure.
+ * @param	address	Written addresses.
+ * @param	value	Written values.
+ * @param	count	Number of address/value pairs.
+ * @param	mask	Registers read back are added.
+ *
+ * @return	CPLD_OK if every register holds its value, an error otherwise.
+ */
+int cpld_verify(struct cpld_context *cpld, const uint64_t *address, const uint64_t *value,
+		int count, uint32_t *mask)
+{
+	struct cpld_txn txn;
+
+	cpld_txn_begin(cpld, &txn);
+	cpld_verify_queue(&txn, address, count);
+	cpld_txn_commit(&txn);
+
+	return cpld_verify_check(cpld, txn.op, address, value, count, mask);
+}
+
+/**
+ * Mark the pairs whose write was done by a transaction.
+ *
+ * @param	txn	Committed transaction, starting with the writes.
+ * @param	pair	Pair of each write.
+ * @param	count	Number of writes.
+ * @param	done	Flags of the pairs, may be NULL.
+ *
+ * @return	None.
+ */
+static void cpld_write_done(const struct cpld_txn *txn, const int *pair, int count,
+			    uint8_t *done)
+{
+	int i;
+
+	if (done == NULL)
+		return;
+
+	for (i = 0; i < count; i++)
+		done[pair[i]] = txn->op[i].status == 0;
+}
+
+/**
+ * Write the pairs of cpld_reg_write, count is at least 1.
+ */
+static int cpld_reg_write_pairs(struct cpld_context *cpld, const uint64_t *address,
+				const uint64_t *value, int count, uint8_t *done,
+				uint64_t *readback, uint32_t *valid)
+{
+	int i, first, num = 0, from = 0, ret = CPLD_OK, err;
+	uint64_t written[count], expect[count];
+	const struct register_context *reg;
+	uint32_t mask = 0;
+	struct cpld_txn txn;
+	int pair[count];
+
+	if (done != NULL)
+		memset(done, 0, count);
+
+	cpld_txn_begin(cpld, &txn);
+	for (i = 0; i < count; i++) {
+		err = cpld_check_reg(cpld, address[i], W, &reg);
+		if (err != CPLD_OK) {
+			ret = cpld_error(ret, err);
+			continue;
 		}
-		if (address == 0x301) { // SoC version
-			page_content[2] = *value;
-			page_content[3] = *(value + 1);
+
+		/* keep room for the read back */
+		if (txn.count == CPLD_TXN_MAX - CPLD_REG_MAX) {
+			ret = cpld_error(ret, cpld_txn_commit(&txn));
+			cpld_write_done(&txn, pair + from, num - from, done);
+			from = num;
+			cpld_txn_begin(cpld, &txn);
 		}
-		if (address == 0x302) // PCB Serial number
-			for (i = 0; i < reg->val_length; i++)
-				page_content[2 * 2 + i] = *(value + i);
-
-		/* Write back */
-		if (address < 0x2FF) // page 0
-			for (i = 0; i < 30 / 2; i++) {
-				ret = smi_write(cpld->mpsse, 0x200 + i,
-						2, &page_content[i * 2], 2);
-				do {
-					smi_read(cpld->mpsse, 0x009, 2, &flash_status, 2);
-				} while (flash_status != 0x01);
-			}
-		else // page 1
-			for (i = 0; i < 8 / 2; i++) {
-				ret = smi_write(cpld->mpsse, 0x300 + i,
-						2, &page_content[i * 2], 2);
-				do {
-					smi_read(cpld->mpsse, 0x009, 2, &flash_status, 2);
-				} while (flash_status != 0x01);
-			}
-	}
-	else { // Not support
-		fprintf(stderr, "Cannot write! Only support write non-volatile function for ");
-		fprintf(stderr, "V3MSK, V3HSK, V3U and S4\n");
+
+		cpld_txn_write(&txn, address[i], value[i]);
+		pair[num] = i;
+		written[num] = address[i];
+		expect[num++] = value[i];
 	}
 
+	first = txn.count;
+	cpld_verify_queue(&txn, written, num);
+	err = cpld_txn_commit(&txn);
+	cpld_write_done(&txn, pair + from, num - from, done);
+
+	for (i = 0; i < first; i++)
+		if (txn.op[i].status != 0)
+			ret = cpld_error(ret, err != CPLD_OK ? err : CPLD_ERR_BUS);
+
+	ret = cpld_error(ret, cpld_verify_check(cpld, txn.op + first, written, expect, num,
+						&mask));
+	cpld_copy_out(cpld, mask, readback, valid);
 	return ret;
 }
 
 /**
- * Dump value of all registers.
+ * Write registers and read them back, in one transaction. Which
+ * registers are read back is set with cpld_set_verify.
+ *
+ * @param	cpld		CPLD structure.
+ * @param	address		CPLD addresses need to write.
+ * @param	value		Values need to write.
+ * @param	count		Number of address/value pairs.
+ * @param	done		Set to 1 for each pair written to the board, 0
+ *				otherwise, may be NULL.
+ * @param	readback	Registers read back, indexed like the register table,
+ *				may be NULL.
+ * @param	valid		Mask of the registers read back, may be NULL.
+ *
+ * @return	CPLD_OK, or the first error: an invalid pair, a failed write or
+ *		a register that does not hold its value. CPLD_ERR_ADDRESS
+ *		without any pair.
+ */
+int cpld_reg_write(struct cpld_context *cpld, const uint64_t *address, const uint64_t *value,
+		   int count, uint8_t *done, uint64_t *readback, uint32_t *valid)
+{
+	if (count <= 0) {
+		cpld_copy_out(cpld, 0, NULL, valid);
+		return CPLD_ERR_ADDRESS;
+	}
+
+	return cpld_reg_write_pairs(cpld, address, value, count, done, readback, valid);
+}
+
+/**
+ * Read all registers.
+ *
+ * All registers are read in one transaction, registers that follow each
+ * other on the bus in one span. Registers of the register cache are
+ * not read from the board.
  *
  * @param	cpld	CPLD structure.
- * @param	address	Address to display (0xFFFFF to dump all registers).
- *
- * @return	Number of NACKs from slave.
- * 0   if read successfully.
- * >0  if read failure.
- * 255 if unsupported address.
- */
-uint8_t cpld_dump(struct cpld_context *cpld, uint64_t address)
-{
-	int ret = 0;
-	struct register_context *reg;
-
-	if (address == 0xFFFFF) {
-		reg = cpld->reg;
-		while (reg != NULL) {
-			if (reg->mode != W) {
-				ret = cpld_read(cpld, reg->address);
-				if (ret != 0)
-					return ret;
-			}
-			reg = reg->pnext;
-		}
-	} else {
-		ret = cpld_read(cpld, address);
-		if (ret != 0)
-			return ret;
+ * @param	value	Values, indexed like the register table.
+ * @param	valid	Mask of the registers with a value: the readable ones,
+ *		in table order up to the first failed read.
+ *
+ * @return	CPLD_OK, or the error that stopped the reads.
+ */
+int cpld_reg_dump(struct cpld_context *cpld, uint64_t *value, uint32_t *valid)
+{
+	struct cpld_txn txn;
+	uint32_t mask = 0;
+	int ret;
+
+	ret = cpld_removed(cpld) ? CPLD_ERR_REMOVED : CPLD_OK;
+	if (ret == CPLD_OK) {
+		cpld_txn_begin(cpld, &txn);
+		cpld_dump_queue(&txn);
+		cpld_txn_commit(&txn);
+		ret = cpld_dump_collect(cpld, txn.op, &mask);
 	}
+
+	cpld_copy_out(cpld, mask, value, valid);
 	return ret;
 }
 
+/**
+ * Get the register table of a board.
+ *
+ * @param	cpld	CPLD structure.
+ * @param	count	Set to the number of registers.
+ *
+ * @return	Registers, in ascending addresses.
+ */
+const struct register_context *cpld_registers(struct cpld_context *cpld, int *count)
+{
+	*count = cpld->board->count;
+	return cpld->reg;
+}
+
 /**
  * Get register's infomation.
  *
  * @param	cpld	CPLD structure.
  * @param	address	Address to look up.
  *
- * @return	A register structure.
+ * @return	A register structure, NULL if there is none at the address.
  */
-struct register_context *cpld_get_reg(struct cpld_context *cpld, uint64_t address)
+const struct register_context *cpld_get_reg(struct cpld_context *cpld, uint64_t address)
 {
-	struct register_context *reg = cpld->reg;
+	int index = cpld_board_reg(cpld->board, address);
 
-	while (reg != NULL) {
-		if (reg->address == address)
-			break;
-		reg = reg->pnext;
-	}
-	return reg;
+	return index < 0 ? NULL : &cpld->reg[index];
 }
 
 /**
- * Deinitialize CPLD structure
+ * Get register's infomation by name.
  *
  * @param	cpld	CPLD structure.
+ * @param	name	Register name, case is ignored.
  *
- * @return	None.
+ * @return	A register structure, NULL if the board has no such register.
  */
-void cpld_deinit(struct cpld_context *cpld)
+const struct register_context *cpld_find_reg(struct cpld_context *cpld, const char *name)
 {
-	struct register_context *reg;
+	int index = cpld_board_reg_name(cpld->board, name);
 
-	while (cpld->reg != NULL) {
-		reg = cpld->reg;
-		cpld->reg = cpld->reg->pnext;
-		free(reg->name);
-		free(reg);
-	}
+	return index < 0 ? NULL : &cpld->reg[index];
+}
+
+/**
+ * Close a CPLD opened with cpld_open.
+ *
+ * @param	cpld	CPLD structure.
+ *
+ * @return	None.
+ */
+void cpld_close(struct cpld_context *cpld)
+{
+	cpld_usb_detach(&cpld->removed);
 	Close(cpld->mpsse);
+	free(cpld->cache_dir);
 	free(cpld);
 }
@@ -0,0 +1,558 @@
+/**
+ * Copyright (C) 2020 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#define _GNU_SOURCE	/* struct ucred */
+#include "daemon.h"
+#include "command.h"
+#include "fleet.h"
+#include "usbdev.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+/**
+ * Request protocol.
+ *
+ * The client sends a uint32_t length together with its stdout and stderr
+ * descriptors (SCM_RIGHTS), followed by the NUL separated argv of the
+ * command. The daemon runs the command with its output redirected to the
+ * client descriptors and answers with the int32_t exit status.
+ *
+ * Opened boards are kept in a session list so that only the first request
+ * for a board pays for cpld_open. The workers of a serial list take their
+ * boards from the same list, one worker per board, so the list is locked.
+ *
+ * Any request may reprogram a board, so the socket is created readable
+ * and writable by its owner only, in $XDG_RUNTIME_DIR by default, and
+ * requests from other users than the daemon's (or root) are refused.
+ * Requests are served one at a time, a client that does not send its
+ * request within CPLD_REQUEST_TIMEOUT seconds is dropped.
+ */
+
+static volatile sig_atomic_t cpld_daemon_stop;
+static struct cpld_session *cpld_sessions;
+static pthread_mutex_t cpld_session_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void cpld_daemon_signal(int sig)
+{
+	cpld_daemon_stop = 1;
+}
+
+/**
+ * Read exactly length bytes.
+ *
+ * @return	0 on success, -1 on error or end of stream.
+ */
+static int cpld_read_all(int fd, void *buf, size_t length)
+{
+	ssize_t ret;
+	size_t n;
+
+	for (n = 0; n < length; n += ret) {
+		ret = read(fd, (char *)buf + n, length - n);
+		if (ret < 0 && errno == EINTR) {
+			ret = 0;
+			continue;
+		}
+		if (ret <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Write exactly length bytes.
+ *
+ * @return	0 on success, -1 on error.
+ */
+static int cpld_write_all(int fd, const void *buf, size_t length)
+{
+	ssize_t ret;
+	size_t n;
+
+	for (n = 0; n < length; n += ret) {
+		ret = write(fd, (const char *)buf + n, length - n);
+		if (ret < 0 && errno == EINTR) {
+			ret = 0;
+			continue;
+		}
+		if (ret < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Get the default socket path.
+ *
+ * @param	path	Buffer of the path.
+ * @param	size	Size of the buffer.
+ *
+ * @return	0 on success, -1 without $XDG_RUNTIME_DIR.
+ */
+int cpld_socket_default(char *path, size_t size)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+
+	if (dir == NULL || dir[0] == '\0')
+		return -1;
+
+	snprintf(path, size, "%s/%s", dir, CPLD_SOCKET_NAME);
+	return 0;
+}
+
+static int cpld_socket_address(char *path, struct sockaddr_un *addr)
+{
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "Socket path %s is too long!\n", path);
+		return -1;
+	}
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+/**
+ * Close a board and forget its session.
+ *
+ * @param	session	Session to drop.
+ *
+ * @return	None.
+ */
+static void cpld_session_drop(struct cpld_session *session)
+{
+	struct cpld_session **pp;
+
+	pthread_mutex_lock(&cpld_session_lock);
+	for (pp = &cpld_sessions; *pp != NULL; pp = &(*pp)->pnext) {
+		if (*pp == session) {
+			*pp = session->pnext;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cpld_session_lock);
+
+	cpld_close(session->cpld);
+	free(session->board);
+	free(session->serial);
+	free(session);
+}
+
+/**
+ * Find the opened board, open it on first use.
+ *
+ * @param	board	Board name.
+ * @param	serial	FTDI iSerial.
+ *
+ * @return	Session of the board, NULL if it cannot be opened.
+ */
+static struct cpld_session *cpld_session_get(char *board, char *serial)
+{
+	struct cpld_session *session;
+
+	pthread_mutex_lock(&cpld_session_lock);
+	for (session = cpld_sessions; session != NULL; session = session->pnext) {
+		if (!strcmp(session->board, board) && !strcmp(session->serial, serial))
+			break;
+	}
+	pthread_mutex_unlock(&cpld_session_lock);
+
+	/* Reopen a board that was unplugged since the last request */
+	if (session != NULL && __atomic_load_n(&session->cpld->removed, __ATOMIC_ACQUIRE))
+		cpld_session_drop(session);
+	else if (session != NULL)
+		return session;
+
+	session = calloc(1, sizeof(*session));
+	if (session == NULL)
+		return NULL;
+
+	/* The session outlives the request and its argument buffer */
+	session->board = strdup(board);
+	session->serial = strdup(serial);
+	if (session->board != NULL && session->serial != NULL)
+		session->cpld = cpld_command_open(session->board, session->serial);
+
+	if (session->cpld == NULL) {
+		free(session->board);
+		free(session->serial);
+		free(session);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&cpld_session_lock);
+	session->pnext = cpld_sessions;
+	cpld_sessions = session;
+	pthread_mutex_unlock(&cpld_session_lock);
+	return session;
+}
+
+/**
+ * Get the board of a fleet worker from the session list.
+ *
+ * @param	board	Board name.
+ * @param	serial	FTDI iSerial.
+ *
+ * @return	CPLD structure, NULL if the board cannot be opened.
+ */
+static struct cpld_context *cpld_session_open(char *board, char *serial)
+{
+	struct cpld_session *session = cpld_session_get(board, serial);
+
+	return session != NULL ? session->cpld : NULL;
+}
+
+/**
+ * Run one command with the daemon state.
+ *
+ * @param	argc	Argument count.
+ * @param	argv	Argument vector.
+ *
+ * @return	Exit status of the command.
+ */
+static int cpld_daemon_run(int argc, char *argv[])
+{
+	struct cpld_session *session;
+	int ret;
+
+	ret = cpld_check_args(argc, argv);
+	if (ret != -1)
+		return ret;
+
+	if (!strcmp(argv[1], "-l"))
+		return cpld_list(argc == 3);
+
+	/* Boards of a serial list stay open for the next requests too */
+	if (cpld_is_fleet(argv[3]))
+		return cpld_fleet(argc, argv, cpld_session_open, NULL);
+
+	session = cpld_session_get(argv[2], argv[3]);
+	if (session == NULL) {
+		fprintf(stderr, "Initialize failed!\n");
+		return EXIT_FAILURE;
+	}
+
+	ret = cpld_command(session->cpld, argc, argv);
+
+	/* The board re-enumerates with its new serial */
+	if (!strcmp(argv[1], "-c"))
+		cpld_session_drop(session);
+
+	return ret;
+}
+
+/**
+ * Check that the client runs as the user of the daemon, or as root.
+ *
+ * @param	conn	Connected socket.
+ *
+ * @return	1 if the client may send requests.
+ */
+static int cpld_daemon_peer(int conn)
+{
+	struct ucred cred;
+	socklen_t length = sizeof(cred);
+
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &length) != 0) {
+		perror("SO_PEERCRED");
+		return 0;
+	}
+	if (cred.uid != geteuid() && cred.uid != 0) {
+		fprintf(stderr, "Refused request from uid %u!\n", (unsigned int)cred.uid);
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Check whether a daemon already serves a socket path. A socket nobody
+ * listens on is left over from a daemon that died and may be removed.
+ *
+ * @param	path	Unix socket path.
+ * @param	addr	Address of the path.
+ *
+ * @return	0 if the path is free or stale, -1 otherwise.
+ */
+static int cpld_daemon_probe(char *path, struct sockaddr_un *addr)
+{
+	struct stat st;
+	int sock, ret;
+
+	if (lstat(path, &st) != 0)
+		return errno == ENOENT ? 0 : -1;
+	if (!S_ISSOCK(st.st_mode)) {
+		fprintf(stderr, "%s is not a socket!\n", path);
+		return -1;
+	}
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+	ret = connect(sock, (struct sockaddr *)addr, sizeof(*addr));
+	close(sock);
+
+	if (ret == 0) {
+		fprintf(stderr, "A daemon is already listening on %s!\n", path);
+		return -1;
+	}
+
+	return errno == ECONNREFUSED ? 0 : -1;
+}
+
+/**
+ * Serve one client connection.
+ *
+ * @param	conn	Connected socket.
+ *
+ * @return	None.
+ */
+static void cpld_daemon_serve(int conn)
+{
+	uint32_t length;
+	int32_t status;
+	int fds[2] = { -1, -1 };
+	int saved[2];
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { &length, sizeof(length) };
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	char *buf, **argv;
+	int argc, i;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if (recvmsg(conn, &msg, 0) != sizeof(length))
+		return;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		fprintf(stderr, "Request without output descriptors!\n");
+		return;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	if (length == 0 || length > CPLD_REQUEST_MAX) {
+		fprintf(stderr, "Invalid request length %u!\n", length);
+		goto out;
+	}
+
+	buf = malloc(length + 1);
+	argv = malloc((length + 1) * sizeof(char *));
+	if (buf == NULL || argv == NULL || cpld_read_all(conn, buf, length) != 0) {
+		free(buf);
+		free(argv);
+		goto out;
+	}
+	buf[length] = '\0';
+
+	/* Split the NUL separated arguments */
+	argc = 0;
+	for (i = 0; i < (int)length; i += strlen(buf + i) + 1)
+		argv[argc++] = buf + i;
+	argv[argc] = NULL;
+
+	fflush(stdout);
+	fflush(stderr);
+	saved[0] = dup(STDOUT_FILENO);
+	saved[1] = dup(STDERR_FILENO);
+	dup2(fds[0], STDOUT_FILENO);
+	dup2(fds[1], STDERR_FILENO);
+
+	status = cpld_daemon_run(argc, argv);
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(saved[0], STDOUT_FILENO);
+	dup2(saved[1], STDERR_FILENO);
+	close(saved[0]);
+	close(saved[1]);
+
+	cpld_write_all(conn, &status, sizeof(status));
+
+	free(buf);
+	free(argv);
+out:
+	close(fds[0]);
+	close(fds[1]);
+}
+
+/**
+ * Run the daemon. Boards stay open between requests until the daemon
+ * receives SIGINT or SIGTERM.
+ *
+ * @param	path	Unix socket path.
+ *
+ * @return	Exit status.
+ */
+int cpld_daemon(char *path)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct timeval timeout = { CPLD_REQUEST_TIMEOUT, 0 };
+	mode_t mask;
+	int sock, conn, ret;
+
+	if (cpld_socket_address(path, &addr) != 0)
+		return EXIT_FAILURE;
+
+	/* A client that went away must not kill the daemon */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* No SA_RESTART, so accept returns on SIGINT/SIGTERM */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = cpld_daemon_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return EXIT_FAILURE;
+	}
+
+	if (cpld_daemon_probe(path, &addr) != 0) {
+		close(sock);
+		return EXIT_FAILURE;
+	}
+
+	/* Only the owner may connect */
+	unlink(path);
+	mask = umask(077);
+	ret = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (ret < 0 || listen(sock, 8) < 0) {
+		fprintf(stderr, "Failed to listen on %s (%s)!\n", path, strerror(errno));
+		close(sock);
+		return EXIT_FAILURE;
+	}
+
+	/* Keep the serial table current without rescanning per request */
+	if (cpld_usb_monitor_start() != 0)
+		fprintf(stderr, "USB hotplug not available, devices are found by enumeration\n");
+
+	printf("cpld-control daemon listening on %s\n", path);
+	fflush(stdout);
+
+	while (!cpld_daemon_stop) {
+		conn = accept(sock, NULL, NULL);
+		if (conn < 0) {
+			if (errno != EINTR)
+				perror("accept");
+			continue;
+		}
+
+		/* A silent client must not hold up the other requests */
+		setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+		if (cpld_daemon_peer(conn))
+			cpld_daemon_serve(conn);
+		close(conn);
+	}
+
+	close(sock);
+	unlink(path);
+
+	while (cpld_sessions != NULL)
+		cpld_session_drop(cpld_sessions);
+	cpld_usb_monitor_stop();
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Forward a command to the daemon. The daemon writes directly to our
+ * stdout and stderr.
+ *
+ * @param	path	Unix socket path.
+ * @param	argc	Argument count.
+ * @param	argv	Argument vector.
+ *
+ * @return	Exit status of the command.
+ */
+int cpld_client(char *path, int argc, char *argv[])
+{
+	struct sockaddr_un addr;
+	uint32_t length = 0;
+	int32_t status;
+	int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { &length, sizeof(length) };
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	char *buf;
+	int sock, i, n;
+
+	if (cpld_socket_address(path, &addr) != 0)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < argc; i++)
+		length += strlen(argv[i]) + 1;
+	if (length > CPLD_REQUEST_MAX) {
+		fprintf(stderr, "Command is too long!\n");
+		return EXIT_FAILURE;
+	}
+
+	buf = malloc(length);
+	if (buf == NULL)
+		return EXIT_FAILURE;
+	for (i = 0, n = 0; i < argc; i++) {
+		strcpy(buf + n, argv[i]);
+		n += strlen(argv[i]) + 1;
+	}
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Cannot connect to daemon at %s (%s)!\n", path, strerror(errno));
+		if (sock >= 0)
+			close(sock);
+		free(buf);
+		return EXIT_FAILURE;
+	}
+
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	fflush(stdout);
+	fflush(stderr);
+	if (sendmsg(sock, &msg, 0) != sizeof(length) ||
+	    cpld_write_all(sock, buf, length) != 0 ||
+	    cpld_read_all(sock, &status, sizeof(status)) != 0) {
+		fprintf(stderr, "Request to daemon failed!\n");
+		status = EXIT_FAILURE;
+	}
+
+	close(sock);
+	free(buf);
+	return status;
+}
@@ -0,0 +1,195 @@
+/**
+ * Copyright (C) 2020 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include "cpld.h"
+#include "log.h"
+#include <unistd.h>
+
+/**
+ * Flash status polling.
+ *
+ * After an erase or program command the CPLD flash controller is busy for
+ * a while. Instead of reading the status register back to back, the
+ * poller sleeps before every read: the first wait is half the average
+ * latency seen so far on the board (the configured wait until there is
+ * one), then the wait doubles up to a ceiling. A command that is not done
+ * by its deadline fails instead of hanging. Each CPLD structure has its own
+ * schedule, copied from the defaults below when it is opened.
+ *
+ * Every completed command is added to the latency histogram of its board.
+ */
+
+static struct cpld_flash_poll cpld_flash_poll[2] = {
+	{ CPLD_ERASE_WAIT_US, CPLD_ERASE_MAX_US, CPLD_ERASE_DEADLINE_MS },
+	{ CPLD_PROGRAM_WAIT_US, CPLD_PROGRAM_MAX_US, CPLD_PROGRAM_DEADLINE_MS }
+};
+
+static const char *cpld_flash_name[2] = { "erase", "program" };
+
+/**
+ * Set the polling schedule of erase or program commands.
+ *
+ * @param	cpld		CPLD structure, NULL for the CPLDs opened from now on.
+ * @param	op		Flash command.
+ * @param	wait_us		First wait, 0 keeps the current one.
+ * @param	deadline_ms	Deadline, 0 keeps the current one.
+ *
+ * @return	None.
+ */
+void cpld_flash_set_poll(struct cpld_context *cpld, enum cpld_flash_op op, uint32_t wait_us,
+			 uint32_t deadline_ms)
+{
+	struct cpld_flash_poll *poll = cpld ? &cpld->poll[op] : &cpld_flash_poll[op];
+
+	if (wait_us != 0) {
+		poll->wait_us = wait_us;
+		if (poll->max_us < wait_us)
+			poll->max_us = wait_us;
+	}
+	if (deadline_ms != 0)
+		poll->deadline_ms = deadline_ms;
+}
+
+/**
+ * Get the default polling schedules.
+ *
+ * @param	poll	Set to the erase and program schedules.
+ *
+ * @return	None.
+ */
+void cpld_flash_get_poll(struct cpld_flash_poll *poll)
+{
+	poll[CPLD_FLASH_ERASE] = cpld_flash_poll[CPLD_FLASH_ERASE];
+	poll[CPLD_FLASH_PROGRAM] = cpld_flash_poll[CPLD_FLASH_PROGRAM];
+}
+
+/**
+ * Take the time a flash command is issued.
+ *
+ * @param	start	Start time.
+ *
+ * @return	None.
+ */
+void cpld_flash_start(struct timespec *start)
+{
+	clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+static uint32_t cpld_flash_elapsed_us(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/**
+ * Add a completed flash command to the histogram.
+ *
+ * @param	hist	Latency histogram.
+ * @param	start	Time the command was issued.
+ *
+ * @return	None.
+ */
+static void cpld_flash_record(struct cpld_flash_hist *hist, struct timespec *start)
+{
+	uint32_t us = cpld_flash_elapsed_us(start);
+	int i;
+
+	for (i = 0; i < CPLD_FLASH_BUCKETS - 1 && us >= (16U << i); i++)
+		;
+	hist->bucket[i]++;
+
+	if (hist->count == 0 || us < hist->min_us)
+		hist->min_us = us;
+	if (us > hist->max_us)
+		hist->max_us = us;
+	hist->avg_us = hist->count ? (hist->avg_us * 7 + us) / 8 : us;
+	hist->total_us += us;
+	hist->count++;
+}
+
+/**
+ * Wait until the flash is ready.
+ *
+ * @param	hist	Latency histogram of the board.
+ * @param	poll	Polling schedule of the board.
+ * @param	op	Flash command.
+ * @param	start	Time the command was issued.
+ * @param	ready	Status check.
+ * @param	arg	Argument of the status check.
+ *
+ * @return	0 when ready, 1 on bus error or timeout.
+ */
+int cpld_flash_wait(struct cpld_flash_hist *hist, const struct cpld_flash_poll *poll,
+		    enum cpld_flash_op op, struct timespec *start, cpld_flash_ready ready,
+		    void *arg)
+{
+	uint32_t wait = hist->count ? hist->avg_us / 2 : poll->wait_us;
+	int ret;
+
+	if (wait > poll->max_us)
+		wait = poll->max_us;
+
+	for (;;) {
+		if (wait > 0)
+			usleep(wait);
+
+		hist->polls++;
+		ret = ready(arg);
+		if (ret < 0)
+			return 1;
+		if (ret > 0)
+			break;
+
+		if (cpld_flash_elapsed_us(start) / 1000 >= poll->deadline_ms) {
+			hist->timeout++;
+			cpld_log(NULL, CPLD_LOG_ERROR, "Flash %s timed out after %u ms!",
+				cpld_flash_name[op], poll->deadline_ms);
+			return 1;
+		}
+
+		wait = wait ? wait * 2 : 1;
+		if (wait > poll->max_us)
+			wait = poll->max_us;
+	}
+
+	cpld_flash_record(hist, start);
+	return 0;
+}
+
+/**
+ * Print a latency histogram.
+ *
+ * @param	out	Output stream.
+ * @param	name	Flash command name.
+ * @param	hist	Latency histogram.
+ *
+ * @return	None.
+ */
+void cpld_flash_print(FILE *out, const char *name, const struct cpld_flash_hist *hist)
+{
+	int i;
+
+	fprintf(out, "%-8s %u done, %u timed out, %u status reads", name,
+		hist->count, hist->timeout, hist->polls);
+	if (hist->count == 0) {
+		fprintf(out, "\n");
+		return;
+	}
+	fprintf(out, ", min %u us, avg %ju us, max %u us\n", hist->min_us,
+		(uintmax_t)(hist->total_us / hist->count), hist->max_us);
+
+	for (i = 0; i < CPLD_FLASH_BUCKETS; i++) {
+		if (hist->bucket[i] == 0)
+			continue;
+		if (i == CPLD_FLASH_BUCKETS - 1)
+			fprintf(out, "  >= %8u us: %u\n", 16U << (i - 1), hist->bucket[i]);
+		else
+			fprintf(out, "  <  %8u us: %u\n", 16U << i, hist->bucket[i]);
+	}
+}
@@ -0,0 +1,192 @@
+/**
+ * Copyright (C) 2020 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include "fleet.h"
+#include "command.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Multi-board commands.
+ *
+ * The serial argument of -r, -w and -wnv may be a comma separated list of
+ * serials or "all". Every board is opened and driven by its own worker
+ * thread, through the open and close functions of the caller: the daemon
+ * hands out the boards it already holds. Register output of a worker is
+ * collected in a memory stream and printed in serial order once all
+ * workers are done, errors go to stderr as they happen.
+ */
+
+struct cpld_worker {
+	pthread_t thread;
+	char serial[32];
+	int argc;
+	char **argv;
+	cpld_fleet_open open;
+	cpld_fleet_close close;
+	char *buf;	/* collected output */
+	size_t size;
+	int ret;
+};
+
+/**
+ * Check whether the serial argument names more than one board.
+ *
+ * @param	serial	Serial argument.
+ *
+ * @return	1 for a serial list or "all", 0 otherwise.
+ */
+int cpld_is_fleet(char *serial)
+{
+	return strchr(serial, ',') != NULL || !strcmp(serial, "all");
+}
+
+static int cpld_serial_cmp(const void *a, const void *b)
+{
+	return strcmp(((struct cpld_worker *)a)->serial, ((struct cpld_worker *)b)->serial);
+}
+
+static void *cpld_worker_run(void *arg)
+{
+	struct cpld_worker *worker = arg;
+	struct cpld_context *cpld;
+	FILE *out;
+
+	out = open_memstream(&worker->buf, &worker->size);
+	cpld_set_output(out);
+
+	cpld = worker->open(worker->argv[2], worker->serial);
+	if (cpld == NULL) {
+		fprintf(stderr, "%s: Initialize failed!\n", worker->serial);
+		worker->ret = EXIT_FAILURE;
+	} else {
+		worker->ret = cpld_command(cpld, worker->argc, worker->argv);
+		if (worker->close != NULL)
+			worker->close(cpld);
+	}
+
+	cpld_set_output(NULL);
+	if (out != NULL)
+		fclose(out);
+	return NULL;
+}
+
+/**
+ * Split the serial argument into workers.
+ *
+ * @param	board	Board name.
+ * @param	list	Serial argument.
+ * @param	worker	Array of CPLD_FLEET_MAX workers.
+ *
+ * @return	Number of boards, -1 on failure.
+ */
+static int cpld_fleet_serials(char *board, char *list, struct cpld_worker *worker)
+{
+	char serial[CPLD_FLEET_MAX][32];
+	char *copy, *tok, *save;
+	int i, count = 0;
+
+	if (!strcmp(list, "all")) {
+		count = cpld_list_serials(board, serial, CPLD_FLEET_MAX);
+		for (i = 0; i < count; i++)
+			strcpy(worker[i].serial, serial[i]);
+	} else {
+		copy = strdup(list);
+		if (copy == NULL)
+			return -1;
+		for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+			if (strlen(tok) >= sizeof(worker->serial) || count == CPLD_FLEET_MAX) {
+				fprintf(stderr, "Invalid serial list %s!\n", list);
+				free(copy);
+				return -1;
+			}
+			strcpy(worker[count++].serial, tok);
+		}
+		free(copy);
+	}
+
+	if (count <= 0) {
+		fprintf(stderr, "No %s boards found!\n", board);
+		return -1;
+	}
+
+	/* Serial order, each board once */
+	qsort(worker, count, sizeof(*worker), cpld_serial_cmp);
+	for (i = 1; i < count; i++) {
+		if (!strcmp(worker[i].serial, worker[i - 1].serial)) {
+			memmove(&worker[i], &worker[i + 1], (count - i - 1) * sizeof(*worker));
+			count--;
+			i--;
+		}
+	}
+
+	return count;
+}
+
+/**
+ * Run a command on several boards concurrently.
+ *
+ * @param	argc	Argument count.
+ * @param	argv	Argument vector, argv[3] is the serial list.
+ * @param	open	Get the context of a board, called by each worker.
+ * @param	close	Release it, NULL to leave it open.
+ *
+ * @return	EXIT_SUCCESS if the command succeeded on every board.
+ */
+int cpld_fleet(int argc, char *argv[], cpld_fleet_open open, cpld_fleet_close close)
+{
+	struct cpld_worker *worker;
+	char *args[CPLD_FLEET_MAX][argc + 1];
+	int i, count, ret = EXIT_SUCCESS;
+
+	if (!strcmp(argv[1], "-c")) {
+		fprintf(stderr, "The -c option takes only one serial!\n");
+		return EXIT_FAILURE;
+	}
+
+	worker = calloc(CPLD_FLEET_MAX, sizeof(*worker));
+	if (worker == NULL)
+		return EXIT_FAILURE;
+
+	count = cpld_fleet_serials(argv[2], argv[3], worker);
+	if (count < 0) {
+		free(worker);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < count; i++) {
+		memcpy(args[i], argv, (argc + 1) * sizeof(char *));
+		args[i][3] = worker[i].serial;
+		worker[i].argc = argc;
+		worker[i].argv = args[i];
+		worker[i].open = open;
+		worker[i].close = close;
+
+		/* Fall back to this thread if no more threads can be created */
+		if (pthread_create(&worker[i].thread, NULL, cpld_worker_run, &worker[i]) != 0) {
+			worker[i].thread = pthread_self();
+			cpld_worker_run(&worker[i]);
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!pthread_equal(worker[i].thread, pthread_self()))
+			pthread_join(worker[i].thread, NULL);
+
+		if (worker[i].buf != NULL)
+			fwrite(worker[i].buf, 1, worker[i].size, stdout);
+		free(worker[i].buf);
+
+		if (worker[i].ret != 0)
+			ret = EXIT_FAILURE;
+	}
+
+	free(worker);
+	return ret;
+}
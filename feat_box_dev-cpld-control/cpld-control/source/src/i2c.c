@@ -6,27 +6,161 @@
  * published by the Free Software Foundation.
  */
 #include "i2c.h"
+#include "log.h"
+#include <pthread.h>
 
-void i2c_delay(void)
+static int i2c_stats_enabled;
+static pthread_once_t i2c_once = PTHREAD_ONCE_INIT;
+static long i2c_clock_cost;	/* ns spent in one clock_gettime call */
+static __thread struct i2c_stats i2c_stats;
+
+/**
+ * Print the USB transfer counters of every bit-bang transaction.
+ *
+ * @param	enable	1 to print, 0 to stay quiet.
+ *
+ * @return	None.
+ */
+void i2c_set_stats(int enable)
+{
+	i2c_stats_enabled = enable;
+}
+
+/**
+ * Get the USB transfer counters of the last bit-bang transaction of this
+ * thread.
+ *
+ * @return	Transfer counters.
+ */
+struct i2c_stats i2c_get_stats(void)
+{
+	return i2c_stats;
+}
+
+static long i2c_ns(struct timespec *from, struct timespec *to)
 {
+	return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+/**
+ * Measure the cost of reading the clock, it is taken off every delay.
+ */
+static void i2c_calibrate(void)
+{
+	struct timespec start, end, now;
 	int i;
 
-	for (i = 0; i < TIME / 2; ++i)
-		;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < 1000; i++)
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	i2c_clock_cost = i2c_ns(&start, &end) / 1000;
+}
+
+/**
+ * Wait a quarter of an SCL period of the bit-bang engine.
+ *
+ * @param	mpsse	MPSSE structure.
+ *
+ * @return	None.
+ */
+void i2c_delay(struct mpsse_context *mpsse)
+{
+	struct timespec start, now;
+	long wait = 250000000L / mpsse->clock - i2c_clock_cost;
+
+	if (wait <= 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (i2c_ns(&start, &now) < wait);
+}
+
+/**
+ * Pin access layer of the bit-bang engine.
+ *
+ * SDA and SCL are open drain: a line is driven LOW by making it an output
+ * and released by making it an input. mpsse->bitbang_shadow holds the
+ * direction byte last written to the chip, so a change that leaves the
+ * direction as it is costs no USB transfer. The pins are only read where
+ * the protocol samples them.
+ */
+
+static void i2c_pin_direction(struct mpsse_context *mpsse, uint8_t direction)
+{
+	mpsse->bitbang = direction;
+	if (mpsse->bitbang_shadow == direction) {
+		i2c_stats.saved++;
+		return;
+	}
+
+	SetDirection(mpsse, direction);
+	mpsse->bitbang_shadow = direction;
+	i2c_stats.transfers++;
+}
+
+static uint8_t i2c_pin_read(struct mpsse_context *mpsse, int pin)
+{
+	i2c_stats.transfers++;
+	return PinState(mpsse, pin, -1);
 }
 
 /**
  * Initialize I2C protocol.
  *
  * @param	mpsse	MPSSE structure.
+ * @param	engine	Engine of the transactions on this device.
+ * @param	khz	SCL frequency in kHz, 0 for I2C_KHZ.
  *
- * @return	None
+ * @return	MPSSE_OK on success.
+ *		MPSSE_FAIL if the engine cannot be set up.
  */
-void i2c_init(struct mpsse_context *mpsse)
+int i2c_init(struct mpsse_context *mpsse, enum i2c_engine engine, uint32_t khz)
 {
+	if (khz == 0)
+		khz = I2C_KHZ;
+
+	mpsse->i2c_engine = engine;
+	if (engine == I2C_ENGINE_SYNCBB)
+		return i2c_syncbb_init(mpsse, khz);
+	if (engine == I2C_ENGINE_MPSSE)
+		return i2c_mpsse_init(mpsse, khz);
+
+	pthread_once(&i2c_once, i2c_calibrate);
+	mpsse->clock = khz * 1000;
+
 	mpsse->bitbang = PIN_SCL | PIN_SDA;
 	SetDirection(mpsse, mpsse->bitbang);
+	mpsse->bitbang_shadow = mpsse->bitbang;
 	usleep(1000);
+	return MPSSE_OK;
+}
+
+/**
+ * Set SDA as input.
+ *
+ * @param	mpsse	MPSSE structure.
+ *
+ * @return	None.
+ */
+void i2c_release_sda(struct mpsse_context *mpsse)
+{
+	i2c_pin_direction(mpsse, mpsse->bitbang & ~PIN_SDA);
+}
+
+/**
+ * Set SCL as input.
+ *
+ * @param	mpsse	MPSSE structure.
+ *
+ * @return	None.
+ */
+void i2c_release_scl(struct mpsse_context *mpsse)
+{
+	i2c_pin_direction(mpsse, mpsse->bitbang & ~PIN_SCL);
 }
 
 /**
@@ -38,9 +172,8 @@ void i2c_init(struct mpsse_context *mpsse)
  */
 uint8_t i2c_read_sda(struct mpsse_context *mpsse)
 {
-	mpsse->bitbang &= ~PIN_SDA;
-	SetDirection(mpsse, mpsse->bitbang);
-	return PinState(mpsse, SDA, -1);
+	i2c_release_sda(mpsse);
+	return i2c_pin_read(mpsse, SDA);
 }
 
 /**
@@ -52,9 +185,8 @@ uint8_t i2c_read_sda(struct mpsse_context *mpsse)
  */
 uint8_t i2c_read_scl(struct mpsse_context *mpsse)
 {
-	mpsse->bitbang &= ~PIN_SCL;
-	SetDirection(mpsse, mpsse->bitbang);
-	return PinState(mpsse, SCL, -1);
+	i2c_release_scl(mpsse);
+	return i2c_pin_read(mpsse, SCL);
 }
 
 /**
@@ -66,8 +198,7 @@ uint8_t i2c_read_scl(struct mpsse_context *mpsse)
  */
 void i2c_clear_sda(struct mpsse_context *mpsse)
 {
-	mpsse->bitbang |= PIN_SDA;
-	SetDirection(mpsse, mpsse->bitbang);
+	i2c_pin_direction(mpsse, mpsse->bitbang | PIN_SDA);
 }
 
 /**
@@ -79,31 +210,41 @@ void i2c_clear_sda(struct mpsse_context *mpsse)
  */
 void i2c_clear_scl(struct mpsse_context *mpsse)
 {
-	mpsse->bitbang |= PIN_SCL;
-	SetDirection(mpsse, mpsse->bitbang);
+	i2c_pin_direction(mpsse, mpsse->bitbang | PIN_SCL);
 }
 
 /**
- * Send a start signal.
+ * Release SCL and wait while the slave stretches the clock.
  *
  * @param	mpsse	MPSSE structure.
  *
  * @return	None.
  */
-void i2c_start(struct mpsse_context *mpsse)
+static void i2c_wait_scl(struct mpsse_context *mpsse)
 {
-	i2c_read_scl(mpsse);
 	while (i2c_read_scl(mpsse) == 0)
 		;
+}
+
+/**
+ * Send a start signal.
+ *
+ * @param	mpsse	MPSSE structure.
+ *
+ * @return	None.
+ */
+void i2c_start(struct mpsse_context *mpsse)
+{
+	i2c_wait_scl(mpsse);
 
-	i2c_delay();
-	i2c_read_sda(mpsse);
-	i2c_delay();
+	i2c_delay(mpsse);
+	i2c_release_sda(mpsse);
+	i2c_delay(mpsse);
 
 	i2c_clear_sda(mpsse);
-	i2c_delay();
+	i2c_delay(mpsse);
 	i2c_clear_scl(mpsse);
-	i2c_delay();
+	i2c_delay(mpsse);
 }
 
 /**
@@ -116,15 +257,13 @@ void i2c_start(struct mpsse_context *mpsse)
 void i2c_stop(struct mpsse_context *mpsse)
 {
 	i2c_clear_sda(mpsse);
-	i2c_delay();
+	i2c_delay(mpsse);
 
-	i2c_read_scl(mpsse);
-	while (i2c_read_scl(mpsse) == 0)
-		;
-	i2c_delay();
+	i2c_wait_scl(mpsse);
+	i2c_delay(mpsse);
 
-	i2c_read_sda(mpsse);
-	i2c_delay();
+	i2c_release_sda(mpsse);
+	i2c_delay(mpsse);
 }
 
 /**
@@ -138,16 +277,15 @@ void i2c_stop(struct mpsse_context *mpsse)
 void i2c_write_bit(struct mpsse_context *mpsse, uint8_t bit)
 {
 	if (bit)
-		i2c_read_sda(mpsse);
+		i2c_release_sda(mpsse);
 	else
 		i2c_clear_sda(mpsse);
 
-	i2c_delay();
+	i2c_delay(mpsse);
 
-	i2c_read_scl(mpsse);
-	i2c_delay();
-	while (i2c_read_scl(mpsse) == 0)
-		;
+	i2c_release_scl(mpsse);
+	i2c_delay(mpsse);
+	i2c_wait_scl(mpsse);
 
 	i2c_clear_scl(mpsse);
 }
@@ -163,15 +301,13 @@ uint8_t i2c_read_bit(struct mpsse_context *mpsse)
 {
 	uint8_t bit;
 
-	i2c_read_sda(mpsse);
-	i2c_delay();
+	i2c_release_sda(mpsse);
+	i2c_delay(mpsse);
 
-	i2c_read_scl(mpsse);
-	while (i2c_read_scl(mpsse) == 0)
-		;
-	i2c_delay();
+	i2c_wait_scl(mpsse);
+	i2c_delay(mpsse);
 
-	bit = i2c_read_sda(mpsse);
+	bit = i2c_pin_read(mpsse, SDA);
 	i2c_clear_scl(mpsse);
 
 	return bit;
@@ -241,6 +377,16 @@ uint8_t i2c_write_data(struct mpsse_context *mpsse,
 	int index;
 	uint8_t ret = 0;
 
+	if (mpsse->i2c_engine == I2C_ENGINE_SYNCBB)
+		return i2c_syncbb_write_data(mpsse, device_address, address, addr_length,
+					     value, val_length);
+	if (mpsse->i2c_engine == I2C_ENGINE_MPSSE)
+		return i2c_mpsse_write_data(mpsse, device_address, address, addr_length,
+					    value, val_length);
+
+	i2c_stats.transfers = 0;
+	i2c_stats.saved = 0;
+
 	i2c_start(mpsse);
 
 	ret += i2c_write_byte(mpsse, device_address & 0xfe);
@@ -253,8 +399,12 @@ uint8_t i2c_write_data(struct mpsse_context *mpsse,
 
 	i2c_stop(mpsse);
 
+	if (i2c_stats_enabled)
+		cpld_log(NULL, CPLD_LOG_INFO, "I2C write 0x%0*jX: %u USB transfers, %u saved",
+			addr_length * 2, address, i2c_stats.transfers, i2c_stats.saved);
+
 	if (ret != 0)
-		fprintf(stderr, "NACK: %d\n", ret);
+		cpld_log(NULL, CPLD_LOG_ERROR, "NACK: %d", ret);
 	return ret;
 }
 
@@ -279,6 +429,17 @@ uint8_t i2c_read_data(struct mpsse_context *mpsse,
 {
 	int index;
 	uint8_t ret = 0, ack;
+
+	if (mpsse->i2c_engine == I2C_ENGINE_SYNCBB)
+		return i2c_syncbb_read_data(mpsse, device_address, address, addr_length,
+					    value, val_length);
+	if (mpsse->i2c_engine == I2C_ENGINE_MPSSE)
+		return i2c_mpsse_read_data(mpsse, device_address, address, addr_length,
+					   value, val_length);
+
+	i2c_stats.transfers = 0;
+	i2c_stats.saved = 0;
+
 	i2c_start(mpsse);
 	ret += i2c_write_byte(mpsse, device_address & 0xfe);
 	for (index = addr_length - 1; index >= 0; --index)
@@ -293,7 +454,50 @@ uint8_t i2c_read_data(struct mpsse_context *mpsse,
 		*(value + index) = i2c_read_byte(mpsse, ack);
 	}
 	i2c_stop(mpsse);
+
+	if (i2c_stats_enabled)
+		cpld_log(NULL, CPLD_LOG_INFO, "I2C read 0x%0*jX: %u USB transfers, %u saved",
+			addr_length * 2, address, i2c_stats.transfers, i2c_stats.saved);
 	if (ret != 0)
-		fprintf(stderr, "NACK: %d\n", ret);
+		cpld_log(NULL, CPLD_LOG_ERROR, "NACK: %d", ret);
+	return ret;
+}
+
+/**
+ * Run a list of transactions. The MPSSE engine concatenates them, the
+ * other engines run them one by one.
+ *
+ * @param	mpsse		MPSSE structure.
+ * @param	device_address	Device address.
+ * @param	op		Transactions and delays, status is filled in.
+ * @param	count		Number of entries.
+ *
+ * @return	0 if every transaction succeeded.
+ */
+uint8_t i2c_batch(struct mpsse_context *mpsse, uint8_t device_address,
+		  struct bus_op *op, int count)
+{
+	int i;
+	uint8_t ret = 0;
+
+	if (mpsse->i2c_engine == I2C_ENGINE_MPSSE)
+		return i2c_mpsse_batch(mpsse, device_address, op, count);
+
+	for (i = 0; i < count; i++) {
+		if (op[i].type == BUS_DELAY) {
+			usleep(op[i].delay_us);
+			op[i].status = 0;
+		} else if (op[i].type == BUS_WRITE) {
+			op[i].status = i2c_write_data(mpsse, device_address, op[i].address,
+						      op[i].addr_length, op[i].value,
+						      op[i].val_length);
+		} else {
+			op[i].status = i2c_read_data(mpsse, device_address, op[i].address,
+						     op[i].addr_length, op[i].value,
+						     op[i].val_length);
+		}
+		ret |= op[i].status;
+	}
+
 	return ret;
 }
@@ -0,0 +1,391 @@
+/**
+ * Copyright (C) 2020 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include "i2c.h"
+#include "log.h"
+
+/**
+ * MPSSE I2C engine.
+ *
+ * SDA and SCL of the CPLD are wired to BDBUS7/BDBUS6, not to the MPSSE
+ * serial pins (BDBUS0-2), so the hardware I2C shifter of libmpsse cannot
+ * reach them. Instead every bus phase is one SET_BITS_LOW command: the value
+ * byte is always 0 and the direction byte decides which line is pulled LOW,
+ * which gives real open-drain lines. Each phase is held for one TCK period
+ * with CLOCK_N_CYCLES while TCK stays an input, so the TCK divisor sets the
+ * bus speed. ACK and read bits are sampled with GET_BITS_LOW.
+ *
+ * The whole transaction is one ftdi_write_data followed by one read of the
+ * samples. A batch of transactions is concatenated the same way, up to
+ * I2C_MPSSE_CHUNK command bytes per write.
+ */
+
+/* Bytes of MPSSE commands per bus phase: SET_BITS_LOW + CLOCK_N_CYCLES */
+#define PHASE_SIZE 5
+/* Command bytes of batched transactions sent at once, one libftdi chunk */
+#define I2C_MPSSE_CHUNK 4096
+
+struct i2c_cmd {
+	uint8_t *buf;	/* MPSSE commands */
+	uint8_t *in;	/* GET_BITS_LOW samples */
+	int len;
+	int nsample;
+};
+
+/**
+ * Size of the command buffer for a transaction.
+ *
+ * @param	addr_length	Register address length.
+ * @param	val_length	Number of data bytes.
+ *
+ * @return	Upper bound of command bytes.
+ */
+static int i2c_mpsse_size(uint8_t addr_length, uint8_t val_length)
+{
+	/* start, repeated start, stop, 9 clocks of 4 phases and a sample per byte */
+	return 3 * 4 * PHASE_SIZE + (2 + addr_length + val_length) * 9 * (4 * PHASE_SIZE + 1) + 1;
+}
+
+static void i2c_mpsse_put(struct i2c_cmd *cmd, uint8_t scl, uint8_t sda)
+{
+	cmd->buf[cmd->len++] = SET_BITS_LOW;
+	cmd->buf[cmd->len++] = 0x00;
+	cmd->buf[cmd->len++] = (scl ? 0 : PIN_SCL) | (sda ? 0 : PIN_SDA);
+	cmd->buf[cmd->len++] = CLOCK_N_CYCLES;
+	cmd->buf[cmd->len++] = 0x00;	/* 1 TCK period */
+}
+
+static void i2c_mpsse_sample(struct i2c_cmd *cmd)
+{
+	cmd->buf[cmd->len++] = GET_BITS_LOW;
+	cmd->nsample++;
+}
+
+static void i2c_mpsse_start(struct i2c_cmd *cmd)
+{
+	i2c_mpsse_put(cmd, 0, 1);
+	i2c_mpsse_put(cmd, 1, 1);
+	i2c_mpsse_put(cmd, 1, 0);
+	i2c_mpsse_put(cmd, 0, 0);
+}
+
+static void i2c_mpsse_stop(struct i2c_cmd *cmd)
+{
+	i2c_mpsse_put(cmd, 0, 0);
+	i2c_mpsse_put(cmd, 1, 0);
+	i2c_mpsse_put(cmd, 1, 1);
+	i2c_mpsse_put(cmd, 1, 1);
+}
+
+/**
+ * Append one SCL period, SDA is sampled while SCL is HIGH when the slave
+ * drives it.
+ */
+static void i2c_mpsse_bit(struct i2c_cmd *cmd, uint8_t bit, uint8_t slave)
+{
+	if (slave)
+		bit = 1;
+
+	i2c_mpsse_put(cmd, 0, bit);
+	i2c_mpsse_put(cmd, 1, bit);
+	if (slave)
+		i2c_mpsse_sample(cmd);
+	i2c_mpsse_put(cmd, 1, bit);
+	i2c_mpsse_put(cmd, 0, bit);
+}
+
+static void i2c_mpsse_write_byte(struct i2c_cmd *cmd, uint8_t byte)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		i2c_mpsse_bit(cmd, (byte >> i) & 0x01, 0);
+
+	i2c_mpsse_bit(cmd, 1, 1);	/* ACK from slave */
+}
+
+static void i2c_mpsse_read_byte(struct i2c_cmd *cmd, uint8_t ack)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		i2c_mpsse_bit(cmd, 1, 1);
+
+	i2c_mpsse_bit(cmd, ack, 0);
+}
+
+/**
+ * Send the command buffer and collect the samples.
+ *
+ * @param	mpsse	MPSSE structure.
+ * @param	cmd	Compiled commands.
+ *
+ * @return	MPSSE_OK on success.
+ *		MPSSE_FAIL on failure.
+ */
+static int i2c_mpsse_send(struct mpsse_context *mpsse, struct i2c_cmd *cmd)
+{
+	int n, ret;
+
+	cmd->buf[cmd->len++] = SEND_IMMEDIATE;
+
+	ret = ftdi_write_data(&mpsse->ftdi, cmd->buf, cmd->len);
+	if (ret != cmd->len) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "I2C: send data failed (ret = %d)!", ret);
+		return MPSSE_FAIL;
+	}
+
+	for (n = 0; n < cmd->nsample; n += ret) {
+		ret = ftdi_read_data(&mpsse->ftdi, cmd->in + n, cmd->nsample - n);
+		if (ret < 0) {
+			cpld_log(NULL, CPLD_LOG_ERROR, "I2C: read data failed (ret = %d)!", ret);
+			return MPSSE_FAIL;
+		}
+	}
+
+	return MPSSE_OK;
+}
+
+/**
+ * Initialize MPSSE I2C. The channel is switched from bit-bang to MPSSE mode
+ * and both lines are released.
+ *
+ * @param	mpsse	MPSSE structure.
+ * @param	khz	SCL frequency in kHz.
+ *
+ * @return	MPSSE_OK on success.
+ *		MPSSE_FAIL on failure.
+ */
+int i2c_mpsse_init(struct mpsse_context *mpsse, uint32_t khz)
+{
+	uint8_t cmd[] = {
+		DISABLE_ADAPTIVE_CLOCK,
+		DISABLE_3_PHASE_CLOCK,
+		LOOPBACK_END,
+		SET_BITS_LOW, 0x00, 0x00	/* SDA, SCL released */
+	};
+
+	if (ftdi_set_bitmode(&mpsse->ftdi, 0, BITMODE_RESET) < 0 ||
+	    ftdi_set_bitmode(&mpsse->ftdi, 0, BITMODE_MPSSE) < 0) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "I2C: enable MPSSE failed (%s)!",
+			ftdi_get_error_string(&mpsse->ftdi));
+		return MPSSE_FAIL;
+	}
+	ftdi_usb_purge_buffers(&mpsse->ftdi);
+
+	/* Each bus phase lasts one TCK period, 4 phases per SCL period */
+	if (SetClock(mpsse, 4 * khz * 1000) != MPSSE_OK) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "I2C: set clock failed!");
+		return MPSSE_FAIL;
+	}
+
+	if (ftdi_write_data(&mpsse->ftdi, cmd, sizeof(cmd)) != sizeof(cmd)) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "I2C: send setup failed!");
+		return MPSSE_FAIL;
+	}
+	mpsse->bitbang = 0;
+
+	usleep(1000);
+	return MPSSE_OK;
+}
+
+/**
+ * Number of samples of a transaction: one per ACK, eight per read byte.
+ */
+static int i2c_mpsse_nsample(const struct bus_op *op)
+{
+	if (op->type == BUS_WRITE)
+		return 1 + op->addr_length + op->val_length;
+
+	return 2 + op->addr_length + 8 * op->val_length;
+}
+
+/**
+ * Append the commands of one transaction.
+ */
+static void i2c_mpsse_compile(struct i2c_cmd *cmd, uint8_t device_address,
+			      const struct bus_op *op)
+{
+	int index;
+
+	i2c_mpsse_start(cmd);
+	i2c_mpsse_write_byte(cmd, device_address & 0xfe);
+	for (index = op->addr_length - 1; index >= 0; --index)
+		i2c_mpsse_write_byte(cmd, (op->address >> (8 * index)) & 0xFF);
+
+	if (op->type == BUS_WRITE) {
+		for (index = 0; index < op->val_length; ++index)
+			i2c_mpsse_write_byte(cmd, *(op->value + index));
+	} else {
+		i2c_mpsse_start(cmd);
+		i2c_mpsse_write_byte(cmd, device_address | 0x01);
+		for (index = 0; index < op->val_length; ++index)
+			i2c_mpsse_read_byte(cmd, (index + 1 == op->val_length) ? NAK : ACK);
+	}
+	i2c_mpsse_stop(cmd);
+}
+
+/**
+ * Count the NACKs of one transaction and take its read data from the
+ * samples.
+ */
+static uint8_t i2c_mpsse_decode(const uint8_t *in, struct bus_op *op)
+{
+	int index, bit, pos;
+	uint8_t ret = 0;
+
+	if (op->type == BUS_WRITE) {
+		for (pos = 0; pos < i2c_mpsse_nsample(op); pos++)
+			ret += !!(in[pos] & PIN_SDA);
+		return ret;
+	}
+
+	/* ACKs of device address, register address and read address */
+	for (pos = 0; pos < 2 + op->addr_length; pos++)
+		ret += !!(in[pos] & PIN_SDA);
+
+	for (index = 0; index < op->val_length; ++index) {
+		*(op->value + index) = 0;
+		for (bit = 0; bit < 8; bit++)
+			*(op->value + index) = (*(op->value + index) << 1) |
+					       !!(in[pos++] & PIN_SDA);
+	}
+
+	return ret;
+}
+
+/**
+ * Send transactions in one command buffer and decode them.
+ *
+ * @param	mpsse		MPSSE structure.
+ * @param	device_address	Device address.
+ * @param	op		Transactions, no delays.
+ * @param	count		Number of transactions.
+ * @param	len		Upper bound of command bytes.
+ * @param	nsample		Number of samples.
+ *
+ * @return	0 if every transaction succeeded.
+ */
+static uint8_t i2c_mpsse_run(struct mpsse_context *mpsse, uint8_t device_address,
+			     struct bus_op *op, int count, int len, int nsample)
+{
+	int i, pos, failed;
+	uint8_t ret = 0;
+	uint8_t buf[len];
+	uint8_t in[nsample];
+	struct i2c_cmd cmd = { buf, in, 0, 0 };
+
+	for (i = 0; i < count; i++)
+		i2c_mpsse_compile(&cmd, device_address, &op[i]);
+
+	failed = (i2c_mpsse_send(mpsse, &cmd) != MPSSE_OK);
+
+	for (i = 0, pos = 0; i < count; i++) {
+		if (failed) {
+			op[i].status = 1 + op[i].addr_length +
+				       (op[i].type == BUS_WRITE ? op[i].val_length : 1);
+		} else {
+			op[i].status = i2c_mpsse_decode(in + pos, &op[i]);
+			if (op[i].status != 0)
+				cpld_log(NULL, CPLD_LOG_ERROR, "NACK: %d", op[i].status);
+		}
+		pos += i2c_mpsse_nsample(&op[i]);
+		ret |= op[i].status;
+	}
+
+	return ret;
+}
+
+/**
+ * Run a list of transactions. Transactions are concatenated into command
+ * buffers of up to I2C_MPSSE_CHUNK bytes, each sent with one
+ * ftdi_write_data and one read of its samples. A delay ends the buffer
+ * and is waited out on the host.
+ *
+ * @param	mpsse		MPSSE structure.
+ * @param	device_address	Device address.
+ * @param	op		Transactions and delays.
+ * @param	count		Number of entries.
+ *
+ * @return	0 if every transaction succeeded.
+ */
+uint8_t i2c_mpsse_batch(struct mpsse_context *mpsse, uint8_t device_address,
+			struct bus_op *op, int count)
+{
+	int i, start, size, len, nsample;
+	uint8_t ret = 0;
+
+	for (start = 0; start < count; start = i) {
+		if (op[start].type == BUS_DELAY) {
+			usleep(op[start].delay_us);
+			op[start].status = 0;
+			i = start + 1;
+			continue;
+		}
+
+		/* a transaction larger than a chunk goes alone */
+		for (i = start, len = 0, nsample = 0; i < count && op[i].type != BUS_DELAY; i++) {
+			size = i2c_mpsse_size(op[i].addr_length, op[i].val_length);
+			if (i > start && len + size > I2C_MPSSE_CHUNK)
+				break;
+			len += size;
+			nsample += i2c_mpsse_nsample(&op[i]);
+		}
+
+		ret |= i2c_mpsse_run(mpsse, device_address, op + start, i - start, len, nsample);
+	}
+
+	return ret;
+}
+
+/**
+ * Write n bytes data to slave.
+ *
+ * @param	mpsse		MPSSE structure.
+ * @param	device_address	Device address.
+ * @param	address		Register address.
+ * @param	addr_length	Register address length.
+ * @param	value		Value need to write.
+ * @param	val_length	Number of bytes need to write.
+ *
+ * @return	Number of NACKs from slave.
+ */
+uint8_t i2c_mpsse_write_data(struct mpsse_context *mpsse,
+			     uint8_t device_address,
+			     uint64_t address,
+			     uint8_t addr_length,
+			     uint8_t *value,
+			     uint8_t val_length)
+{
+	struct bus_op op = { BUS_WRITE, address, addr_length, value, val_length, 0, 0 };
+
+	return i2c_mpsse_batch(mpsse, device_address, &op, 1);
+}
+
+/**
+ * Read n bytes data from slave.
+ *
+ * @param	mpsse		MPSSE structure.
+ * @param	device_address	Device address.
+ * @param	address		Register address.
+ * @param	addr_length	Register address length.
+ * @param	value		Read value.
+ * @param	val_length	Number of bytes need to read.
+ *
+ * @return	Number of NACKs from slave.
+ */
+uint8_t i2c_mpsse_read_data(struct mpsse_context *mpsse,
+			    uint8_t device_address,
+			    uint64_t address,
+			    uint8_t addr_length,
+			    uint8_t *value,
+			    uint8_t val_length)
+{
+	struct bus_op op = { BUS_READ, address, addr_length, value, val_length, 0, 0 };
+
+	return i2c_mpsse_batch(mpsse, device_address, &op, 1);
+}
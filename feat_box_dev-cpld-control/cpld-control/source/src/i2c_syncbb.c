@@ -0,0 +1,334 @@
+/**
+ * Copyright (C) 2020 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include "i2c.h"
+#include "log.h"
+
+/**
+ * Synchronous bit-bang I2C engine.
+ *
+ * The whole transaction (start, address phase, data, stop) is compiled into
+ * one buffer of pin samples, four per SCL period. SCL is always driven by
+ * the FTDI, the CPLD never stretches the clock. SDA is driven while the
+ * master owns the bus and released while the slave drives ACK or read
+ * bits. In BITMODE_SYNCBB every written byte returns the pin state sampled
+ * before it is applied, so ACK and read bits are decoded from the echoed
+ * samples instead of per-bit ReadPins calls.
+ *
+ * The pin direction cannot change inside a synchronous bit-bang stream, so
+ * the buffer is sent as one ftdi_write_data per direction run, each run
+ * followed by its echo read before the next ftdi_set_bitmode is issued.
+ * SDA only changes direction at the slave ACK and at read byte boundaries,
+ * so a byte costs at most two runs.
+ */
+
+#define DIR_OUT (PIN_SCL | PIN_SDA)
+#define DIR_IN  (PIN_SCL)
+
+/* Empty echo reads before the chip is given up, ~16 ms each */
+#define I2C_SYNCBB_READS 100
+
+struct i2c_wave {
+	uint8_t *out;	/* pin levels to drive */
+	uint8_t *dir;	/* pin direction of each sample */
+	uint8_t *in;	/* echoed pin samples */
+	int *slot;	/* sample index of each slave driven bit */
+	int len;
+	int nslot;
+};
+
+/**
+ * Number of samples needed for a transaction.
+ *
+ * @param	addr_length	Register address length.
+ * @param	val_length	Number of data bytes.
+ *
+ * @return	Upper bound of samples in the waveform.
+ */
+static int i2c_syncbb_samples(uint8_t addr_length, uint8_t val_length)
+{
+	/* start, repeated start and stop plus 9 clocks of 4 samples per byte */
+	return 4 * 3 + (2 + addr_length + val_length) * 9 * 4;
+}
+
+static void i2c_syncbb_put(struct i2c_wave *wave, uint8_t scl, uint8_t sda, uint8_t dir)
+{
+	wave->out[wave->len] = (scl ? PIN_SCL : 0) | (sda ? PIN_SDA : 0);
+	wave->dir[wave->len] = dir;
+	wave->len++;
+}
+
+/**
+ * Append a start (or repeated start) condition, SCL is left LOW.
+ */
+static void i2c_syncbb_start(struct i2c_wave *wave)
+{
+	i2c_syncbb_put(wave, 0, 1, DIR_OUT);
+	i2c_syncbb_put(wave, 1, 1, DIR_OUT);
+	i2c_syncbb_put(wave, 1, 0, DIR_OUT);
+	i2c_syncbb_put(wave, 0, 0, DIR_OUT);
+}
+
+/**
+ * Append a stop condition, the bus is left idle.
+ */
+static void i2c_syncbb_stop(struct i2c_wave *wave)
+{
+	i2c_syncbb_put(wave, 0, 0, DIR_OUT);
+	i2c_syncbb_put(wave, 1, 0, DIR_OUT);
+	i2c_syncbb_put(wave, 1, 1, DIR_OUT);
+	i2c_syncbb_put(wave, 1, 1, DIR_OUT);
+}
+
+/**
+ * Append one SCL period. When the slave drives SDA, the sample taken in
+ * the middle of SCL HIGH is recorded as a slot to decode later.
+ */
+static void i2c_syncbb_bit(struct i2c_wave *wave, uint8_t bit, uint8_t slave)
+{
+	uint8_t dir = slave ? DIR_IN : DIR_OUT;
+
+	if (slave)
+		bit = 1;
+
+	i2c_syncbb_put(wave, 0, bit, dir);
+	i2c_syncbb_put(wave, 1, bit, dir);
+	/* echo of this sample is the pin state after SCL went HIGH */
+	if (slave)
+		wave->slot[wave->nslot++] = wave->len;
+	i2c_syncbb_put(wave, 1, bit, dir);
+	i2c_syncbb_put(wave, 0, bit, dir);
+}
+
+static void i2c_syncbb_write_byte(struct i2c_wave *wave, uint8_t byte)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		i2c_syncbb_bit(wave, (byte >> i) & 0x01, 0);
+
+	i2c_syncbb_bit(wave, 1, 1);	/* ACK from slave */
+}
+
+static void i2c_syncbb_read_byte(struct i2c_wave *wave, uint8_t ack)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		i2c_syncbb_bit(wave, 1, 1);
+
+	/* NAK is a released SDA, keep it in the input run */
+	i2c_syncbb_bit(wave, ack, ack == NAK);
+}
+
+/**
+ * Read the echo of samples already written.
+ *
+ * @param	mpsse	MPSSE structure.
+ * @param	in	Buffer of the echo.
+ * @param	len	Number of samples.
+ *
+ * @return	MPSSE_OK on success.
+ *		MPSSE_FAIL if the read fails or the chip stops answering.
+ */
+static int i2c_syncbb_echo(struct mpsse_context *mpsse, uint8_t *in, int len)
+{
+	int n, ret, empty = 0;
+
+	for (n = 0; n < len; n += ret) {
+		ret = ftdi_read_data(&mpsse->ftdi, in + n, len - n);
+		if (ret < 0 || (ret == 0 && ++empty == I2C_SYNCBB_READS)) {
+			cpld_log(NULL, CPLD_LOG_ERROR, "I2C: read data failed (ret = %d)!", ret);
+			return MPSSE_FAIL;
+		}
+	}
+
+	return MPSSE_OK;
+}
+
+/**
+ * Clock the waveform out, one ftdi_write_data per direction run.
+ *
+ * @param	mpsse	MPSSE structure.
+ * @param	wave	Compiled waveform.
+ *
+ * @return	MPSSE_OK on success.
+ *		MPSSE_FAIL on failure.
+ */
+static int i2c_syncbb_send(struct mpsse_context *mpsse, struct i2c_wave *wave)
+{
+	int start, end, ret;
+
+	for (start = 0; start < wave->len; start = end) {
+		for (end = start + 1; end < wave->len; end++)
+			if (wave->dir[end] != wave->dir[start])
+				break;
+
+		if (wave->dir[start] != mpsse->bitbang) {
+			mpsse->bitbang = wave->dir[start];
+			ret = ftdi_set_bitmode(&mpsse->ftdi, mpsse->bitbang, BITMODE_SYNCBB);
+			if (ret < 0) {
+				cpld_log(NULL, CPLD_LOG_ERROR, "I2C: set direction failed (ret = %d)!", ret);
+				return MPSSE_FAIL;
+			}
+		}
+
+		ret = ftdi_write_data(&mpsse->ftdi, wave->out + start, end - start);
+		if (ret < 0) {
+			cpld_log(NULL, CPLD_LOG_ERROR, "I2C: send data failed (ret = %d)!", ret);
+			return MPSSE_FAIL;
+		}
+
+		if (i2c_syncbb_echo(mpsse, wave->in + start, end - start) != MPSSE_OK)
+			return MPSSE_FAIL;
+	}
+
+	return MPSSE_OK;
+}
+
+/**
+ * Initialize synchronous bit-bang I2C.
+ *
+ * @param	mpsse	MPSSE structure.
+ * @param	khz	SCL frequency in kHz.
+ *
+ * @return	MPSSE_OK on success.
+ *		MPSSE_FAIL on failure.
+ */
+int i2c_syncbb_init(struct mpsse_context *mpsse, uint32_t khz)
+{
+	int ret;
+	uint8_t dat[16];
+
+	mpsse->bitbang = DIR_OUT;
+	ret = ftdi_set_bitmode(&mpsse->ftdi, mpsse->bitbang, BITMODE_SYNCBB);
+	if (ret < 0) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "I2C: enable synchronous bit-bang failed (ret = %d)!", ret);
+		return MPSSE_FAIL;
+	}
+	/* libftdi clocks bit-bang samples at four times the baud rate */
+	ret = ftdi_set_baudrate(&mpsse->ftdi, khz * 1000);
+	if (ret < 0) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "I2C: set %u kHz failed (ret = %d)!", khz, ret);
+		return MPSSE_FAIL;
+	}
+
+	/* Drop anything left from a previous mode */
+	while ((ret = ftdi_read_data(&mpsse->ftdi, dat, sizeof(dat))) > 0)
+		;
+
+	/* Bus idle: SCL and SDA HIGH */
+	dat[0] = PIN_SCL | PIN_SDA;
+	ret = ftdi_write_data(&mpsse->ftdi, dat, 1);
+	if (ret < 0) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "I2C: send data failed (ret = %d)!", ret);
+		return MPSSE_FAIL;
+	}
+	if (i2c_syncbb_echo(mpsse, dat, 1) != MPSSE_OK)
+		return MPSSE_FAIL;
+
+	usleep(1000);
+	return MPSSE_OK;
+}
+
+/**
+ * Write n bytes data to slave.
+ *
+ * @param	mpsse		MPSSE structure.
+ * @param	device_address	Device address.
+ * @param	address		Register address.
+ * @param	addr_length	Register address length.
+ * @param	value		Value need to write.
+ * @param	val_length	Number of bytes need to write.
+ *
+ * @return	Number of NACKs from slave.
+ */
+uint8_t i2c_syncbb_write_data(struct mpsse_context *mpsse,
+			      uint8_t device_address,
+			      uint64_t address,
+			      uint8_t addr_length,
+			      uint8_t *value,
+			      uint8_t val_length)
+{
+	int index, size = i2c_syncbb_samples(addr_length, val_length);
+	uint8_t ret = 0;
+	uint8_t out[size], dir[size], in[size];
+	int slot[2 + addr_length + val_length];
+	struct i2c_wave wave = { out, dir, in, slot, 0, 0 };
+
+	i2c_syncbb_start(&wave);
+	i2c_syncbb_write_byte(&wave, device_address & 0xfe);
+	for (index = addr_length - 1; index >= 0; --index)
+		i2c_syncbb_write_byte(&wave, (address >> (8 * index)) & 0xFF);
+	for (index = 0; index < val_length; ++index)
+		i2c_syncbb_write_byte(&wave, *(value + index));
+	i2c_syncbb_stop(&wave);
+
+	if (i2c_syncbb_send(mpsse, &wave) != MPSSE_OK)
+		return 1 + addr_length + val_length;
+
+	for (index = 0; index < wave.nslot; index++)
+		ret += !!(in[slot[index]] & PIN_SDA);
+
+	if (ret != 0)
+		cpld_log(NULL, CPLD_LOG_ERROR, "NACK: %d", ret);
+	return ret;
+}
+
+/**
+ * Read n bytes data from slave.
+ *
+ * @param	mpsse		MPSSE structure.
+ * @param	device_address	Device address.
+ * @param	address		Register address.
+ * @param	addr_length	Register address length.
+ * @param	value		Read value.
+ * @param	val_length	Number of bytes need to read.
+ *
+ * @return	Number of NACKs from slave.
+ */
+uint8_t i2c_syncbb_read_data(struct mpsse_context *mpsse,
+			     uint8_t device_address,
+			     uint64_t address,
+			     uint8_t addr_length,
+			     uint8_t *value,
+			     uint8_t val_length)
+{
+	int index, bit, pos, size = i2c_syncbb_samples(addr_length, val_length);
+	uint8_t ret = 0;
+	uint8_t out[size], dir[size], in[size];
+	int slot[2 + addr_length + 9 * val_length];
+	struct i2c_wave wave = { out, dir, in, slot, 0, 0 };
+
+	i2c_syncbb_start(&wave);
+	i2c_syncbb_write_byte(&wave, device_address & 0xfe);
+	for (index = addr_length - 1; index >= 0; --index)
+		i2c_syncbb_write_byte(&wave, (address >> (8 * index)) & 0xFF);
+	i2c_syncbb_start(&wave);
+	i2c_syncbb_write_byte(&wave, device_address | 0x01);
+	for (index = 0; index < val_length; ++index)
+		i2c_syncbb_read_byte(&wave, (index + 1 == val_length) ? NAK : ACK);
+	i2c_syncbb_stop(&wave);
+
+	if (i2c_syncbb_send(mpsse, &wave) != MPSSE_OK)
+		return 2 + addr_length;
+
+	/* ACKs of device address, register address and read address */
+	for (pos = 0; pos < 2 + addr_length; pos++)
+		ret += !!(in[slot[pos]] & PIN_SDA);
+
+	for (index = 0; index < val_length; ++index) {
+		*(value + index) = 0;
+		for (bit = 0; bit < 8; bit++)
+			*(value + index) = (*(value + index) << 1) |
+					   !!(in[slot[pos++]] & PIN_SDA);
+	}
+
+	if (ret != 0)
+		cpld_log(NULL, CPLD_LOG_ERROR, "NACK: %d", ret);
+	return ret;
+}
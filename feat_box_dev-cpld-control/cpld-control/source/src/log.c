@@ -0,0 +1,69 @@
+/**
+ * Copyright (C) 2020 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include "log.h"
+#include <stdarg.h>
+#include <stdio.h>
+
+/**
+ * Messages.
+ *
+ * The library prints nothing itself. Errors and notes are formatted into
+ * one line and handed to a log handler: the handler of the CPLD they are
+ * about, or the default handler for CPLDs without one and for messages of
+ * the bus layers, which do not know their CPLD. The default handler
+ * prints to stderr.
+ */
+
+/* Longest message, longer ones are cut */
+#define CPLD_LOG_MAX 256
+
+static void cpld_log_stderr(void *arg, enum cpld_log_level level, const char *msg)
+{
+	fprintf(stderr, "%s\n", msg);
+}
+
+static struct cpld_log_handler cpld_log_default = { cpld_log_stderr, NULL };
+
+/**
+ * Set the default log handler.
+ *
+ * @param	fn	Handler, NULL to print to stderr.
+ * @param	arg	Argument of the handler.
+ *
+ * @return	None.
+ */
+void cpld_log_set_default(cpld_log_fn fn, void *arg)
+{
+	cpld_log_default.fn = fn ? fn : cpld_log_stderr;
+	cpld_log_default.arg = fn ? arg : NULL;
+}
+
+/**
+ * Format a message and pass it to a log handler.
+ *
+ * @param	handler	Handler, NULL or one without a function for the default.
+ * @param	level	Level of the message.
+ * @param	fmt	printf format of the message, without a trailing newline.
+ *
+ * @return	None.
+ */
+void cpld_log(const struct cpld_log_handler *handler, enum cpld_log_level level,
+	      const char *fmt, ...)
+{
+	char msg[CPLD_LOG_MAX];
+	va_list ap;
+
+	if (handler == NULL || handler->fn == NULL)
+		handler = &cpld_log_default;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	handler->fn(handler->arg, level, msg);
+}
@@ -5,44 +5,93 @@
  * it under the terms of the GNU General Public License version 2 as
  * published by the Free Software Foundation.
  */
-#include "cpld.h"
+#include "command.h"
+#include "cache.h"
+#include "daemon.h"
+#include "fleet.h"
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define MAJOR_VERSION 1
-#define MINOR_VERSION 7
+static char *socket_path;
 
 /**
- * usage
+ * Parse options placed before the command and drop them from argv.
+ *
+ * @param	argc	Pointer to argument count.
+ * @param	argv	Pointer to argument vector.
+ *
+ * @return	0 on success, 1 on unknown option.
  */
-void usage(char *pn)
+int parse_options(int *argc, char ***argv)
 {
-	printf("CPLD control version %d.%d.1\n", MAJOR_VERSION, MINOR_VERSION);
-	printf("\nThe valid <Board name>: M3SK, H3SK, V3HSK, V3MSK, V3U, S4\n\n");
-	printf("%s -h ....................................................... ", pn);
-	printf("Print this help.\n");
-
-	printf("%s -l ....................................................... ", pn);
-	printf("List available devices.\n");
-
-	printf("%s -c <Board name> <Old serial number> <New serial number>... ", pn);
-	printf("Change FTDI serial number\n");
-
-	printf("%s -r <Board name> <FTDI iSerial> ........................... ", pn);
-	printf("Print all CPLD registers.\n");
-
-	printf("%s -r <Board name> <FTDI iSerial> <reg>* .................... ", pn);
-	printf("Print 1 CPLD register.\n");
-	printf("\t\t\t\t *One or more <reg> can be specified.\n");
+	char *opt, *end;
+	unsigned long khz, hold;
+	unsigned int wait, deadline;
+
+	while (*argc > 1 && !strncmp((*argv)[1], "--", 2)) {
+		opt = (*argv)[1];
+		if (!strcmp(opt, "--i2c-engine=bitbang")) {
+			cpld_set_i2c_engine(NULL, I2C_ENGINE_BITBANG);
+		} else if (!strcmp(opt, "--i2c-engine=syncbb")) {
+			cpld_set_i2c_engine(NULL, I2C_ENGINE_SYNCBB);
+		} else if (!strcmp(opt, "--i2c-engine=mpsse")) {
+			cpld_set_i2c_engine(NULL, I2C_ENGINE_MPSSE);
+		} else if (!strncmp(opt, "--nv-erase=", 11) || !strncmp(opt, "--nv-program=", 13)) {
+			if (sscanf(strchr(opt, '=') + 1, "%u,%u", &wait, &deadline) != 2) {
+				fprintf(stderr, "Invalid option %s!\n", opt);
+				return 1;
+			}
+			cpld_flash_set_poll(NULL, opt[5] == 'e' ? CPLD_FLASH_ERASE : CPLD_FLASH_PROGRAM,
+					    wait, deadline);
+		} else if (!strcmp(opt, "--verify=written")) {
+			cpld_set_verify(NULL, CPLD_VERIFY_WRITTEN);
+		} else if (!strcmp(opt, "--verify=full")) {
+			cpld_set_verify(NULL, CPLD_VERIFY_FULL);
+		} else if (!strcmp(opt, "--verify=none")) {
+			cpld_set_verify(NULL, CPLD_VERIFY_NONE);
+		} else if (!strcmp(opt, "--nv-force")) {
+			cpld_nv_set_force(NULL, 1);
+		} else if (!strncmp(opt, "--spi-hold=", 11)) {
+			hold = strtoul(opt + 11, &end, 0);
+			if (opt[11] == '\0' || *end != '\0' || hold > SPI_HOLD_MAX) {
+				fprintf(stderr, "SPI hold must be 0..%d!\n", SPI_HOLD_MAX);
+				return 1;
+			}
+			cpld_set_spi_hold(NULL, hold);
+		} else if (!strncmp(opt, "--boards=", 9)) {
+			cpld_board_set_file(opt + 9);
+		} else if (!strcmp(opt, "--cache")) {
+			cpld_cache_set_dir(NULL, "");
+		} else if (!strncmp(opt, "--cache=", 8)) {
+			cpld_cache_set_dir(NULL, opt + 8);
+		} else if (!strcmp(opt, "--no-cache")) {
+			cpld_cache_set_dir(NULL, NULL);
+		} else if (!strncmp(opt, "--socket=", 9)) {
+			socket_path = opt + 9;
+		} else if (!strcmp(opt, "--i2c-stats")) {
+			i2c_set_stats(1);
+		} else if (!strncmp(opt, "--i2c-khz=", 10)) {
+			khz = strtoul(opt + 10, &end, 0);
+			if (*end != '\0' || khz < I2C_KHZ_MIN || khz > I2C_KHZ_MAX) {
+				fprintf(stderr, "I2C speed must be %d..%d kHz!\n",
+					I2C_KHZ_MIN, I2C_KHZ_MAX);
+				return 1;
+			}
+			cpld_set_i2c_khz(NULL, khz);
+		} else {
+			fprintf(stderr, "Unknown option %s!\n", opt);
+			return 1;
+		}
 
-	printf("%s -w <Board name> <FTDI iSerial> [<reg> <val>]* ............ ", pn);
-	printf("Write CPLD register(s).\n");
-	printf("\t\t\t\t *One or more [<reg> <val>] pairs can be specified.\n");
+		/* keep the program name in front */
+		(*argv)[1] = (*argv)[0];
+		(*argv)++;
+		(*argc)--;
+	}
 
-	printf("%s -wnv <Board name> <FTDI iSerial> [<reg> <val>]* .......... ", pn);
-	printf("Write non-volatile CPLD register(s).\n");
-	printf("\t\t\t\t *One or more [<reg> <val>] pairs can be specified.\n");
+	return 0;
 }
 
 /**
@@ -51,122 +100,52 @@ void usage(char *pn)
 int main(int argc, char *argv[])
 {
 	struct cpld_context *cpld;
-	uint64_t reg;
-	uint64_t val;
-	char *endptr;
-	int i, ret = EXIT_FAILURE;
-
-	if ((argc < 2) || (argc == 2 && !strcmp(argv[1], "-h"))) {
-		usage(argv[0]);
-		return EXIT_SUCCESS;
-	}
+	char path[PATH_MAX];
+	int ret = EXIT_FAILURE;
 
-	if (argc == 2 && !strcmp(argv[1], "-l")) {
-		ret = cpld_list();
-		return ret;
-	}
+	socket_path = getenv("CPLD_CONTROL_SOCKET");
+	cpld_board_set_file(getenv("CPLD_CONTROL_BOARDS"));
+	cpld_cache_set_dir(NULL, getenv("CPLD_CONTROL_CACHE"));
 
-	if (argc > 2 && !strcmp(argv[1], "-l")) {
-		fprintf(stderr, "The -l option takes no arguments!\n");
+	if (parse_options(&argc, &argv) != 0) {
 		usage(argv[0]);
 		return ret;
 	}
 
-	if (argc != 5 && !strcmp(argv[1], "-c")) {
-		fprintf(stderr, "The -c option takes three arguments");
-		fprintf(stderr, "(board name, old serial number and new serial number)!\n");
-		usage(argv[0]);
-		return ret;
+	/* Serve requests from other cpld-control invocations */
+	if (argc == 2 && !strcmp(argv[1], "-daemon")) {
+		if (socket_path != NULL)
+			return cpld_daemon(socket_path);
+		if (cpld_socket_default(path, sizeof(path)) != 0) {
+			fprintf(stderr, "XDG_RUNTIME_DIR is not set, give the socket with --socket!\n");
+			return ret;
+		}
+		return cpld_daemon(path);
 	}
 
-	if (strcmp(argv[1], "-r") && strcmp(argv[1], "-w") &&
-	    strcmp(argv[1], "-c") && strcmp(argv[1], "-wnv") && argc >= 2) {
-		printf("Unknown option!\n");
-		usage(argv[0]);
+	ret = cpld_check_args(argc, argv);
+	if (ret != -1)
 		return ret;
-	}
 
-	if (argc < 4 && !strcmp(argv[1], "-r")) {
-		fprintf(stderr, "The -d option takes at least one board name and one iSerial!\n");
-		usage(argv[0]);
-		return ret;
-	}
+	/* Forward the command to a running daemon */
+	if (socket_path != NULL)
+		return cpld_client(socket_path, argc, argv);
 
-	if (((argc < 6) || (((argc - 6) % 2) != 0)) && !strcmp(argv[1], "-w")) {
-		fprintf(stderr, "The -w option takes one board name, one iSerial ");
-		fprintf(stderr, "and at least one reg/val pair!\n");
-		usage(argv[0]);
-		return ret;
-	}
+	if (!strcmp(argv[1], "-l"))
+		return cpld_list(argc == 3);
 
-	if (((argc < 6) || (((argc - 6) % 2) != 0)) && !strcmp(argv[1], "-wnv")) {
-		fprintf(stderr, "The -wnv option takes one board name, one iSerial ");
-		fprintf(stderr, "and at least one reg/val pair!\n");
-		usage(argv[0]);
-		return ret;
-	}
+	if (cpld_is_fleet(argv[3]))
+		return cpld_fleet(argc, argv, cpld_command_open, cpld_close);
 
 	/* init CPLD */
-	ret = EXIT_SUCCESS;
-	cpld = cpld_init(argv[2], argv[3]);
+	cpld = cpld_command_open(argv[2], argv[3]);
 	if (cpld == NULL) {
 		fprintf(stderr, "Initialize failed!\n");
 		return EXIT_FAILURE;
 	}
 
-	/* Change serial number */
-	if (argc == 5 && !strcmp(argv[1], "-c")) {
-		ret = cpld_change_serial(cpld, argv[4]);
-		if (ret != 0) {
-			fprintf(stderr, "Failed to change serial!\n");
-			cpld_deinit(cpld);
-			return ret;
-		}
-	}
-
-	/* Dump registers */
-	if (argc == 4 && !strcmp(argv[1], "-r")) {
-		ret = cpld_dump(cpld, 0xFFFFF);
-	} else if (argc > 4 && !strcmp(argv[1], "-r")) {
-		for (i = 4; i < argc; i++) {
-			reg = strtoull(argv[i], &endptr, 16);
-			if (reg == ULLONG_MAX)
-				fprintf(stderr, "The address %s is too large!\n", argv[i]);
-			else
-				ret |= cpld_dump(cpld, reg);
-		}
-	}
-
-	/* Write registers */
-	if (argc >= 5 && (((argc - 6) % 2) == 0) && !strcmp(argv[1], "-w")) {
-		for (i = 4; i < argc; i += 2) {
-			reg = strtoull(argv[i], &endptr, 16);
-			val = strtoull(argv[i + 1], &endptr, 16);
-			if (reg == ULLONG_MAX || val == ULLONG_MAX)
-				fprintf(stderr, "The address %s or value %s is too large!\n",
-					argv[i],
-					argv[i + 1]);
-			else
-				ret = cpld_write(cpld, reg, (uint8_t *)&val);
-		}
-		ret |= cpld_dump(cpld, 0xFFFFF);
-	}
-
-	/* Write non-volatile registers */
-	if (argc >= 5 && (((argc - 6) % 2) == 0) && !strcmp(argv[1], "-wnv")) {
-		for (i = 4; i < argc; i += 2) {
-			reg = strtoull(argv[i], &endptr, 16);
-			val = strtoull(argv[i + 1], &endptr, 16);
-			if (reg == ULLONG_MAX || val == ULLONG_MAX)
-				fprintf(stderr, "The address %s or value %s is too large!\n",
-					argv[i],
-					argv[i + 1]);
-			else
-				ret = cpld_write_nonvolatile(cpld, reg, (uint8_t *)&val);
-		}
-		ret |= cpld_dump(cpld, 0xFFFFF);
-	}
+	ret = cpld_command(cpld, argc, argv);
 
-	cpld_deinit(cpld);
+	cpld_close(cpld);
 	return ret;
 }
@@ -6,12 +6,97 @@
  * published by the Free Software Foundation.
  */
 #include "smi.h"
+#include "log.h"
+#include <pthread.h>
+#include <string.h>
+
+/**
+ * SMI frames run in synchronous bit-bang mode: every MDC period is two
+ * samples and every written sample returns the pin state read just before
+ * it was applied. A batch of frames is concatenated into one sample buffer,
+ * the echo is read with a transfer that is queued before the write goes
+ * out, so the chip never stalls on a full receive FIFO and a whole batch
+ * costs one USB write and one USB read.
+ */
 
 struct smi_bufer {
 	uint32_t data;
 	uint8_t length;
 };
 
+static pthread_once_t smi_once = PTHREAD_ONCE_INIT;
+static uint8_t smi_template[2][2][SMI_FRAME_SIZE];
+static uint8_t smi_lut[256][16];
+
+/**
+ * Send samples and collect their echo.
+ *
+ * @param	mpsse	MPSSE structure.
+ * @param	out	Samples to send.
+ * @param	in	Echoed samples.
+ * @param	len	Number of samples.
+ *
+ * @return	MPSSE_OK on success.
+ *		MPSSE_FAIL on failure.
+ */
+static int smi_exchange(struct mpsse_context *mpsse, uint8_t *out, uint8_t *in, int len)
+{
+#if LIBFTDI1 == 1
+	struct ftdi_transfer_control *rtc, *wtc;
+	struct timeval tv = { 1, 0 };
+	int ret;
+
+	rtc = ftdi_read_data_submit(&mpsse->ftdi, in, len);
+	if (rtc == NULL) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "SMI: submit read failed!");
+		return MPSSE_FAIL;
+	}
+
+	wtc = ftdi_write_data_submit(&mpsse->ftdi, out, len);
+	if (wtc == NULL) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "SMI: submit write failed!");
+		ftdi_transfer_data_cancel(rtc, &tv);
+		return MPSSE_FAIL;
+	}
+
+	ret = ftdi_transfer_data_done(wtc);
+	if (ret != len) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "SMI: send data failed (ret = %d)!", ret);
+		ftdi_transfer_data_cancel(rtc, &tv);
+		return MPSSE_FAIL;
+	}
+
+	ret = ftdi_transfer_data_done(rtc);
+	if (ret != len) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "SMI: read data failed (ret = %d)!", ret);
+		return MPSSE_FAIL;
+	}
+#else
+	int start, size, n, ret;
+
+	/* One frame at a time, the receive FIFO cannot hold more */
+	for (start = 0; start < len; start += size) {
+		size = (len - start < SMI_FRAME_SIZE) ? len - start : SMI_FRAME_SIZE;
+
+		ret = ftdi_write_data(&mpsse->ftdi, out + start, size);
+		if (ret != size) {
+			cpld_log(NULL, CPLD_LOG_ERROR, "SMI: send data failed (ret = %d)!", ret);
+			return MPSSE_FAIL;
+		}
+
+		for (n = 0; n < size; n += ret) {
+			ret = ftdi_read_data(&mpsse->ftdi, in + start + n, size - n);
+			if (ret < 0) {
+				cpld_log(NULL, CPLD_LOG_ERROR, "SMI: read data failed (ret = %d)!", ret);
+				return MPSSE_FAIL;
+			}
+		}
+	}
+#endif
+
+	return MPSSE_OK;
+}
+
 /**
  * Initialize SMI protocol.
  *
@@ -23,19 +108,23 @@ struct smi_bufer {
 int smi_init(struct mpsse_context *mpsse)
 {
 	int ret;
-	uint8_t dat;
+	uint8_t dat, echo[64];
 
 	/* Setup MDC, MDO as output */
 	mpsse->bitbang = PIN_MDC | PIN_MDO;
 	ftdi_set_bitmode(&(mpsse->ftdi), mpsse->bitbang, BITMODE_SYNCBB);
 	ftdi_set_baudrate(&(mpsse->ftdi), 3000000);
 
+	/* Drop anything left from the asynchronous mode */
+	while ((ret = ftdi_read_data(&mpsse->ftdi, echo, sizeof(echo))) > 0)
+		;
+
 	/* Set MDC, MDO to low for safe pattern */
 	dat = PIN_MDC | PIN_MDO;
 
-	ret = Write(mpsse, (char *)&dat, 1);
+	ret = smi_exchange(mpsse, &dat, echo, 1);
 	if (ret == MPSSE_FAIL) {
-		fprintf(stderr, "SMI: send data failed!\n");
+		cpld_log(NULL, CPLD_LOG_ERROR, "SMI: send data failed!");
 		return ret;
 	}
 
@@ -43,27 +132,17 @@ int smi_init(struct mpsse_context *mpsse)
 }
 
 /**
- * Generate data to read register
+ * Convert a frame description to samples.
  *
  * @param	buffer	buffer to storing data.
- * @param	address	register needs to read.
+ * @param	buf	Frame fields.
  *
- * @return	None.
+ * @return	Number of samples.
  */
-void smi_generate_read(uint8_t *buffer, uint16_t address)
+static int smi_generate(uint8_t *buffer, struct smi_bufer *buf)
 {
 	int8_t i, pos, bit;
 	uint16_t idx = 0;
-	struct smi_bufer buf[8] = {
-		{ 0x01, 1 },	    // begin
-		{ 0xFFFFFFFF, 32 }, // preamble
-		{ 0x01, 2 },	    // start
-		{ 0x02, 2 },	    // read
-		{ address, 10 },    // address
-		{ 0x00, 2 },	    // turnaround
-		{ 0x00, 16 },	    // data
-		{ 0x01, 1 }	    // end
-	};
 
 	for (i = 0; i < 8; i++) {
 		for (pos = buf[i].length - 1; pos >= 0; pos--) {
@@ -73,40 +152,152 @@ void smi_generate_read(uint8_t *buffer, uint16_t address)
 			idx++;
 		}
 	}
+
+	return 2 * idx;
 }
 
 /**
- * Generate data to write register
- *
- * @param	buffer	buffer to storing data.
- * @param	address	register needs to write.
- * @param	value	value to write.
- *
- * @return	None.
+ * Build the frame templates and the byte to samples table. Templates are
+ * indexed by [write][preamble] and carry zero address and data bits.
  */
-void smi_generate_write(uint8_t *buffer, uint16_t address, uint16_t *value)
+static void smi_build_templates(void)
 {
-	int8_t i, pos, bit;
-	uint16_t idx = 0;
+	int i, write, preamble;
 	struct smi_bufer buf[8] = {
 		{ 0x01, 1 },	    // begin
 		{ 0xFFFFFFFF, 32 }, // preamble
 		{ 0x01, 2 },	    // start
-		{ 0x01, 2 },	    // write
-		{ address, 10 },    // address
-		{ 0x02, 2 },	    // turnaround
-		{ *value, 16 },	    // data
+		{ 0x02, 2 },	    // read (0x01 write)
+		{ 0x00, 10 },	    // address
+		{ 0x00, 2 },	    // turnaround (0x02 write)
+		{ 0x00, 16 },	    // data
 		{ 0x01, 1 }	    // end
 	};
 
-	for (i = 0; i < 8; i++) {
-		for (pos = buf[i].length - 1; pos >= 0; pos--) {
-			bit = (buf[i].data & (1 << pos)) ? PIN_MDO : 0;
-			*(buffer + (2 * idx) + 0) = bit;
-			*(buffer + (2 * idx) + 1) = bit | PIN_MDC;
-			idx++;
+	for (write = 0; write < 2; write++) {
+		for (preamble = 0; preamble < 2; preamble++) {
+			buf[1].length = preamble ? 32 : 0;
+			buf[3].data = write ? 0x01 : 0x02;
+			buf[5].data = write ? 0x02 : 0x00;
+			smi_generate(smi_template[write][preamble], buf);
+		}
+	}
+
+	for (i = 0; i < 256; i++) {
+		buf[0].data = i;
+		buf[0].length = 8;
+		buf[1].length = buf[2].length = buf[3].length = buf[4].length = 0;
+		buf[5].length = buf[6].length = buf[7].length = 0;
+		smi_generate(smi_lut[i], buf);
+	}
+}
+
+/**
+ * Encode one frame from its template. Only the address and data slots
+ * are patched, 16 samples per byte from the lookup table.
+ *
+ * @param	buffer		Caller buffer of at least SMI_FRAME_SIZE samples.
+ * @param	frame		Frame to encode.
+ * @param	preamble	0 to leave out the preamble.
+ *
+ * @return	Number of samples.
+ */
+int smi_encode(uint8_t *buffer, const struct smi_frame *frame, uint8_t preamble)
+{
+	int len = preamble ? SMI_FRAME_SIZE : SMI_SHORT_SIZE;
+	/* address follows begin, preamble, start and op */
+	uint8_t *slot = buffer + 2 * (1 + (preamble ? 32 : 0) + 4);
+
+	pthread_once(&smi_once, smi_build_templates);
+
+	memcpy(buffer, smi_template[!!frame->write][!!preamble], len);
+
+	/* 10-bit address: the low 2 bits of the high byte, then the low byte */
+	memcpy(slot, smi_lut[(frame->address >> 8) & 0x03] + 12, 4);
+	memcpy(slot + 4, smi_lut[frame->address & 0xFF], 16);
+
+	/* the data slot follows the turnaround */
+	if (frame->write) {
+		memcpy(slot + 24, smi_lut[frame->value >> 8], 16);
+		memcpy(slot + 40, smi_lut[frame->value & 0xFF], 16);
+	}
+
+	return len;
+}
+
+/**
+ * Run a list of SMI frames. Frames go out in bursts of up to SMI_BURST
+ * samples, the value of every read frame is filled in from the echo of
+ * its burst. With mpsse->smi_short set only the first frame of a burst
+ * carries the preamble.
+ *
+ * @param	mpsse	MPSSE structure.
+ * @param	frame	Frames to run.
+ * @param	count	Number of frames.
+ *
+ * @return	MPSSE_OK on success.
+ *		MPSSE_FAIL on failure.
+ */
+int smi_transfer(struct mpsse_context *mpsse, struct smi_frame *frame, int count)
+{
+	int i, j, n, len, done, preamble;
+	int start[SMI_BURST / SMI_SHORT_SIZE];
+	uint8_t out[SMI_BURST];
+	uint8_t in[SMI_BURST];
+	uint8_t *data;
+
+	for (done = 0; done < count; done += n) {
+		for (n = 0, len = 0; done + n < count; n++) {
+			preamble = (n == 0 || !mpsse->smi_short);
+			if (len + (preamble ? SMI_FRAME_SIZE : SMI_SHORT_SIZE) > SMI_BURST)
+				break;
+
+			start[n] = len;
+			len += smi_encode(out + len, &frame[done + n], preamble);
+		}
+
+		if (smi_exchange(mpsse, out, in, len) != MPSSE_OK)
+			return MPSSE_FAIL;
+
+		/* MDI of data bit j is echoed by the low sample of bit j + 1 */
+		for (i = 0; i < n; i++) {
+			if (frame[done + i].write)
+				continue;
+			preamble = (i == 0 || !mpsse->smi_short);
+			data = in + start[i] + (preamble ? SMI_FRAME_SIZE : SMI_SHORT_SIZE) - 32;
+			frame[done + i].value = 0;
+			for (j = 0; j < 16; j++)
+				frame[done + i].value = (frame[done + i].value << 1) |
+							!!(data[j * 2] & PIN_MDI);
 		}
 	}
+
+	return MPSSE_OK;
+}
+
+/**
+ * Find out whether the slave accepts frames without preamble. Two reads
+ * of the same register go out in one burst, the second one without
+ * preamble; short frames are used only if both return the same value.
+ *
+ * @param	mpsse	MPSSE structure.
+ * @param	address	Register with a known value other than 0xFFFF.
+ *
+ * @return	1 if the preamble can be suppressed, 0 otherwise.
+ */
+int smi_detect_preamble(struct mpsse_context *mpsse, uint16_t address)
+{
+	struct smi_frame frame[2] = {
+		{ address, 0, 0 },
+		{ address, 0, 0 }
+	};
+
+	mpsse->smi_short = 1;
+	if (smi_transfer(mpsse, frame, 2) != MPSSE_OK ||
+	    frame[0].value == 0xFFFF || frame[1].value != frame[0].value)
+		mpsse->smi_short = 0;
+
+	return mpsse->smi_short;
 }
 
 /**
@@ -127,44 +318,62 @@ int smi_read(struct mpsse_context *mpsse,
 	     uint8_t *value,
 	     uint8_t val_length)
 {
-	int ret = 0;
-	uint8_t i, j, pos;
-	uint8_t data[132];
-	uint16_t idx;
+	int i, ret;
+	struct smi_frame frame[val_length / 2 + 1];
 
-	// read data to clean buffer
-	while ((ret = ftdi_read_data(&mpsse->ftdi, data, 132)) > 0)
-		;
+	for (i = 0; i < val_length / 2; i++) {
+		frame[i].address = address + i;
+		frame[i].write = 0;
+	}
 
-	if (ret < 0) {
-		fprintf(stderr, "SMI: clean buffer error (ret = %d)\n", ret);
+	ret = smi_transfer(mpsse, frame, val_length / 2);
+	if (ret != MPSSE_OK)
 		return ret;
-	}
 
+	/* Words are stored little endian */
 	for (i = 0; i < val_length / 2; i++) {
+		*(value + i * 2) = frame[i].value & 0xFF;
+		*(value + i * 2 + 1) = frame[i].value >> 8;
+	}
 
-		// prepare data
-		smi_generate_read(data, address + i);
+	return MPSSE_OK;
+}
 
-		// send data
-		ret = ftdi_write_data(&mpsse->ftdi, data, 132);
-		if (ret < 0) {
-			fprintf(stderr, "SMI: send data failed (ret = %d)!\n", ret);
-			return ret;
-		}
+/**
+ * Read n bytes data from the V3MSK flash window (0x2XX, 0x3XX). A flash
+ * read returns the word of the previous request, so one more frame is
+ * sent and every result is taken from the frame after its request.
+ *
+ * @param	mpsse		MPSSE structure.
+ * @param	address		Register address.
+ * @param	addr_length	Register address length.
+ * @param	value		Read value.
+ * @param	val_length	Number of bytes need to read.
+ *
+ * @return	MPSSE_OK on success.
+ *		MPSSE_FAIL on failure.
+ */
+int smi_read_flash(struct mpsse_context *mpsse,
+		   uint64_t address,
+		   uint8_t addr_length,
+		   uint8_t *value,
+		   uint8_t val_length)
+{
+	int i, ret;
+	struct smi_frame frame[val_length / 2 + 1];
 
-		// receive data
-		ret = ftdi_read_data(&mpsse->ftdi, data, 132);
-		if (ret < 0) {
-			fprintf(stderr, "SMI: read data failed (ret = %d)!\n", ret);
-			return ret;
-		}
+	for (i = 0; i <= val_length / 2; i++) {
+		frame[i].address = address + i;
+		frame[i].write = 0;
+	}
 
-		for (j = 0; j < 16; j++) {
-			idx = (50 + j) * 2;
-			pos = i * 2 + 1 - (j / 8);
-			*(value + pos) = (*(value + pos) << 1) | !!(data[idx] & PIN_MDI);
-		}
+	ret = smi_transfer(mpsse, frame, val_length / 2 + 1);
+	if (ret != MPSSE_OK)
+		return ret;
+
+	for (i = 0; i < val_length / 2; i++) {
+		*(value + i * 2) = frame[i + 1].value & 0xFF;
+		*(value + i * 2 + 1) = frame[i + 1].value >> 8;
 	}
 
 	return MPSSE_OK;
@@ -176,8 +385,8 @@ int smi_read(struct mpsse_context *mpsse,
  * @param	mpsse		MPSSE structure.
  * @param	address		Register address.
  * @param	addr_length	Register address length.
- * @param	value		Read value.
- * @param	val_length	Number of bytes need to read.
+ * @param	value		Value need to write.
+ * @param	val_length	Number of bytes need to write.
  *
  * @return	MPSSE_OK on success.
  *		MPSSE_FAIL on failure.
@@ -188,20 +397,14 @@ int smi_write(struct mpsse_context *mpsse,
 	      uint8_t *value,
 	      uint8_t val_length)
 {
-	int i, ret = 0;
-	uint8_t data[132];
+	int i;
+	struct smi_frame frame[val_length / 2 + 1];
 
 	for (i = 0; i < val_length / 2; i++) {
-		// prepare for data
-		smi_generate_write(data, address + i, (uint16_t *)(value + i * 2));
-
-		// send data
-		ret = ftdi_write_data(&mpsse->ftdi, data, 132);
-		if (ret < 0) {
-			fprintf(stderr, "SMI: write data failed (ret = %d)!\n", ret);
-			return ret;
-		}
+		frame[i].address = address + i;
+		frame[i].value = *(value + i * 2) | (*(value + i * 2 + 1) << 8);
+		frame[i].write = 1;
 	}
 
-	return MPSSE_OK;
+	return smi_transfer(mpsse, frame, val_length / 2);
 }
@@ -6,64 +6,374 @@
  * published by the Free Software Foundation.
  */
 #include "spi.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * The SPI lines are driven in synchronous bit-bang mode. A whole transfer
+ * (address phase, strobe and data clocks) is built as one sample buffer.
+ * Every written sample returns the pin state read just before it was
+ * applied, so MISO after a falling SCK edge is found in the echo of the
+ * following sample. As for SMI, the echo is read with a transfer queued
+ * before the write goes out, so the chip never stalls on a full receive
+ * FIFO and the whole buffer costs one USB write and one USB read.
+ *
+ * Each SCK level is held for 1 + hold samples, hold is set per device by
+ * spi_init. The gaps the CPLD needs
+ * after the strobe are idle samples instead of usleep calls. Address and
+ * data bytes come from a byte to samples table instead of being shifted
+ * out bit by bit.
+ *
+ * A batch of transfers is built the same way, one after the other in the
+ * same sample buffer.
+ */
+
+static pthread_once_t spi_once = PTHREAD_ONCE_INIT;
+static uint8_t spi_lut[256][16];
+
+struct spi_wave {
+	uint8_t *out;
+	int len;
+	uint16_t hold;	/* extra samples of each SCK level */
+};
+
+/**
+ * Number of samples needed for a transfer.
+ *
+ * @param	hold	Extra samples per SCK level.
+ * @param	bits	Number of SCK clocks.
+ *
+ * @return	Upper bound of samples.
+ */
+static int spi_samples(uint16_t hold, int bits)
+{
+	/* clocks, strobe, settle time and the trailing sample */
+	return (bits + 1) * 2 * (1 + hold) + SPI_SETTLE + 1;
+}
+
+/**
+ * Build the byte to samples table: eight SCK clocks, MSB first, one
+ * sample per level and SSTBZ high.
+ */
+static void spi_build_lut(void)
+{
+	int i, j;
+	uint8_t pins;
+
+	for (i = 0; i < 256; i++) {
+		for (j = 0; j < 8; j++) {
+			pins = ((i << j) & 0x80 ? PIN_MOSI : 0) | PIN_SSTBZ;
+			spi_lut[i][2 * j] = pins | PIN_SCK;
+			spi_lut[i][2 * j + 1] = pins;
+		}
+	}
+}
+
+static void spi_put(struct spi_wave *wave, uint8_t pins, int count)
+{
+	memset(wave->out + wave->len, pins, count);
+	wave->len += count;
+}
+
+/**
+ * Append one SCK clock: HIGH then LOW, both held for 1 + hold samples.
+ */
+static void spi_clock(struct spi_wave *wave, uint8_t pins)
+{
+	spi_put(wave, pins | PIN_SCK, 1 + wave->hold);
+	spi_put(wave, pins, 1 + wave->hold);
+}
+
+/**
+ * Append eight clocks with SSTBZ high shifting out one byte, MSB first.
+ */
+static void spi_byte(struct spi_wave *wave, uint8_t byte)
+{
+	int i;
+
+	if (wave->hold == 0) {
+		memcpy(wave->out + wave->len, spi_lut[byte], 16);
+		wave->len += 16;
+		return;
+	}
+
+	for (i = 0; i < 16; i++)
+		spi_put(wave, spi_lut[byte][i], 1 + wave->hold);
+}
+
+static void spi_address(struct spi_wave *wave, uint64_t address, uint8_t addr_length)
+{
+	int i;
+
+	for (i = addr_length - 1; i >= 0; i--)
+		spi_byte(wave, address >> (8 * i));
+}
+
+/**
+ * Send samples and collect their echo.
+ *
+ * @param	mpsse	MPSSE structure.
+ * @param	out	Samples to send.
+ * @param	in	Echoed samples.
+ * @param	len	Number of samples.
+ *
+ * @return	MPSSE_OK on success.
+ *		MPSSE_FAIL on failure.
+ */
+static int spi_transfer(struct mpsse_context *mpsse, uint8_t *out, uint8_t *in, int len)
+{
+#if LIBFTDI1 == 1
+	struct ftdi_transfer_control *rtc, *wtc;
+	struct timeval tv = { 1, 0 };
+	int ret;
+
+	rtc = ftdi_read_data_submit(&mpsse->ftdi, in, len);
+	if (rtc == NULL) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "SPI: submit read failed!");
+		return MPSSE_FAIL;
+	}
+
+	wtc = ftdi_write_data_submit(&mpsse->ftdi, out, len);
+	if (wtc == NULL) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "SPI: submit write failed!");
+		ftdi_transfer_data_cancel(rtc, &tv);
+		return MPSSE_FAIL;
+	}
+
+	ret = ftdi_transfer_data_done(wtc);
+	if (ret != len) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "SPI: send data failed (ret = %d)!", ret);
+		ftdi_transfer_data_cancel(rtc, &tv);
+		return MPSSE_FAIL;
+	}
+
+	ret = ftdi_transfer_data_done(rtc);
+	if (ret != len) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "SPI: read data failed (ret = %d)!", ret);
+		return MPSSE_FAIL;
+	}
+#else
+	int start, size, n, ret;
+
+	/* 128 samples at a time, the receive FIFO cannot hold more */
+	for (start = 0; start < len; start += size) {
+		size = (len - start < 128) ? len - start : 128;
+
+		ret = ftdi_write_data(&mpsse->ftdi, out + start, size);
+		if (ret != size) {
+			cpld_log(NULL, CPLD_LOG_ERROR, "SPI: send data failed (ret = %d)!", ret);
+			return MPSSE_FAIL;
+		}
+
+		for (n = 0; n < size; n += ret) {
+			ret = ftdi_read_data(&mpsse->ftdi, in + start + n, size - n);
+			if (ret < 0) {
+				cpld_log(NULL, CPLD_LOG_ERROR, "SPI: read data failed (ret = %d)!", ret);
+				return MPSSE_FAIL;
+			}
+		}
+	}
+#endif
+
+	return MPSSE_OK;
+}
 
 /**
  * Initialize SPI protocol.
  *
  * @param	mpsse	MPSSE structure.
+ * @param	hold	Extra samples each SCK level is held for, at most
+ *			SPI_HOLD_MAX.
  *
  * @return	MPSSE_OK on success.
  *		MPSSE_FAIL on failure.
  */
-int spi_init(struct mpsse_context *mpsse)
+int spi_init(struct mpsse_context *mpsse, uint16_t hold)
 {
-	int i, ret;
-	uint8_t bit;
-	uint8_t addr = 0xfe;
-	uint8_t dat[2 * 32];
-	uint8_t cmd[(2 * 8) + 2];
+	int ret;
+	uint8_t dat[64];
+	uint8_t buf[spi_samples(SPI_HOLD_MAX, 32 + 8) + SPI_SETTLE], echo[sizeof(buf)];
+	struct spi_wave wave = { buf, 0, hold };
+
+	if (hold > SPI_HOLD_MAX)
+		return MPSSE_FAIL;
+	mpsse->spi_hold = hold;
 
 	/* Setup MOSI, SCK, SSTBZ as output */
 	mpsse->bitbang = PIN_MOSI | PIN_SCK | PIN_SSTBZ;
-	SetDirection(mpsse, mpsse->bitbang);
+	ret = ftdi_set_bitmode(&(mpsse->ftdi), mpsse->bitbang, BITMODE_SYNCBB);
+	if (ret < 0) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "SPI: enable synchronous bit-bang failed (ret = %d)!", ret);
+		return MPSSE_FAIL;
+	}
 	ftdi_set_baudrate(&(mpsse->ftdi), 57600);
 
+	/* Drop anything left from the asynchronous mode */
+	while ((ret = ftdi_read_data(&mpsse->ftdi, dat, sizeof(dat))) > 0)
+		;
+
+	pthread_once(&spi_once, spi_build_lut);
+
 	/* Do this to somehow synchronize the CPLD and let it communicate. */
-	for (i = 0; i < 32; i++) {
-		dat[(2 * i) + 0] = PIN_SSTBZ | PIN_SCK;
-		dat[(2 * i) + 1] = PIN_SSTBZ;
+	spi_address(&wave, 0x00000001, 4);
+	spi_put(&wave, PIN_MOSI | PIN_SSTBZ, SPI_SETTLE);
+
+	spi_address(&wave, 0xfe, 1);
+	spi_clock(&wave, PIN_MOSI);
+	spi_put(&wave, PIN_MOSI, SPI_SETTLE);
+
+	ret = spi_transfer(mpsse, buf, echo, wave.len);
+	if (ret == MPSSE_FAIL)
+		cpld_log(NULL, CPLD_LOG_ERROR, "SPI: send command failed!");
+
+	return ret;
+}
+
+/**
+ * Number of samples of a transfer.
+ */
+static int spi_size(uint16_t hold, const struct bus_op *op)
+{
+	int size = spi_samples(hold, 8 * (op->addr_length + op->val_length));
+
+	return op->type == BUS_WRITE ? size + SPI_SETTLE : size;
+}
+
+/**
+ * Append the samples of one transfer.
+ *
+ * @param	wave	Sample buffer.
+ * @param	op	Transfer.
+ *
+ * @return	Sample of the first data bit of a read.
+ */
+static int spi_compile(struct spi_wave *wave, const struct bus_op *op)
+{
+	int i, data;
+
+	if (op->type == BUS_WRITE) {
+		/* Data goes first, most significant byte first */
+		for (i = op->val_length - 1; i > -1; i--)
+			spi_byte(wave, *(op->value + i));
+		spi_put(wave, (*op->value & 0x01 ? PIN_MOSI : 0) | PIN_SSTBZ, SPI_SETTLE);
+
+		/* Address and write strobe */
+		spi_address(wave, op->address, op->addr_length);
+		spi_clock(wave, PIN_MOSI);
+		spi_put(wave, PIN_MOSI, SPI_SETTLE);
+		return 0;
 	}
 
-	dat[(2 * 31) + 0] = PIN_MOSI | PIN_SSTBZ | PIN_SCK;
-	dat[(2 * 31) + 1] = PIN_MOSI | PIN_SSTBZ;
+	spi_address(wave, op->address, op->addr_length);
+
+	/* Strobe the read, then give the CPLD time to fetch the register */
+	spi_clock(wave, 0);
+	spi_put(wave, 0, SPI_SETTLE);
 
-	ret = Write(mpsse, (char *)dat, sizeof(dat));
-	if (ret == MPSSE_FAIL) {
-		fprintf(stderr, "SPI: send data failed!\n");
-		return ret;
+	/* Clock the data out with MOSI low */
+	data = wave->len;
+	for (i = 0; i < op->val_length; i++)
+		spi_byte(wave, 0x00);
+	spi_put(wave, PIN_SSTBZ, 1);
+
+	return data;
+}
+
+/**
+ * Take the data of a read from the echo.
+ */
+static void spi_decode(const uint8_t *in, int data, uint16_t hold, struct bus_op *op)
+{
+	int i, j;
+	int bit = 2 * (1 + hold);
+
+	/* MISO after the falling edge of a bit is the echo of the next sample */
+	for (i = op->val_length - 1; i > -1; i--) {
+		*(op->value + i) = 0;
+		for (j = 0; j < 8; j++, data += bit)
+			*(op->value + i) = (*(op->value + i) << 1) | !!(in[data + bit] & PIN_MISO);
 	}
+}
 
-	/* Wait a bit after writing data, otherwise bad things happen */
-	usleep(100);
+/**
+ * Send transfers in one sample buffer and decode them.
+ *
+ * @param	mpsse	MPSSE structure.
+ * @param	op	Transfers, no delays.
+ * @param	count	Number of transfers.
+ * @param	size	Number of samples.
+ *
+ * @return	0 if every transfer succeeded.
+ */
+static uint8_t spi_run(struct mpsse_context *mpsse, struct bus_op *op, int count, int size)
+{
+	int i, failed;
+	int data[count];
+	uint8_t stack[2 * SPI_STACK], *out = stack, *in;
+	struct spi_wave wave;
 
-	for (i = 0; i < 8; i++) {
-		bit = (addr & (1 << 7)) ? PIN_MOSI : 0;
-		cmd[(2 * i) + 0] = bit | PIN_SSTBZ | PIN_SCK;
-		cmd[(2 * i) + 1] = bit | PIN_SSTBZ;
-		addr <<= 1;
+	if (size > SPI_STACK) {
+		out = malloc(2 * size);
+		if (out == NULL) {
+			cpld_log(NULL, CPLD_LOG_ERROR, "SPI: no memory for %d samples!", size);
+			for (i = 0; i < count; i++)
+				op[i].status = (uint8_t)MPSSE_FAIL;
+			return (uint8_t)MPSSE_FAIL;
+		}
 	}
+	in = out + size;
+	wave.out = out;
+	wave.len = 0;
+	wave.hold = mpsse->spi_hold;
+
+	pthread_once(&spi_once, spi_build_lut);
 
-	cmd[(2 * 8) + 0] = PIN_MOSI | PIN_SCK;
-	cmd[(2 * 8) + 1] = PIN_MOSI;
+	for (i = 0; i < count; i++)
+		data[i] = spi_compile(&wave, &op[i]);
 
-	ret = Write(mpsse, (char *)cmd, sizeof(cmd));
-	if (ret == MPSSE_FAIL) {
-		fprintf(stderr, "SPI: send command failed!\n");
-		return ret;
+	failed = (spi_transfer(mpsse, out, in, wave.len) != MPSSE_OK);
+
+	for (i = 0; i < count; i++) {
+		op[i].status = failed ? (uint8_t)MPSSE_FAIL : 0;
+		if (!failed && op[i].type == BUS_READ)
+			spi_decode(in, data[i], wave.hold, &op[i]);
 	}
 
-	/* Wait a bit after writing data, otherwise bad things happen */
-	usleep(100);
+	if (out != stack)
+		free(out);
+	return failed ? (uint8_t)MPSSE_FAIL : 0;
+}
+
+/**
+ * Run a list of transfers. The transfers between two delays go out as one
+ * sample buffer, delays are waited out on the host.
+ *
+ * @param	mpsse	MPSSE structure.
+ * @param	op	Transfers and delays, status is filled in.
+ * @param	count	Number of entries.
+ *
+ * @return	0 if every transfer succeeded.
+ */
+uint8_t spi_batch(struct mpsse_context *mpsse, struct bus_op *op, int count)
+{
+	int i, start, size;
+	uint8_t ret = 0;
+
+	for (start = 0; start < count; start = i) {
+		if (op[start].type == BUS_DELAY) {
+			usleep(op[start].delay_us);
+			op[start].status = 0;
+			i = start + 1;
+			continue;
+		}
+
+		for (i = start, size = 0; i < count && op[i].type != BUS_DELAY; i++)
+			size += spi_size(mpsse->spi_hold, &op[i]);
+
+		ret |= spi_run(mpsse, op + start, i - start, size);
+	}
 
 	return ret;
 }
@@ -86,50 +396,14 @@ int spi_read(struct mpsse_context *mpsse,
 	     uint8_t *value,
 	     uint8_t val_length)
 {
-	int i, j, ret;
-	uint8_t bit;
-	uint8_t pin_data;
-	uint8_t cmd[(2 * 8 * addr_length) + 2];
-
-	for (i = 0; i < 8 * addr_length; i++) {
-		bit = (address & (1 << (8 * addr_length - 1))) ? PIN_MOSI : 0;
-		cmd[(2 * i) + 0] = bit | PIN_SSTBZ | PIN_SCK;
-		cmd[(2 * i) + 1] = bit | PIN_SSTBZ;
-		address <<= 1;
-	}
-
-	cmd[(2 * 8 * addr_length) + 0] = PIN_SCK;
-	cmd[(2 * 8 * addr_length) + 1] = 0;
-
-	ret = Write(mpsse, (char *)cmd, sizeof(cmd));
-	if (ret == MPSSE_FAIL) {
-		fprintf(stderr, "SPI: send command failed!\n");
-		return ret;
-	}
-
-	/* Wait a bit after writing data, otherwise bad things happen */
-	usleep(100);
-
-	/* Read data */
-	for (i = val_length - 1; i > -1; i--) {
-		for (j = 0; j < 8; j++) {
-			cmd[(2 * 0) + 0] = PIN_SSTBZ | PIN_SCK;
-			cmd[(2 * 0) + 1] = PIN_SSTBZ;
-			ret = Write(mpsse, (char *)cmd, 2);
-			if (ret == MPSSE_FAIL) {
-				fprintf(stderr, "SPI: send command failed!\n");
-				return ret;
-			}
-
-			/* Wait a bit after writing data, otherwise bad things happen */
-			usleep(100);
+	struct bus_op op = { BUS_READ, address, addr_length, value, val_length, 0, 0 };
 
-			pin_data = ReadPins(mpsse);
-			*(value + i) = (*(value + i) << 1) | !!(pin_data & PIN_MISO);
-		}
+	if (spi_batch(mpsse, &op, 1) != 0) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "SPI: send command failed!");
+		return MPSSE_FAIL;
 	}
 
-	return ret;
+	return MPSSE_OK;
 }
 
 /**
@@ -150,53 +424,12 @@ int spi_write(struct mpsse_context *mpsse,
 	      uint8_t *value,
 	      uint8_t val_length)
 {
-	int i, j, ret;
-	uint8_t *dat = NULL;
-	uint8_t bit, idx_bit = 0;
-	uint8_t cmd[(2 * 8 * addr_length) + 2];
-
-	dat = (uint8_t *)malloc(2 * val_length * 8 * sizeof(uint8_t));
-
-	for (i = val_length - 1; i > -1; i--) {
-		for (j = 0; j < 8; j++) {
-			bit = (*(value + i) & (1 << 7)) ? PIN_MOSI : 0;
-			*(dat + (2 * idx_bit) + 0) = bit | PIN_SSTBZ | PIN_SCK;
-			*(dat + (2 * idx_bit) + 1) = bit | PIN_SSTBZ;
-			*(value + i) = *(value + i) << 1;
-			idx_bit++;
-		}
-	}
+	struct bus_op op = { BUS_WRITE, address, addr_length, value, val_length, 0, 0 };
 
-	ret = Write(mpsse, (char *)dat, 2 * val_length * 8);
-	if (ret == MPSSE_FAIL) {
-		fprintf(stderr, "SPI: send data failed!\n");
-		free(dat);
-		return ret;
+	if (spi_batch(mpsse, &op, 1) != 0) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "SPI: send data failed!");
+		return MPSSE_FAIL;
 	}
 
-	/* Wait a bit after writing data, otherwise bad things happen */
-	usleep(100);
-
-	for (i = 0; i < 8 * addr_length; i++) {
-		bit = (address & (1 << (8 * addr_length - 1))) ? PIN_MOSI : 0;
-		cmd[(2 * i) + 0] = bit | PIN_SSTBZ | PIN_SCK;
-		cmd[(2 * i) + 1] = bit | PIN_SSTBZ;
-		address <<= 1;
-	}
-
-	cmd[(2 * 8 * addr_length) + 0] = PIN_MOSI | PIN_SCK;
-	cmd[(2 * 8 * addr_length) + 1] = PIN_MOSI;
-
-	ret = Write(mpsse, (char *)cmd, sizeof(cmd));
-	if (ret == MPSSE_FAIL) {
-		fprintf(stderr, "SPI: send command failed!\n");
-		free(dat);
-		return ret;
-	}
-
-	/* Wait a bit after writing data, otherwise bad things happen */
-	usleep(100);
-
-	free(dat);
-	return ret;
+	return MPSSE_OK;
 }
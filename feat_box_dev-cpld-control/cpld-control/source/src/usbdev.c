@@ -0,0 +1,616 @@
+/**
+ * Copyright (C) 2020 Renesas Electronics Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include "usbdev.h"
+#include "cpld.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * FTDI device discovery.
+ *
+ * The bus is enumerated once through libusb and every FTDI device found is
+ * remembered with its serial, bus number, device address and port path.
+ * The serial string descriptor is read only the first time a device is
+ * seen; later lookups are answered from the cache, and the device is opened
+ * by bus/address so libftdi does not enumerate again.
+ *
+ * The cache is a fixed table of slots hashed by serial, so a lookup costs
+ * the same with 2 or 200 boards attached.
+ *
+ * Without the hotplug monitor, a replugged device gets a new address and
+ * its stale entry fails to open. The caller then drops it with
+ * cpld_usb_forget and looks the serial up again. With the monitor running
+ * (cpld_usb_monitor_start), libusb hotplug events keep the table current:
+ * arrivals are read by the event thread and removals drop the entry and
+ * flag every CPLD attached to that device.
+ *
+ * The hotplug callback may run in any thread that handles libusb events,
+ * including one doing synchronous I/O with cpld_usb_lock held. It therefore
+ * never takes cpld_usb_lock: it only queues the event, and the monitor
+ * thread applies the queue between two rounds of event handling.
+ */
+
+struct cpld_usb_slot {
+	struct cpld_usb_device dev;
+	int used;
+	int next;	/* next slot in the hash chain, -1 at the end */
+};
+
+struct cpld_usb_attach {
+	uint8_t bus;
+	uint8_t address;
+	int *removed;
+};
+
+struct cpld_usb_event {
+	libusb_device *usb;	/* referenced until the event is applied */
+	uint8_t arrived;	/* 1 on arrival, 0 on removal */
+};
+
+static pthread_mutex_t cpld_usb_lock = PTHREAD_MUTEX_INITIALIZER;
+static libusb_context *cpld_usb_ctx;
+static struct cpld_usb_slot cpld_usb_slot[CPLD_USB_MAX];
+static int cpld_usb_bucket[CPLD_USB_HASH];
+static int cpld_usb_ready;
+
+/* Open CPLDs to flag when their device goes away */
+static struct cpld_usb_attach cpld_usb_attached[CPLD_USB_MAX];
+
+/* Hotplug monitor */
+static libusb_hotplug_callback_handle cpld_usb_hotplug;
+static pthread_t cpld_usb_thread;
+static int cpld_usb_monitoring;
+
+/* Hotplug events not applied yet, the lock is never held across libusb calls */
+static pthread_mutex_t cpld_usb_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cpld_usb_event cpld_usb_queue[CPLD_USB_MAX];
+static int cpld_usb_queued;
+
+static int cpld_usb_known(uint16_t product)
+{
+	return product == FT232R || product == FT2232 ||
+	       product == FT4232 || product == FT232H;
+}
+
+static int cpld_usb_init(void)
+{
+	int i, ret;
+
+	if (!cpld_usb_ready) {
+		for (i = 0; i < CPLD_USB_HASH; i++)
+			cpld_usb_bucket[i] = -1;
+		cpld_usb_ready = 1;
+	}
+
+	if (cpld_usb_ctx != NULL)
+		return 0;
+
+	ret = libusb_init(&cpld_usb_ctx);
+	if (ret < 0) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "libusb: Initialized failed!");
+		cpld_usb_ctx = NULL;
+	}
+	return ret;
+}
+
+static unsigned int cpld_usb_hash(const char *serial)
+{
+	unsigned int hash = 5381;
+
+	while (*serial)
+		hash = hash * 33 + (unsigned char)*serial++;
+
+	return hash % CPLD_USB_HASH;
+}
+
+static struct cpld_usb_device *cpld_usb_lookup(uint16_t product, const char *serial)
+{
+	int i;
+
+	if (!cpld_usb_ready)
+		return NULL;
+
+	for (i = cpld_usb_bucket[cpld_usb_hash(serial)]; i >= 0; i = cpld_usb_slot[i].next)
+		if (cpld_usb_slot[i].dev.product == product && !cpld_usb_slot[i].dev.failed &&
+		    !strcmp(cpld_usb_slot[i].dev.serial, serial))
+			return &cpld_usb_slot[i].dev;
+
+	return NULL;
+}
+
+static int cpld_usb_find_slot(uint8_t bus, uint8_t address)
+{
+	int i;
+
+	for (i = 0; i < CPLD_USB_MAX; i++)
+		if (cpld_usb_slot[i].used && cpld_usb_slot[i].dev.bus == bus &&
+		    cpld_usb_slot[i].dev.address == address)
+			return i;
+
+	return -1;
+}
+
+static void cpld_usb_remove(int index)
+{
+	int *pp;
+
+	for (pp = &cpld_usb_bucket[cpld_usb_hash(cpld_usb_slot[index].dev.serial)];
+	     *pp >= 0; pp = &cpld_usb_slot[*pp].next) {
+		if (*pp == index) {
+			*pp = cpld_usb_slot[index].next;
+			break;
+		}
+	}
+	cpld_usb_slot[index].used = 0;
+}
+
+/**
+ * Read the serial of a new device and add it to the table. A device whose
+ * serial cannot be read is added as failed, so that a scan reports it.
+ * Called with cpld_usb_lock held.
+ *
+ * @param	usb	libusb device.
+ * @param	desc	Its device descriptor.
+ *
+ * @return	Added entry, NULL if the table is full.
+ */
+static struct cpld_usb_device *cpld_usb_add(struct libusb_device *usb,
+					    struct libusb_device_descriptor *desc)
+{
+	struct cpld_usb_device *dev;
+	libusb_device_handle *handle;
+	unsigned int hash;
+	int i, ret;
+
+	for (i = 0; i < CPLD_USB_MAX; i++)
+		if (!cpld_usb_slot[i].used)
+			break;
+	if (i == CPLD_USB_MAX)
+		return NULL;
+
+	dev = &cpld_usb_slot[i].dev;
+	memset(dev, 0, sizeof(*dev));
+	dev->vendor = desc->idVendor;
+	dev->product = desc->idProduct;
+	dev->bus = libusb_get_bus_number(usb);
+	dev->address = libusb_get_device_address(usb);
+	ret = libusb_get_port_numbers(usb, dev->port, CPLD_USB_PORTS);
+	dev->port_depth = ret < 0 ? 0 : ret;
+
+	if (desc->iSerialNumber != 0) {
+		if (libusb_open(usb, &handle) < 0) {
+			dev->failed = 1;
+		} else {
+			ret = libusb_get_string_descriptor_ascii(handle, desc->iSerialNumber,
+								 (unsigned char *)dev->serial,
+								 sizeof(dev->serial));
+			libusb_close(handle);
+			dev->failed = ret < 0;
+		}
+		if (dev->failed)
+			dev->serial[0] = '\0';
+	}
+
+	hash = cpld_usb_hash(dev->serial);
+	cpld_usb_slot[i].used = 1;
+	cpld_usb_slot[i].next = cpld_usb_bucket[hash];
+	cpld_usb_bucket[hash] = i;
+	return dev;
+}
+
+/**
+ * Enumerate the bus once and update the cache. Entries of devices that are
+ * gone are dropped, new devices of the product get their serial read.
+ * Called with cpld_usb_lock held.
+ *
+ * @param	product	Product ID to look for, 0 for all products in cpld.h.
+ * @param	serial	Stop after this serial is found, NULL to read all.
+ *
+ * @return	0 on success, libusb error code on failure.
+ */
+static int cpld_usb_discover(uint16_t product, const char *serial)
+{
+	struct libusb_device **list, *usb;
+	struct libusb_device_descriptor desc;
+	struct cpld_usb_device *dev;
+	uint8_t present[CPLD_USB_MAX] = { 0 };
+	int i, j, ret;
+
+	ret = cpld_usb_init();
+	if (ret < 0)
+		return ret;
+
+	ret = libusb_get_device_list(cpld_usb_ctx, &list);
+	if (ret < 0) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "libusb: Get list of device failed!");
+		return ret;
+	}
+
+	/* Forget devices that left the bus */
+	for (i = 0; (usb = list[i]) != NULL; i++) {
+		j = cpld_usb_find_slot(libusb_get_bus_number(usb), libusb_get_device_address(usb));
+		if (j >= 0)
+			present[j] = 1;
+	}
+	for (j = 0; j < CPLD_USB_MAX; j++)
+		if (cpld_usb_slot[j].used && !present[j])
+			cpld_usb_remove(j);
+
+	for (i = 0; (usb = list[i]) != NULL; i++) {
+		/* The device descriptor is cached by libusb, no bus traffic */
+		if (libusb_get_device_descriptor(usb, &desc) < 0)
+			continue;
+		if (desc.idVendor != VENDOR ||
+		    (product ? desc.idProduct != product : !cpld_usb_known(desc.idProduct)))
+			continue;
+		j = cpld_usb_find_slot(libusb_get_bus_number(usb), libusb_get_device_address(usb));
+		if (j >= 0 && !cpld_usb_slot[j].dev.failed)
+			continue;
+		if (j >= 0)
+			cpld_usb_remove(j);
+
+		dev = cpld_usb_add(usb, &desc);
+		if (serial != NULL && dev != NULL && !strcmp(dev->serial, serial))
+			break;
+	}
+
+	libusb_free_device_list(list, 1);
+	return 0;
+}
+
+/**
+ * Find a device by serial, enumerating the bus only on a cache miss.
+ *
+ * @param	product	Product ID.
+ * @param	serial	FTDI iSerial.
+ * @param	dev	Device found.
+ *
+ * @return	0 on success, -1 if no such device.
+ */
+int cpld_usb_find(uint16_t product, const char *serial, struct cpld_usb_device *dev)
+{
+	struct cpld_usb_device *found;
+
+	pthread_mutex_lock(&cpld_usb_lock);
+	found = cpld_usb_lookup(product, serial);
+	if (found == NULL && cpld_usb_discover(product, serial) == 0)
+		found = cpld_usb_lookup(product, serial);
+	if (found != NULL)
+		*dev = *found;
+	pthread_mutex_unlock(&cpld_usb_lock);
+
+	return found != NULL ? 0 : -1;
+}
+
+/**
+ * Enumerate all devices of a product.
+ *
+ * @param	product	Product ID, 0 for all products in cpld.h.
+ * @param	dev	Array to store the devices.
+ * @param	max	Number of entries in dev.
+ *
+ * @return	Number of devices, -1 on failure.
+ */
+int cpld_usb_scan(uint16_t product, struct cpld_usb_device *dev, int max)
+{
+	int i, count = 0;
+
+	pthread_mutex_lock(&cpld_usb_lock);
+	if (cpld_usb_discover(product, NULL) != 0) {
+		pthread_mutex_unlock(&cpld_usb_lock);
+		return -1;
+	}
+	for (i = 0; i < CPLD_USB_MAX && count < max; i++)
+		if (cpld_usb_slot[i].used &&
+		    (product == 0 || cpld_usb_slot[i].dev.product == product))
+			dev[count++] = cpld_usb_slot[i].dev;
+	pthread_mutex_unlock(&cpld_usb_lock);
+
+	return count;
+}
+
+/**
+ * Drop a device from the cache, e.g. after it failed to open.
+ *
+ * @param	dev	Device to forget.
+ *
+ * @return	None.
+ */
+void cpld_usb_forget(const struct cpld_usb_device *dev)
+{
+	int i;
+
+	pthread_mutex_lock(&cpld_usb_lock);
+	i = cpld_usb_find_slot(dev->bus, dev->address);
+	if (i >= 0)
+		cpld_usb_remove(i);
+	pthread_mutex_unlock(&cpld_usb_lock);
+}
+
+/**
+ * Format the physical location of a device as "<bus>-<port>.<port>...",
+ * the same naming as /sys/bus/usb/devices.
+ *
+ * @param	dev	Device.
+ * @param	buf	Output buffer.
+ * @param	size	Size of buf.
+ *
+ * @return	None.
+ */
+void cpld_usb_port(const struct cpld_usb_device *dev, char *buf, int size)
+{
+	int i, n;
+
+	n = snprintf(buf, size, "%d", dev->bus);
+	for (i = 0; i < dev->port_depth && n < size; i++)
+		n += snprintf(buf + n, size - n, "%c%d", i ? '.' : '-', dev->port[i]);
+}
+
+static void *cpld_usb_reset_one(void *handle)
+{
+	libusb_reset_device(handle);
+	return NULL;
+}
+
+/**
+ * Reset every FT4232 that came up without a serial string. All resets are
+ * issued at once and the re-enumeration is waited for only once.
+ *
+ * @param	None.
+ *
+ * @return	Number of devices reset, libusb error code on failure.
+ */
+int cpld_usb_reset_unnamed(void)
+{
+	struct libusb_device **list, *usb;
+	struct libusb_device_descriptor desc;
+	libusb_device_handle *handle[CPLD_USB_MAX];
+	pthread_t thread[CPLD_USB_MAX];
+	uint8_t threaded[CPLD_USB_MAX];
+	int i, count = 0, ret;
+
+	pthread_mutex_lock(&cpld_usb_lock);
+	ret = cpld_usb_init();
+	if (ret < 0)
+		goto out;
+
+	ret = libusb_get_device_list(cpld_usb_ctx, &list);
+	if (ret < 0) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "libusb: Get list of device failed!");
+		goto out;
+	}
+
+	for (i = 0; (usb = list[i]) != NULL && count < CPLD_USB_MAX; i++) {
+		if (libusb_get_device_descriptor(usb, &desc) < 0)
+			continue;
+		if (desc.idVendor != VENDOR || desc.idProduct != FT4232 ||
+		    desc.iSerialNumber != 0)
+			continue;
+
+		if (libusb_open(usb, &handle[count]) < 0) {
+			cpld_log(NULL, CPLD_LOG_ERROR, "libusb: Cannot open usb device!");
+			continue;
+		}
+		count++;
+	}
+	libusb_free_device_list(list, 1);
+
+	/* libusb_reset_device blocks, run them side by side */
+	for (i = 0; i < count; i++) {
+		threaded[i] = pthread_create(&thread[i], NULL, cpld_usb_reset_one,
+					     handle[i]) == 0;
+		if (!threaded[i])
+			libusb_reset_device(handle[i]);
+	}
+	for (i = 0; i < count; i++) {
+		if (threaded[i])
+			pthread_join(thread[i], NULL);
+		libusb_close(handle[i]);
+	}
+
+	/* One settle time for all of them to come back */
+	if (count > 0)
+		usleep(300000);
+	ret = count;
+out:
+	pthread_mutex_unlock(&cpld_usb_lock);
+	return ret;
+}
+
+/**
+ * Watch a device for removal. *removed is set to 1, atomically, by the
+ * hotplug monitor when the device leaves the bus.
+ *
+ * @param	dev	Device of the CPLD.
+ * @param	removed	Flag of the CPLD.
+ *
+ * @return	None.
+ */
+void cpld_usb_attach(const struct cpld_usb_device *dev, int *removed)
+{
+	int i;
+
+	pthread_mutex_lock(&cpld_usb_lock);
+	for (i = 0; i < CPLD_USB_MAX; i++) {
+		if (cpld_usb_attached[i].removed == NULL) {
+			cpld_usb_attached[i].bus = dev->bus;
+			cpld_usb_attached[i].address = dev->address;
+			cpld_usb_attached[i].removed = removed;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cpld_usb_lock);
+}
+
+/**
+ * Stop watching a CPLD.
+ *
+ * @param	removed	Flag passed to cpld_usb_attach.
+ *
+ * @return	None.
+ */
+void cpld_usb_detach(int *removed)
+{
+	int i;
+
+	pthread_mutex_lock(&cpld_usb_lock);
+	for (i = 0; i < CPLD_USB_MAX; i++)
+		if (cpld_usb_attached[i].removed == removed)
+			cpld_usb_attached[i].removed = NULL;
+	pthread_mutex_unlock(&cpld_usb_lock);
+}
+
+/**
+ * Hotplug callback. The event is only queued, see cpld_usb_apply. A full
+ * queue drops the event; the next enumeration then fixes the table.
+ */
+static int cpld_usb_event(libusb_context *ctx, libusb_device *usb,
+			  libusb_hotplug_event event, void *data)
+{
+	struct libusb_device_descriptor desc;
+
+	if (libusb_get_device_descriptor(usb, &desc) < 0 || !cpld_usb_known(desc.idProduct))
+		return 0;
+
+	pthread_mutex_lock(&cpld_usb_queue_lock);
+	if (cpld_usb_queued < CPLD_USB_MAX) {
+		cpld_usb_queue[cpld_usb_queued].usb = libusb_ref_device(usb);
+		cpld_usb_queue[cpld_usb_queued].arrived =
+			event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED;
+		cpld_usb_queued++;
+	}
+	pthread_mutex_unlock(&cpld_usb_queue_lock);
+
+	return 0;
+}
+
+/**
+ * Apply the queued hotplug events in order. Arrivals get their serial
+ * read and are added to the table, removals drop the entry and flag the
+ * CPLDs attached to the device.
+ */
+static void cpld_usb_apply(void)
+{
+	struct cpld_usb_event queue[CPLD_USB_MAX];
+	struct libusb_device_descriptor desc;
+	libusb_device *usb;
+	uint8_t bus, address;
+	int i, j, k, count;
+
+	pthread_mutex_lock(&cpld_usb_queue_lock);
+	count = cpld_usb_queued;
+	memcpy(queue, cpld_usb_queue, count * sizeof(queue[0]));
+	cpld_usb_queued = 0;
+	pthread_mutex_unlock(&cpld_usb_queue_lock);
+	if (count == 0)
+		return;
+
+	pthread_mutex_lock(&cpld_usb_lock);
+	for (i = 0; i < count; i++) {
+		usb = queue[i].usb;
+		bus = libusb_get_bus_number(usb);
+		address = libusb_get_device_address(usb);
+		j = cpld_usb_find_slot(bus, address);
+
+		if (queue[i].arrived) {
+			/* skip a device that left again */
+			for (k = i + 1; k < count; k++)
+				if (queue[k].usb == usb && !queue[k].arrived)
+					break;
+			if (j < 0 && k == count && libusb_get_device_descriptor(usb, &desc) == 0)
+				cpld_usb_add(usb, &desc);
+		} else {
+			if (j >= 0)
+				cpld_usb_remove(j);
+			for (j = 0; j < CPLD_USB_MAX; j++)
+				if (cpld_usb_attached[j].removed != NULL &&
+				    cpld_usb_attached[j].bus == bus &&
+				    cpld_usb_attached[j].address == address)
+					__atomic_store_n(cpld_usb_attached[j].removed, 1,
+							 __ATOMIC_RELEASE);
+		}
+		libusb_unref_device(usb);
+	}
+	pthread_mutex_unlock(&cpld_usb_lock);
+}
+
+static void *cpld_usb_monitor(void *arg)
+{
+	struct timeval tv = { 0, 200000 };
+
+	while (__atomic_load_n(&cpld_usb_monitoring, __ATOMIC_ACQUIRE)) {
+		cpld_usb_apply();
+		libusb_handle_events_timeout_completed(cpld_usb_ctx, &tv, NULL);
+	}
+	cpld_usb_apply();
+
+	return NULL;
+}
+
+/**
+ * Start tracking FTDI arrival and removal with libusb hotplug events.
+ *
+ * @param	None.
+ *
+ * @return	0 on success, -1 if hotplug is not available. The cache then
+ *		keeps working by enumeration.
+ */
+int cpld_usb_monitor_start(void)
+{
+	int ret;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return -1;
+
+	pthread_mutex_lock(&cpld_usb_lock);
+	ret = cpld_usb_init();
+	pthread_mutex_unlock(&cpld_usb_lock);
+	if (ret < 0)
+		return -1;
+
+	/* ENUMERATE queues the devices already attached */
+	ret = libusb_hotplug_register_callback(cpld_usb_ctx,
+					       LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+					       LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+					       LIBUSB_HOTPLUG_ENUMERATE, VENDOR,
+					       LIBUSB_HOTPLUG_MATCH_ANY,
+					       LIBUSB_HOTPLUG_MATCH_ANY,
+					       cpld_usb_event, NULL, &cpld_usb_hotplug);
+	if (ret < 0) {
+		cpld_log(NULL, CPLD_LOG_ERROR, "libusb: Register hotplug callback failed!");
+		return -1;
+	}
+
+	__atomic_store_n(&cpld_usb_monitoring, 1, __ATOMIC_RELEASE);
+	if (pthread_create(&cpld_usb_thread, NULL, cpld_usb_monitor, NULL) != 0) {
+		__atomic_store_n(&cpld_usb_monitoring, 0, __ATOMIC_RELEASE);
+		libusb_hotplug_deregister_callback(cpld_usb_ctx, cpld_usb_hotplug);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Stop the hotplug monitor.
+ *
+ * @param	None.
+ *
+ * @return	None.
+ */
+void cpld_usb_monitor_stop(void)
+{
+	if (!__atomic_load_n(&cpld_usb_monitoring, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&cpld_usb_monitoring, 0, __ATOMIC_RELEASE);
+	pthread_join(cpld_usb_thread, NULL);
+	libusb_hotplug_deregister_callback(cpld_usb_ctx, cpld_usb_hotplug);
+}
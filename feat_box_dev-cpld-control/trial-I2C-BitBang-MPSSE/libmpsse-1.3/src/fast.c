@@ -22,14 +22,14 @@ int fast_build_block_buffer(struct mpsse_context *mpsse, uint8_t cmd, unsigned c
 	rsize = size - 1;
 
 	/* Copy in the command for this block */
-	fast_rw_buf[i++] = cmd;
-	fast_rw_buf[i++] = (rsize & 0xFF);
-	fast_rw_buf[i++] = ((rsize >> 8) & 0xFF);
+	mpsse->fast_rw_buf[i++] = cmd;
+	mpsse->fast_rw_buf[i++] = (rsize & 0xFF);
+	mpsse->fast_rw_buf[i++] = ((rsize >> 8) & 0xFF);
 
 	/* On a write, copy the data to transmit after the command */
-	if((cmd == mpsse->tx || cmd == mpsse->txrx) && (i + size) <= sizeof(fast_rw_buf))
+	if((cmd == mpsse->tx || cmd == mpsse->txrx) && (i + size) <= sizeof(mpsse->fast_rw_buf))
 	{
-		memcpy(fast_rw_buf+i, data, size);
+		memcpy(mpsse->fast_rw_buf+i, data, size);
 
 		/* i == offset into buf */
 		i += size;
@@ -67,7 +67,7 @@ int FastWrite(struct mpsse_context *mpsse, char *data, int size)
 	
 				if(fast_build_block_buffer(mpsse, mpsse->tx, (unsigned char *) (data + n), txsize, &buf_size) == MPSSE_OK)
 				{	
-					if(raw_write(mpsse, fast_rw_buf, buf_size) == MPSSE_OK)
+					if(raw_write(mpsse, mpsse->fast_rw_buf, buf_size) == MPSSE_OK)
 					{
 						n += txsize;
 					}
@@ -121,7 +121,7 @@ int FastRead(struct mpsse_context *mpsse, char *data, int size)
 
 				if(fast_build_block_buffer(mpsse, mpsse->rx, NULL, rxsize, &data_size) == MPSSE_OK)
 				{
-					if(raw_write(mpsse, fast_rw_buf, data_size) == MPSSE_OK)
+					if(raw_write(mpsse, mpsse->fast_rw_buf, data_size) == MPSSE_OK)
 					{
 						n += raw_read(mpsse, (unsigned char *)(data+n), rxsize);
 					}
@@ -177,7 +177,7 @@ int FastTransfer(struct mpsse_context *mpsse, char *wdata, char *rdata, int size
 
 				if(build_block_buffer(mpsse, mpsse->txrx, (unsigned char *) (wdata + n), rxsize, &data_size) == MPSSE_OK)
 				{
-					if(raw_write(mpsse, fast_rw_buf, data_size) == MPSSE_OK)
+					if(raw_write(mpsse, mpsse->fast_rw_buf, data_size) == MPSSE_OK)
 					{
 						n += raw_read(mpsse, (unsigned char *)(rdata + n), rxsize);
 					}
@@ -115,7 +115,6 @@ struct mpsse_context *Open(int vid, int pid, enum modes mode, int freq, int endi
  */
 struct mpsse_context *OpenIndex(int vid, int pid, enum modes mode, int freq, int endianess, int interface, const char *description, const char *serial, int index)
 {
-	int status = 0;
 	struct mpsse_context *mpsse = NULL;
 
 	mpsse = malloc(sizeof(struct mpsse_context));
@@ -135,63 +134,52 @@ struct mpsse_context *OpenIndex(int vid, int pid, enum modes mode, int freq, int
 			/* Open the specified device */
 			if(ftdi_usb_open_desc_index(&mpsse->ftdi, vid, pid, description, serial, index) == 0)
 			{
-				mpsse->mode = mode;
-				mpsse->vid = vid;
-				mpsse->pid = pid;
-				mpsse->status = STOPPED;
-				mpsse->endianess = endianess;
+				open_setup(mpsse, vid, pid, mode, freq, endianess);
+			}
+		}
+	}
 
-				/* Set the appropriate transfer size for the requested protocol */
-				if(mpsse->mode == I2C)
-				{
-					mpsse->xsize = I2C_TRANSFER_SIZE;
-				}
-				else
-				{
-					mpsse->xsize = SPI_RW_SIZE;
-				}
-	
-				status |= ftdi_usb_reset(&mpsse->ftdi);
-				status |= ftdi_set_latency_timer(&mpsse->ftdi, LATENCY_MS);
-				status |= ftdi_write_data_set_chunksize(&mpsse->ftdi, CHUNK_SIZE);
-				status |= ftdi_read_data_set_chunksize(&mpsse->ftdi, CHUNK_SIZE);
-				status |= ftdi_set_bitmode(&mpsse->ftdi, 0, BITMODE_RESET);
+	return mpsse;
+}
 
-				if(status == 0)
-				{
-					/* Set the read and write timeout periods */
-					set_timeouts(mpsse, USB_TIMEOUT);
-					
-					if(mpsse->mode != BITBANG)
-					{
-						ftdi_set_bitmode(&mpsse->ftdi, 0, BITMODE_MPSSE);
+/* 
+ * Open device by USB bus number and device address, without reading any string descriptors.
+ *
+ * @vid         - Device vendor ID.
+ * @pid         - Device product ID.
+ * @mode        - MPSSE mode, one of enum modes.
+ * @freq        - Clock frequency to use for the specified mode.
+ * @endianess   - Specifies how data is clocked in/out (MSB, LSB).
+ * @interface   - FTDI interface to use (IFACE_A - IFACE_D).
+ * @bus         - USB bus number.
+ * @addr        - USB device address on the bus.
+ *
+ * Returns a pointer to an MPSSE context structure. 
+ * On success, mpsse->open will be set to 1.
+ * On failure, mpsse->open will be set to 0.
+ */
+struct mpsse_context *OpenBusAddr(int vid, int pid, enum modes mode, int freq, int endianess, int interface, uint8_t bus, uint8_t addr)
+{
+	struct mpsse_context *mpsse = NULL;
 
-						if(SetClock(mpsse, freq) == MPSSE_OK)
-						{
-							if(SetMode(mpsse, endianess) == MPSSE_OK)
-							{
-								mpsse->open = 1;
-
-								/* Give the chip a few mS to initialize */
-								usleep(SETUP_DELAY);
-
-								/* 
-								 * Not all FTDI chips support all the commands that SetMode may have sent.
-								 * This clears out any errors from unsupported commands that might have been sent during set up. 
-								 */
-								ftdi_usb_purge_buffers(&mpsse->ftdi);
-							}
-						}
-					}
-					else
-					{
-						/* Skip the setup functions if we're just operating in BITBANG mode */
-						if(ftdi_set_bitmode(&mpsse->ftdi, 0xFF, BITMODE_BITBANG) == 0)
-						{
-							mpsse->open = 1;
-						}
-					}
-				}
+	mpsse = malloc(sizeof(struct mpsse_context));
+	if(mpsse)
+	{
+		memset(mpsse, 0, sizeof(struct mpsse_context));
+
+		/* Legacy; flushing is no longer needed, so disable it by default. */
+		FlushAfterRead(mpsse, 0);
+
+		/* ftdilib initialization */
+		if(ftdi_init(&mpsse->ftdi) == 0)
+		{
+			/* Set the FTDI interface  */
+			ftdi_set_interface(&mpsse->ftdi, interface);
+
+			/* Open the specified device */
+			if(ftdi_usb_open_bus_addr(&mpsse->ftdi, bus, addr) == 0)
+			{
+				open_setup(mpsse, vid, pid, mode, freq, endianess);
 			}
 		}
 	}
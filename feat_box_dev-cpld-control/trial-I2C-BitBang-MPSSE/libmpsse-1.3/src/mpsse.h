@@ -170,11 +170,23 @@ struct mpsse_context
 	uint8_t txrx;
 	uint8_t tack;
 	uint8_t rack;
+	/* Bit-bang I2C: direction byte last written to the chip */
+	uint8_t bitbang_shadow;
+	/* SMI: frames after the first of a burst go without preamble */
+	uint8_t smi_short;
+	/* I2C: engine of the transactions, enum i2c_engine */
+	uint8_t i2c_engine;
+	/* SPI: extra samples each SCK level is held for */
+	uint16_t spi_hold;
+	/* Block buffer of the Fast* functions, per device so that several
+	 * devices can be driven from different threads */
+	unsigned char fast_rw_buf[SPI_RW_SIZE + CMD_SIZE];
 };
 
 struct mpsse_context *MPSSE(enum modes mode, int freq, int endianess);
 struct mpsse_context *Open(int vid, int pid, enum modes mode, int freq, int endianess, int interface, const char *description, const char *serial);
 struct mpsse_context *OpenIndex(int vid, int pid, enum modes mode, int freq, int endianess, int interface, const char *description, const char *serial, int index);
+struct mpsse_context *OpenBusAddr(int vid, int pid, enum modes mode, int freq, int endianess, int interface, uint8_t bus, uint8_t addr);
 void Close(struct mpsse_context *mpsse);
 const char *ErrorString(struct mpsse_context *mpsse);
 int SetMode(struct mpsse_context *mpsse, int endianess);
@@ -218,7 +230,6 @@ swig_string_data Transfer(struct mpsse_context *mpsse, char *data, int size);
 char *Read(struct mpsse_context *mpsse, int size);
 char *Transfer(struct mpsse_context *mpsse, char *data, int size);
 
-unsigned char fast_rw_buf[SPI_RW_SIZE + CMD_SIZE];
 int FastWrite(struct mpsse_context *mpsse, char *data, int size);
 int FastRead(struct mpsse_context *mpsse, char *data, int size);
 int FastTransfer(struct mpsse_context *mpsse, char *wdata, char *rdata, int size);
@@ -6,6 +6,7 @@
  */
 
 #include <string.h>
+#include <unistd.h>
 
 #if LIBFTDI1 == 1
 #include <libftdi1/ftdi.h>
@@ -306,3 +307,67 @@ int is_valid_context(struct mpsse_context *mpsse)
 
 	return retval;
 }
+
+/* Configures a freshly opened device for the requested mode. Sets mpsse->open on success. */
+void open_setup(struct mpsse_context *mpsse, int vid, int pid, enum modes mode, int freq, int endianess)
+{
+	int status = 0;
+
+	mpsse->mode = mode;
+	mpsse->vid = vid;
+	mpsse->pid = pid;
+	mpsse->status = STOPPED;
+	mpsse->endianess = endianess;
+
+	/* Set the appropriate transfer size for the requested protocol */
+	if(mpsse->mode == I2C)
+	{
+		mpsse->xsize = I2C_TRANSFER_SIZE;
+	}
+	else
+	{
+		mpsse->xsize = SPI_RW_SIZE;
+	}
+	
+	status |= ftdi_usb_reset(&mpsse->ftdi);
+	status |= ftdi_set_latency_timer(&mpsse->ftdi, LATENCY_MS);
+	status |= ftdi_write_data_set_chunksize(&mpsse->ftdi, CHUNK_SIZE);
+	status |= ftdi_read_data_set_chunksize(&mpsse->ftdi, CHUNK_SIZE);
+	status |= ftdi_set_bitmode(&mpsse->ftdi, 0, BITMODE_RESET);
+
+	if(status == 0)
+	{
+		/* Set the read and write timeout periods */
+		set_timeouts(mpsse, USB_TIMEOUT);
+		
+		if(mpsse->mode != BITBANG)
+		{
+			ftdi_set_bitmode(&mpsse->ftdi, 0, BITMODE_MPSSE);
+
+			if(SetClock(mpsse, freq) == MPSSE_OK)
+			{
+				if(SetMode(mpsse, endianess) == MPSSE_OK)
+				{
+					mpsse->open = 1;
+
+					/* Give the chip a few mS to initialize */
+					usleep(SETUP_DELAY);
+
+					/* 
+					 * Not all FTDI chips support all the commands that SetMode may have sent.
+					 * This clears out any errors from unsupported commands that might have been sent during set up. 
+					 */
+					ftdi_usb_purge_buffers(&mpsse->ftdi);
+				}
+			}
+		}
+		else
+		{
+			/* Skip the setup functions if we're just operating in BITBANG mode */
+			if(ftdi_set_bitmode(&mpsse->ftdi, 0xFF, BITMODE_BITBANG) == 0)
+			{
+				mpsse->open = 1;
+			}
+		}
+	}
+}
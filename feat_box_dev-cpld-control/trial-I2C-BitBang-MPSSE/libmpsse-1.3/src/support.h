@@ -13,5 +13,6 @@ int set_bits_high(struct mpsse_context *mpsse, int port);
 int set_bits_low(struct mpsse_context *mpsse, int port);
 int gpio_write(struct mpsse_context *mpsse, int pin, int direction);
 int is_valid_context(struct mpsse_context *mpsse);
+void open_setup(struct mpsse_context *mpsse, int vid, int pid, enum modes mode, int freq, int endianess);
 
 #endif